@@ -21,17 +21,58 @@
 /* Utility macro */
 #define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)	// ((a)+(b)-1)/(b) --> ROUNDUP()
 
-/* Size of bitmap (in bits) */
-#define SFS_BITMAPSIZE(nblocks) SFS_ROUNDUP(nblocks, SFS_BLOCKBITS)
+/* Block numbers are 32-bit: a volume is at most just under 2 TB */
+#define SFS_MAXBLOCKS 0xffffffffU
+
+/* A file is its direct blocks and those of one indirect block */
+#define SFS_MAXFILESIZE ((SFS_NDIRECT + SFS_DBPERIDB) * SFS_BLOCKSIZE)
+
+/* Size of bitmap (in bits); 64-bit, as it passes 2^32 near the top */
+#define SFS_BITMAPSIZE(nblocks) SFS_ROUNDUP((u_int64_t)(nblocks), SFS_BLOCKBITS)
 
 /* Size of bitmap (in blocks) */
 #define SFS_BITBLOCKS(nblocks)  (SFS_BITMAPSIZE(nblocks)/SFS_BLOCKBITS)
 
+/* Bytes of file data an inode block can hold itself */
+#define SFS_INLINESIZE    (SFS_BLOCKSIZE - 4*(4+SFS_NDIRECT))
+
+/* Inode flags for sfi_flags */
+#define SFS_IFLAG_INLINE  0x1     /* data is in sfi_inline, no data blocks */
+#define SFS_IFLAG_COMP    0x2     /* data is compressed in chunks */
+
+/*
+ * Compressed files: every SFS_CZBLOCKS block pointers make a chunk
+ * (the last may be shorter). If all of a chunk's pointers are set,
+ * it is stored as is; if none, it is a hole; if only the first k are,
+ * those k blocks hold a 4-byte length and that many bytes of
+ * compressed data (sfs_lz.h) for the whole chunk.
+ */
+#define SFS_CZBLOCKS      8
+
 /* File types for dfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
+/* Feature flags for sp_features */
+#define SFS_FEAT_NFREE    0x1     /* sp_nfree is maintained */
+#define SFS_FEAT_ITABLE   0x2     /* inodes live in a packed table */
+#define SFS_FEAT_SPARSE   0x4     /* files may have holes (0 block ptrs) */
+#define SFS_FEAT_DEDUP    0x8     /* block reference table at sp_ddt */
+#define SFS_FEAT_CSUM     0x10    /* CRC32C of every block at sp_csum */
+#define SFS_FEAT_SNAP     0x20    /* snapshot table at sp_snap */
+
+/*
+ * Packed inode table: inode n is the n-th SFS_PINODESIZE slot from
+ * sp_itable (slot 0 is unused, 1 is the root). A packed inode is the
+ * first SFS_PINODESIZE bytes of struct sfs_inode; a free slot has
+ * type SFS_TYPE_INVAL. Without SFS_FEAT_ITABLE an inode number is
+ * the block the inode lives in.
+ */
+#define SFS_PINODESIZE    128
+#define SFS_PINODEPERBLOCK (SFS_BLOCKSIZE/SFS_PINODESIZE)
+#define SFS_PINLINESIZE   (SFS_PINODESIZE - 4*(4+SFS_NDIRECT))
+
 /*
  * On-disk superblock
  */
@@ -39,7 +80,17 @@ struct sfs_super {
 	u_int32_t sp_magic;       /* Magic number, should be SFS_MAGIC */
 	u_int32_t sp_nblocks;     /* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];  /* Name of this volume */
-	u_int32_t reserved[118];
+	u_int32_t sp_features;    /* SFS_FEAT_* flags (0 on old images) */
+	u_int32_t sp_nfree;       /* Number of free blocks */
+	u_int32_t sp_itable;      /* 1st block of the inode table */
+	u_int32_t sp_ninodes;     /* Number of inode table slots */
+	u_int32_t sp_ddt;         /* 1st block of the dedup table */
+	u_int32_t sp_ddtblocks;   /* Number of dedup table blocks */
+	u_int32_t sp_csum;        /* 1st block of the checksum table */
+	u_int32_t sp_csumblocks;  /* Number of checksum table blocks */
+	u_int32_t sp_snap;        /* Block of the snapshot table */
+	u_int32_t sp_gen;         /* Bumped as changes start and end; odd meanwhile */
+	u_int32_t reserved[108];
 };
 
 /*
@@ -51,7 +102,60 @@ struct sfs_inode {
 	u_int16_t sfi_linkcount;   /* Number of hard links to this file */ /* Unused in our hw */
 	u_int32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	u_int32_t sfi_indirect;			/* Indirect block */
-	u_int32_t sfi_waste[128-3-SFS_NDIRECT]; /* unused space */
+	u_int32_t sfi_flags;			/* SFS_IFLAG_* (0 on old images) */
+	u_int8_t sfi_inline[SFS_INLINESIZE];	/* data of tiny files */
+};
+
+/*
+ * Block reference table entry, one per block. A block shared by
+ * dd_refs block pointers (data blocks, or an indirect block shared by
+ * cloned files); 0 for a block with a single owner. dd_hash is the
+ * content hash of a block dedup may share, marked SFS_DD_HASHED.
+ */
+struct sfs_ddent {
+	u_int16_t dd_refs;
+	u_int16_t dd_flags;
+	u_int32_t dd_hash;
+};
+
+#define SFS_DD_HASHED     0x1     /* dd_hash is valid, block is indexed */
+
+#define SFS_DDPERBLOCK    (SFS_BLOCKSIZE/sizeof(struct sfs_ddent))
+#define SFS_DDMAXREFS     0xffff
+
+/*
+ * Snapshots. A snapshot keeps the volume as it was when it was taken:
+ * the first time a block is written after the newest snapshot, its old
+ * contents go to a free block first, and the pair is logged for that
+ * snapshot. A snapshot's view of a block is the copy in its own log,
+ * else in the log of the next newer snapshot, and so on, else the
+ * block itself. The freemap and the dedup table are not kept.
+ *
+ * The table is one block of SFS_MAXSNAP slots; a free slot has an
+ * empty name. ss_log is the newest block of the snapshot's log, and
+ * each log block links to the one before it.
+ */
+#define SFS_MAXSNAP       8
+#define SFS_SNAPNAMELEN   40
+
+struct sfs_snap {
+	char ss_name[SFS_SNAPNAMELEN];
+	u_int32_t ss_seq;         /* order taken, from 1 */
+	u_int32_t ss_time;        /* when, seconds since the epoch */
+	u_int32_t ss_log;         /* newest log block, 0 if none */
+	u_int32_t ss_nkept;       /* blocks in the log */
+	u_int32_t ss_flags;       /* SFS_SNAP_* */
+	u_int32_t ss_pad;
+};
+
+#define SFS_SNAP_BROKEN   0x1     /* a block could not be kept, no space */
+
+#define SFS_SNAPLOGENT    ((SFS_BLOCKSIZE - 8) / 8)
+
+struct sfs_snaplog {
+	u_int32_t sl_next;        /* previous log block, 0 at the end */
+	u_int32_t sl_n;           /* pairs used */
+	u_int32_t sl_map[SFS_SNAPLOGENT][2];	/* block, where its copy is */
 };
 
 /*
@@ -0,0 +1,116 @@
+// Multi-threaded read benchmark
+//
+// Build: gcc -pthread sfs_disk.c sfs_crc32c.c sfs_lz.c sfs_func_hw.c sfs_bench.c sfs_func_ext.o -o sfs_bench
+// Usage: sfs_bench disk_img [seconds]
+//
+// Runs ls/cd on one shared mount from 1, 2, 4, ... threads and reports
+// read throughput per thread count. It creates a bench.d directory in
+// the image on first use, so run it on a scratch copy.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "sfs_func.h"
+
+#define BENCH_DIR    "bench.d"
+#define BENCH_FILES  64
+
+static struct sfs_mnt *mnt;
+static volatile int stop;
+
+struct worker {
+	pthread_t w_thread;
+	long w_ops;
+};
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	struct sfs_mnt *mp = sfs_mnt_dup(mnt);
+
+	sfs_cd_r(mp, BENCH_DIR);
+	while (!stop) {
+		sfs_ls_r(mp, NULL);
+		sfs_cd_r(mp, "..");
+		sfs_cd_r(mp, BENCH_DIR);
+		w->w_ops += 3;
+	}
+	sfs_mnt_free(mp);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int seconds = 2;
+	int ncpu, nthread, i;
+	double base = 0;
+	char name[16];
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: sfs_bench disk_img [seconds]\n");
+		return 1;
+	}
+	if (argc == 3)
+		seconds = atoi(argv[2]);
+
+	// results go to the real stdout, operation output to /dev/null
+	FILE *res = fdopen(dup(1), "w");
+	int devnull = open("/dev/null", O_WRONLY);
+	if (res == NULL || devnull < 0)
+		err(1, "stdout");
+	fflush(stdout);
+	dup2(devnull, 1);
+
+	mnt = sfs_mnt_alloc();
+	sfs_mount_r(mnt, argv[1]);
+	sfs_mkdir_r(mnt, BENCH_DIR);
+	sfs_cd_r(mnt, BENCH_DIR);
+	for (i = 0; i < BENCH_FILES; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		sfs_touch_r(mnt, name);
+	}
+	sfs_cd_r(mnt, NULL);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	fprintf(res, "%d cpus, %d s per run\n", ncpu, seconds);
+	fprintf(res, "threads\tops/s\tspeedup\n");
+
+	for (nthread = 1; nthread <= 2 * ncpu; nthread *= 2) {
+		struct worker *w = calloc(nthread, sizeof(struct worker));
+		long ops = 0;
+		double t0, t1;
+
+		stop = 0;
+		t0 = now();
+		for (i = 0; i < nthread; i++)
+			pthread_create(&w[i].w_thread, NULL, reader, &w[i]);
+		sleep(seconds);
+		stop = 1;
+		for (i = 0; i < nthread; i++) {
+			pthread_join(w[i].w_thread, NULL);
+			ops += w[i].w_ops;
+		}
+		t1 = now();
+		free(w);
+
+		if (nthread == 1)
+			base = ops / (t1 - t0);
+		fprintf(res, "%d\t%.0f\t%.2f\n", nthread, ops / (t1 - t0), ops / (t1 - t0) / base);
+		fflush(res);
+	}
+
+	sfs_mnt_free(mnt);
+	return 0;
+}
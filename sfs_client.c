@@ -0,0 +1,85 @@
+// Thin client for the SFS server
+//
+// Build: gcc sfs_client.c -o sfs_client
+// Usage: sfs_client socket < script
+//
+// Sends shell commands from stdin to a running "sfs -s socket" and
+// prints the replies the way the shell would, so a script runs the
+// same against the server as against a freshly started shell.
+// Commands are streamed without waiting for replies.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int sfd;
+
+/* stdin -> server */
+static void *sender(void *arg)
+{
+	char buf[4096];
+	ssize_t len, tot, n;
+
+	while ((len = read(0, buf, sizeof(buf))) > 0) {
+		for (tot = 0; tot < len; tot += n) {
+			n = write(sfd, buf + tot, len - tot);
+			if (n <= 0)
+				return NULL;
+		}
+	}
+	shutdown(sfd, SHUT_WR);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un sun;
+	pthread_t tid;
+	char buf[4096];
+	ssize_t len, i;
+	int prompt = 1;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: sfs_client socket\n");
+		return 1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(argv[1]) >= sizeof(sun.sun_path))
+		errx(1, "%s: socket path too long", argv[1]);
+	strcpy(sun.sun_path, argv[1]);
+
+	sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd < 0)
+		err(1, "socket");
+	if (connect(sfd, (struct sockaddr*)&sun, sizeof(sun)) < 0)
+		err(1, "%s", argv[1]);
+
+	if (pthread_create(&tid, NULL, sender, NULL))
+		errx(1, "can't start sender");
+
+	printf("OS SFS shell\n");
+
+	/* server -> stdout; every reply ends with a NUL */
+	while ((len = read(sfd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < len; i++) {
+			if (prompt) {
+				printf("os_shell> ");
+				prompt = 0;
+			}
+			if (buf[i] == '\0') {
+				prompt = 1;
+				continue;
+			}
+			putchar(buf[i]);
+		}
+	}
+
+	return 0;
+}
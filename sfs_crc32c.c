@@ -0,0 +1,95 @@
+/*
+ * CRC32C, reflected polynomial 0x82F63B78.
+ *
+ * With SSE4.2 the crc32 instruction does 8 bytes at a time; without,
+ * it is table driven, 8 bytes at a time with 8 tables.
+ */
+#include <sys/types.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sfs_types.h"
+#include "sfs_crc32c.h"
+
+#define POLY 0x82F63B78
+
+static u_int32_t table[8][256];
+static int have_hw;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void
+crc_init(void)
+{
+	u_int32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++) {
+			c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+		}
+		table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		for (k = 1; k < 8; k++) {
+			table[k][i] = (table[k-1][i] >> 8) ^ table[0][table[k-1][i] & 0xff];
+		}
+	}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	have_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static u_int32_t
+crc_sw(u_int32_t crc, const u_int8_t *p, size_t len)
+{
+	u_int32_t lo, hi;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+		    table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+		    table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+		    table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+	}
+	for (; len > 0; len--, p++) {
+		crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xff];
+	}
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static u_int32_t
+crc_hw(u_int32_t crc, const u_int8_t *p, size_t len)
+{
+	u_int64_t c = crc, v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	crc = c;
+	for (; len > 0; len--, p++) {
+		crc = __builtin_ia32_crc32qi(crc, *p);
+	}
+	return crc;
+}
+#endif
+
+u_int32_t
+sfs_crc32c(u_int32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&once, crc_init);
+
+	crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (have_hw)
+		return ~crc_hw(crc, buf, len);
+#endif
+	return ~crc_sw(crc, buf, len);
+}
@@ -0,0 +1,11 @@
+#ifndef _SFS_CRC32C_H_
+#define _SFS_CRC32C_H_
+
+/*
+ * CRC32C (Castagnoli). Start with crc 0; pass the result back in to
+ * continue over more data. Uses the SSE4.2 crc32 instruction when
+ * the CPU has it, and tables otherwise.
+ */
+u_int32_t sfs_crc32c(u_int32_t crc, const void *buf, size_t len);
+
+#endif /*_SFS_CRC32C_H_*/
@@ -1,103 +1,947 @@
+#define _GNU_SOURCE	/* O_DIRECT */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <err.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "sfs_types.h"
 #include "sfs_disk.h"
+#include "sfs_crc32c.h"
 
 #define BLOCKSIZE  512
 
 #ifndef EINTR
 #define EINTR 0
 #endif
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+#ifndef F_OFD_SETLK
+#define F_OFD_SETLK F_SETLK	/* then readers in the writer's process go unseen */
+#define F_OFD_GETLK F_GETLK
+#endif
+
+#define DIRECT_UNIT  4096	/* largest unit; also the pool's alignment */
+#define POOL_KEEP    16		/* idle buffers kept for reuse */
+#define UNIT_LOCKS   64
+
+/*
+ * Aligned buffers, allocated as needed and kept for reuse once given
+ * back, up to POOL_KEEP. Writing a block in direct mode reads and
+ * rewrites its whole unit, under one of the unit locks.
+ */
+struct dpool {
+	pthread_mutex_t dp_lock;
+	void *dp_free[POOL_KEEP];
+	int dp_nfree;
+	pthread_mutex_t dp_unitlock[UNIT_LOCKS];
+};
+
+/*
+ * Sync state. ds_dirty counts blocks written since the last sync
+ * began; ds_synclock makes a sync that starts while another runs wait
+ * for it, then sync whatever was written after it began.
+ */
+struct dsync {
+	pthread_mutex_t ds_lock;	/* policy, flusher */
+	pthread_cond_t ds_wake;
+	pthread_t ds_thread;
+	int ds_policy;
+	int ds_stop;
+	u_int32_t ds_interval;
+	u_int32_t ds_maxdirty;
+	pthread_mutex_t ds_synclock;
+	u_int64_t ds_dirty;
+	u_int64_t ds_syncs;
+	u_int64_t ds_blocks;
+};
 
-static int fd=-1;
+static struct disk default_disk = { -1, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, 0 };
+static struct disk *curdisk = &default_disk;
+
+struct disk *
+disk_select(struct disk *dk)
+{
+	struct disk *prev = curdisk;
+	curdisk = dk;
+	return prev;
+}
+
+static struct dpool *
+pool_alloc(void)
+{
+	struct dpool *dp = malloc(sizeof(struct dpool));
+	int i;
+
+	if (dp == NULL)
+		err(1, "malloc");
+	pthread_mutex_init(&dp->dp_lock, NULL);
+	dp->dp_nfree = 0;
+	for (i = 0; i < UNIT_LOCKS; i++) {
+		pthread_mutex_init(&dp->dp_unitlock[i], NULL);
+	}
+	return dp;
+}
+
+static void
+pool_free(struct dpool *dp)
+{
+	int i;
+
+	while (dp->dp_nfree > 0) {
+		free(dp->dp_free[--dp->dp_nfree]);
+	}
+	for (i = 0; i < UNIT_LOCKS; i++) {
+		pthread_mutex_destroy(&dp->dp_unitlock[i]);
+	}
+	pthread_mutex_destroy(&dp->dp_lock);
+	free(dp);
+}
+
+void *
+disk_buf_get(struct disk *dk)
+{
+	struct dpool *dp = dk->dk_pool;
+	void *buf = NULL;
+
+	pthread_mutex_lock(&dp->dp_lock);
+	if (dp->dp_nfree > 0)
+		buf = dp->dp_free[--dp->dp_nfree];
+	pthread_mutex_unlock(&dp->dp_lock);
+
+	if (buf == NULL && (errno = posix_memalign(&buf, DIRECT_UNIT, DISK_BUFSIZE)) != 0)
+		err(1, "posix_memalign");
+	return buf;
+}
 
 void
-disk_open(const char *path)
+disk_buf_put(struct disk *dk, void *buf)
 {
-	assert(fd<0);
-	fd = open(path, O_RDWR);
+	struct dpool *dp = dk->dk_pool;
 
-	if (fd<0) {
+	pthread_mutex_lock(&dp->dp_lock);
+	if (dp->dp_nfree < POOL_KEEP) {
+		dp->dp_free[dp->dp_nfree++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&dp->dp_lock);
+	free(buf);
+}
+
+/*
+ * The unit for direct I/O on an open image: 4 KB unless the image ends
+ * inside one. Returns 0 if the host will not do direct I/O on it.
+ */
+static u_int32_t
+direct_unit(int fd)
+{
+	struct stat st;
+	u_int32_t unit = DIRECT_UNIT;
+	void *probe;
+	int ok;
+
+	if (fstat(fd, &st))
+		err(1, "fstat");
+	while (unit > BLOCKSIZE && st.st_size % unit)
+		unit /= 2;
+	if ((errno = posix_memalign(&probe, DIRECT_UNIT, unit)) != 0)
+		err(1, "posix_memalign");
+	ok = pread(fd, probe, unit, 0) >= 0;
+	free(probe);
+	return ok ? unit : 0;
+}
+
+static struct dsync *
+sync_alloc(void)
+{
+	struct dsync *ds = malloc(sizeof(struct dsync));
+
+	if (ds == NULL)
+		err(1, "malloc");
+	bzero(ds, sizeof(struct dsync));
+	pthread_mutex_init(&ds->ds_lock, NULL);
+	pthread_cond_init(&ds->ds_wake, NULL);
+	pthread_mutex_init(&ds->ds_synclock, NULL);
+	ds->ds_policy = DISK_SYNC_NONE;
+	return ds;
+}
+
+/* map the image for a DISK_RDONLY disk; an empty one is not mapped */
+static void
+map_image(struct disk *dk, const char *path)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat(dk->dk_fd, &st))
+		err(1, "fstat");
+	dk->dk_map = NULL;
+	dk->dk_maplen = st.st_size;
+	if (st.st_size == 0)
+		return;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, dk->dk_fd, 0);
+	if (map == MAP_FAILED)
+		err(1, "%s: mmap", path);
+	dk->dk_map = map;
+}
+
+/*
+ * A DISK_SHARED reader holds a read lock on the image's first byte for
+ * as long as it has it open; a writer looks for one. The lock is only
+ * a hint, so a reader that can't take it goes on without.
+ */
+static struct flock *
+reader_lock(struct flock *fl, short type)
+{
+	bzero(fl, sizeof(struct flock));
+	fl->l_type = type;
+	fl->l_whence = SEEK_SET;
+	fl->l_start = 0;
+	fl->l_len = 1;
+	return fl;
+}
+
+int
+disk_shared_r(struct disk *dk)
+{
+	struct flock fl;
+
+	if (fcntl(dk->dk_fd, F_OFD_GETLK, reader_lock(&fl, F_WRLCK)))
+		return 1;	/* can't tell: assume so */
+	return fl.l_type != F_UNLCK;
+}
+
+int
+disk_open_flags_r(struct disk *dk, const char *path, int flags)
+{
+	struct flock fl;
+
+	assert(dk->dk_fd<0);
+	dk->dk_unit = 0;
+	dk->dk_map = NULL;
+	dk->dk_maplen = 0;
+	if (flags & DISK_RDONLY) {
+		dk->dk_fd = open(path, O_RDONLY);
+		if (dk->dk_fd<0) {
+			return -1;
+		}
+		map_image(dk, path);
+		if (flags & DISK_SHARED)
+			(void)fcntl(dk->dk_fd, F_OFD_SETLK, reader_lock(&fl, F_RDLCK));
+		dk->dk_pool = pool_alloc();
+		dk->dk_sync = sync_alloc();
+		return 0;
+	}
+	if (flags & DISK_DIRECT) {
+		dk->dk_fd = open(path, O_RDWR | O_DIRECT);
+		if (dk->dk_fd>=0 && (dk->dk_unit = direct_unit(dk->dk_fd)) == 0) {
+			close(dk->dk_fd);
+			dk->dk_fd = -1;
+			errno = EINVAL;
+		}
+		if (dk->dk_fd<0 && errno == EINVAL)
+			warnx("%s: no direct I/O here, using the page cache", path);
+	}
+	if (dk->dk_fd<0)
+		dk->dk_fd = open(path, O_RDWR);
+
+	if (dk->dk_fd<0) {
+		return -1;
+	}
+	if (flock(dk->dk_fd, LOCK_EX | LOCK_NB)) {
+		if (errno != EWOULDBLOCK) {
+			err(1, "%s: flock", path);
+		}
+		close(dk->dk_fd);
+		dk->dk_fd = -1;
+		errno = EBUSY;
+		return -1;
+	}
+	dk->dk_pool = pool_alloc();
+	dk->dk_sync = sync_alloc();
+	return 0;
+}
+
+void
+disk_open_r(struct disk *dk, const char *path)
+{
+	if (disk_open_flags_r(dk, path, 0)) {
 		err(1, "%s", path);
 	}
 }
 
+void
+disk_open(const char *path)
+{
+	disk_open_r(curdisk, path);
+}
+
 u_int32_t
 disk_blocksize(void)
 {
-	assert(fd>=0);
+	assert(curdisk->dk_fd>=0);
 	return BLOCKSIZE;
 }
 
-void
-disk_write(const void *data, u_int32_t block)
+static void
+host_write(int fd, const char *data, off_t off, size_t len)
 {
-	const char *cdata = data;
-	u_int32_t tot=0;
-	int len;
+	size_t tot=0;
+	ssize_t n;
 
 	assert(fd>=0);
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
-	}
-
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
-		if (len < 0) {
+	/* positioned I/O: handles on several threads share the fd */
+	while (tot < len) {
+		n = pwrite(fd, data + tot, len - tot, off + tot);
+		if (n < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
 			}
 			err(1, "write");
 		}
-		if (len==0) {
+		if (n==0) {
 			err(1, "write returned 0?");
 		}
-		tot += len;
+		tot += n;
 	}
 }
 
-void
-disk_read(void *data, u_int32_t block)
+static void
+host_read(int fd, char *data, off_t off, size_t len)
 {
-	char *cdata = data;
-	u_int32_t tot=0;
-	int len;
+	size_t tot=0;
+	ssize_t n;
 
 	assert(fd>=0);
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
-	}
-
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
-		if (len < 0) {
+	/* positioned I/O: handles on several threads share the fd */
+	while (tot < len) {
+		n = pread(fd, data + tot, len - tot, off + tot);
+		if (n < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
 			}
 			err(1, "read");
 		}
-		if (len==0) {
+		if (n==0) {
 			err(1, "unexpected EOF in mid-sector");
 		}
-		tot += len;
+		tot += n;
+	}
+}
+
+/*
+ * Direct reads: an aligned run of whole units goes straight into the
+ * caller's memory, anything else through a pool buffer, as many
+ * units at a time as fit.
+ */
+static void
+direct_read(struct disk *dk, char *data, off_t off, size_t len)
+{
+	size_t unit = dk->dk_unit, skip, n;
+	char *buf;
+
+	if ((uintptr_t)data % unit == 0 && off % unit == 0 && len % unit == 0) {
+		host_read(dk->dk_fd, data, off, len);
+		return;
+	}
+	buf = disk_buf_get(dk);
+	while (len > 0) {
+		skip = off % unit;
+		n = DISK_BUFSIZE - skip;
+		if (n > len)
+			n = len;
+		host_read(dk->dk_fd, buf, off - skip, (skip + n + unit - 1) / unit * unit);
+		memcpy(data, buf + skip, n);
+		data += n;
+		off += n;
+		len -= n;
+	}
+	disk_buf_put(dk, buf);
+}
+
+/*
+ * Direct writes, a unit at a time: the rest of a unit is read first
+ * and written back unchanged. Two writers in one unit would each put
+ * back the other's old data, so the unit is locked throughout.
+ */
+static void
+direct_write(struct disk *dk, const char *data, off_t off, size_t len)
+{
+	size_t unit = dk->dk_unit, skip, n;
+	pthread_mutex_t *lk;
+	char *buf;
+
+	buf = disk_buf_get(dk);
+	while (len > 0) {
+		skip = off % unit;
+		n = unit - skip;
+		if (n > len)
+			n = len;
+		lk = &dk->dk_pool->dp_unitlock[(off / unit) % UNIT_LOCKS];
+		pthread_mutex_lock(lk);
+		if (n < unit)
+			host_read(dk->dk_fd, buf, off - skip, unit);
+		memcpy(buf + skip, data, n);
+		host_write(dk->dk_fd, buf, off - skip, unit);
+		pthread_mutex_unlock(lk);
+		data += n;
+		off += n;
+		len -= n;
+	}
+	disk_buf_put(dk, buf);
+}
+
+/* images go past 4 GB: offsets are 64-bit before they are multiplied */
+#define BLOCKOFF(block)  ((off_t)(block) * BLOCKSIZE)
+#define BLOCKLEN(n)      ((size_t)(n) * BLOCKSIZE)
+
+static void
+write_blocks(struct disk *dk, const void *data, u_int32_t block, u_int32_t nblocks)
+{
+	if (dk->dk_unit)
+		direct_write(dk, data, BLOCKOFF(block), BLOCKLEN(nblocks));
+	else
+		host_write(dk->dk_fd, data, BLOCKOFF(block), BLOCKLEN(nblocks));
+}
+
+static void
+read_blocks(struct disk *dk, void *data, u_int32_t block, u_int32_t nblocks)
+{
+	if (dk->dk_map != NULL) {
+		if (BLOCKOFF(block) + BLOCKLEN(nblocks) > dk->dk_maplen) {
+			errx(1, "unexpected EOF in mid-sector");
+		}
+		memcpy(data, dk->dk_map + BLOCKOFF(block), BLOCKLEN(nblocks));
+	} else if (dk->dk_unit)
+		direct_read(dk, data, BLOCKOFF(block), BLOCKLEN(nblocks));
+	else
+		host_read(dk->dk_fd, data, BLOCKOFF(block), BLOCKLEN(nblocks));
+}
+
+/*
+ * Block checksums: a CRC32C for every block, kept in a table of
+ * consecutive blocks on the disk (which it does not cover itself).
+ * Only CS_PAGES of the table's blocks are in memory, each in the slot
+ * its number picks. A write changes its sum there, and the table
+ * blocks so changed are written together at disk_commit_r(), or when
+ * pushed out; a command writing many neighbouring blocks writes each
+ * table block once. Reads are checked, and a block that does not
+ * match is read again before it counts: it may have been caught
+ * between its write and its sum's, by a thread of the writer or, until
+ * the writer's command ends, by a reader sharing the image.
+ */
+#define CSPERBLOCK (BLOCKSIZE/sizeof(u_int32_t))
+#define CS_PAGES   1024
+#define CS_NOPAGE  0xffffffff
+#define CS_RETRY   1000		/* us a mapped reader waits to read again */
+#define CS_WAIT    1000
+
+struct cspage {
+	u_int32_t cp_tb;		/* table block held, or CS_NOPAGE */
+	int cp_dirty;
+	u_int32_t cp_sum[CSPERBLOCK];
+};
+
+struct dcsum {
+	u_int32_t *cs_sum;		/* mapped: the writer's table */
+	struct cspage *cs_page;		/* else CS_PAGES of it */
+	u_int32_t *cs_dirty;		/* pages to write at csum_flush */
+	u_int32_t cs_ndirty;
+	struct disk *cs_dk;		/* the disk the table belongs to */
+	u_int32_t cs_start;		/* the table on disk */
+	u_int32_t cs_nblocks;
+	u_int32_t cs_disksize;		/* blocks covered */
+	pthread_mutex_t cs_lock;	/* pages */
+	u_int32_t cs_errors;		/* mismatches seen by reads */
+};
+
+static int
+csum_covers(struct dcsum *cs, u_int32_t block)
+{
+	return block < cs->cs_disksize &&
+	    (block < cs->cs_start || block >= cs->cs_start + cs->cs_nblocks);
+}
+
+static void
+csum_put(struct dcsum *cs, struct cspage *cp)
+{
+	write_blocks(cs->cs_dk, cp->cp_sum, cs->cs_start + cp->cp_tb, 1);
+	cp->cp_dirty = 0;
+}
+
+/* block's sum, in memory, with cs_lock held unless mapped */
+static u_int32_t *
+csum_sum(struct dcsum *cs, u_int32_t block)
+{
+	u_int32_t tb = block / CSPERBLOCK;
+	struct cspage *cp;
+
+	if (cs->cs_sum != NULL)
+		return &cs->cs_sum[block];
+	cp = &cs->cs_page[tb % CS_PAGES];
+	if (cp->cp_tb != tb) {
+		if (cp->cp_dirty)
+			csum_put(cs, cp);
+		read_blocks(cs->cs_dk, cp->cp_sum, cs->cs_start + tb, 1);
+		cp->cp_tb = tb;
+	}
+	return &cp->cp_sum[block % CSPERBLOCK];
+}
+
+/* write the changed table blocks; cs_lock held */
+static void
+csum_flush_locked(struct dcsum *cs)
+{
+	u_int32_t i;
+
+	for (i = 0; i < cs->cs_ndirty; i++) {
+		if (cs->cs_page[cs->cs_dirty[i]].cp_dirty)
+			csum_put(cs, &cs->cs_page[cs->cs_dirty[i]]);
+	}
+	cs->cs_ndirty = 0;
+}
+
+static void
+csum_flush(struct disk *dk)
+{
+	struct dcsum *cs = dk->dk_cs;
+
+	if (cs == NULL || cs->cs_sum != NULL)
+		return;
+	pthread_mutex_lock(&cs->cs_lock);
+	csum_flush_locked(cs);
+	pthread_mutex_unlock(&cs->cs_lock);
+}
+
+static void
+csum_update(struct disk *dk, const void *data, u_int32_t block)
+{
+	struct dcsum *cs = dk->dk_cs;
+	u_int32_t sum, slot;
+
+	if (cs == NULL || !csum_covers(cs, block))
+		return;
+	sum = sfs_crc32c(0, data, BLOCKSIZE);
+	slot = block / CSPERBLOCK % CS_PAGES;
+	pthread_mutex_lock(&cs->cs_lock);
+	*csum_sum(cs, block) = sum;
+	if (!cs->cs_page[slot].cp_dirty) {
+		if (cs->cs_ndirty == CS_PAGES)
+			csum_flush_locked(cs);	/* the list also holds pages put since */
+		cs->cs_page[slot].cp_dirty = 1;
+		cs->cs_dirty[cs->cs_ndirty++] = slot;
 	}
+	pthread_mutex_unlock(&cs->cs_lock);
+}
+
+int
+disk_csum_check(struct disk *dk, const void *data, u_int32_t block)
+{
+	struct dcsum *cs = dk->dk_cs;
+	u_int32_t sum;
+
+	if (cs == NULL || !csum_covers(cs, block))
+		return -1;
+	sum = sfs_crc32c(0, data, BLOCKSIZE);
+	if (cs->cs_sum != NULL)
+		return sum == cs->cs_sum[block];
+	pthread_mutex_lock(&cs->cs_lock);
+	sum = (sum == *csum_sum(cs, block));
+	pthread_mutex_unlock(&cs->cs_lock);
+	return sum;
+}
+
+/*
+ * Read a block that did not match again, into data, until it does:
+ * once in the writer, where its sum follows it at once, and for a
+ * mapped reader every CS_RETRY us until the writer's command in flight
+ * has had CS_WAIT of them to end. With remap, block is read from
+ * wherever lblock is now. Returns 1 once it matches.
+ */
+static int
+csum_reread(struct disk *dk, void *data, u_int32_t block, u_int32_t lblock, int remap)
+{
+	int tries = (dk->dk_cs->cs_sum != NULL) ? CS_WAIT : 1;
+
+	while (tries-- > 0) {
+		if (dk->dk_cs->cs_sum != NULL)
+			usleep(CS_RETRY);
+		if (remap && dk->dk_remap != NULL)
+			block = dk->dk_remap(dk->dk_arg, lblock);
+		read_blocks(dk, data, block, 1);
+		if (disk_csum_check(dk, data, block) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+int
+disk_csum_reread_r(struct disk *dk, void *data, u_int32_t block)
+{
+	return csum_reread(dk, data, block, block, 0);
+}
+
+/* check block, just read into data as lblock */
+static void
+csum_check_read(struct disk *dk, void *data, u_int32_t block, u_int32_t lblock)
+{
+	if (disk_csum_check(dk, data, block) != 0 || csum_reread(dk, data, block, lblock, 1))
+		return;
+	__atomic_fetch_add(&dk->dk_cs->cs_errors, 1, __ATOMIC_RELAXED);
+	warnx("block %u: checksum mismatch", block);
+}
+
+static void
+csum_verify(struct disk *dk, void *data, u_int32_t block, u_int32_t nblocks)
+{
+	char *cdata = data;
+	u_int32_t i;
+
+	for (i = 0; i < nblocks; i++) {
+		csum_check_read(dk, cdata + i*BLOCKSIZE, block + i, block + i);
+	}
+}
+
+static struct dcsum *
+csum_alloc(struct disk *dk, u_int32_t start, u_int32_t ntable, u_int32_t disksize, u_int32_t *sum)
+{
+	struct dcsum *cs = malloc(sizeof(struct dcsum));
+	u_int32_t i;
+
+	if (cs == NULL)
+		err(1, "malloc");
+	cs->cs_sum = sum;
+	cs->cs_page = NULL;
+	cs->cs_dirty = NULL;
+	cs->cs_ndirty = 0;
+	if (sum == NULL) {
+		cs->cs_page = malloc(CS_PAGES * sizeof(struct cspage));
+		cs->cs_dirty = malloc(CS_PAGES * sizeof(u_int32_t));
+		if (cs->cs_page == NULL || cs->cs_dirty == NULL)
+			err(1, "malloc");
+		for (i = 0; i < CS_PAGES; i++) {
+			cs->cs_page[i].cp_tb = CS_NOPAGE;
+			cs->cs_page[i].cp_dirty = 0;
+		}
+	}
+	cs->cs_dk = dk;
+	cs->cs_start = start;
+	cs->cs_nblocks = ntable;
+	cs->cs_disksize = disksize;
+	cs->cs_errors = 0;
+	pthread_mutex_init(&cs->cs_lock, NULL);
+	return cs;
 }
 
 void
-disk_close(void)
+disk_csum_attach(struct disk *dk, u_int32_t start, u_int32_t ntable, u_int32_t disksize)
 {
-	assert(fd>=0);
-	if (close(fd)) {
+	assert(dk->dk_cs == NULL);
+	if (dk->dk_map != NULL && BLOCKOFF(start) + BLOCKLEN(ntable) <= dk->dk_maplen) {
+		// the writer's table, as it keeps it
+		dk->dk_cs = csum_alloc(dk, start, ntable, disksize, (u_int32_t *)(dk->dk_map + BLOCKOFF(start)));
+		return;
+	}
+	dk->dk_cs = csum_alloc(dk, start, ntable, disksize, NULL);
+}
+
+void
+disk_csum_create(struct disk *dk, u_int32_t start, u_int32_t ntable, u_int32_t disksize)
+{
+	char zero[BLOCKSIZE];
+	u_int32_t zsum[CSPERBLOCK];
+	u_int32_t i;
+
+	assert(dk->dk_cs == NULL);
+	dk->dk_cs = csum_alloc(dk, start, ntable, disksize, NULL);
+
+	bzero(zero, BLOCKSIZE);
+	zsum[0] = sfs_crc32c(0, zero, BLOCKSIZE);
+	for (i = 1; i < CSPERBLOCK; i++) {
+		zsum[i] = zsum[0];
+	}
+	for (i = 0; i < ntable; i++) {
+		write_blocks(dk, zsum, start + i, 1);
+	}
+}
+
+u_int32_t
+disk_csum_errors(struct disk *dk)
+{
+	return dk->dk_cs ? __atomic_load_n(&dk->dk_cs->cs_errors, __ATOMIC_RELAXED) : 0;
+}
+
+void
+disk_write_nohook_r(struct disk *dk, const void *data, u_int32_t block)
+{
+	struct dsync *ds = dk->dk_sync;
+
+	assert(dk->dk_remap == NULL && dk->dk_map == NULL);
+	write_blocks(dk, data, block, 1);
+	csum_update(dk, data, block);
+
+	// wake the flusher once, when the batch fills up
+	if (__atomic_add_fetch(&ds->ds_dirty, 1, __ATOMIC_RELEASE) == ds->ds_maxdirty &&
+	    ds->ds_policy == DISK_SYNC_GROUP) {
+		pthread_mutex_lock(&ds->ds_lock);
+		pthread_cond_signal(&ds->ds_wake);
+		pthread_mutex_unlock(&ds->ds_lock);
+	}
+}
+
+void
+disk_write_r(struct disk *dk, const void *data, u_int32_t block)
+{
+	if (dk->dk_prewrite != NULL)
+		dk->dk_prewrite(dk->dk_arg, block);
+	disk_write_nohook_r(dk, data, block);
+}
+
+void
+disk_write(const void *data, u_int32_t block)
+{
+	disk_write_r(curdisk, data, block);
+}
+
+/*
+ * Read through dk_remap: runs of blocks that map to themselves are
+ * read at once, the others one by one. A block may be copied away and
+ * overwritten while it is read, so one that maps somewhere once it has
+ * been read is read again from there.
+ */
+static void
+remap_read(struct disk *dk, char *data, u_int32_t block, u_int32_t nblocks)
+{
+	u_int32_t i, n, to;
+
+	for (i = 0; i < nblocks; i += n) {
+		to = dk->dk_remap(dk->dk_arg, block + i);
+		if (to != block + i) {
+			read_blocks(dk, data + i*BLOCKSIZE, to, 1);
+			if (dk->dk_cs != NULL)
+				csum_check_read(dk, data + i*BLOCKSIZE, to, block + i);
+			n = 1;
+			continue;
+		}
+		for (n = 1; i + n < nblocks; n++) {
+			if (dk->dk_remap(dk->dk_arg, block + i + n) != block + i + n)
+				break;
+		}
+		read_blocks(dk, data + i*BLOCKSIZE, block + i, n);
+		for (to = 0; to < n; to++) {
+			if (dk->dk_remap(dk->dk_arg, block + i + to) != block + i + to) {
+				n = to;	// moved meanwhile: from here on again
+				break;
+			}
+		}
+		if (n == 0)
+			continue;
+		if (dk->dk_cs != NULL)
+			csum_verify(dk, data + i*BLOCKSIZE, block + i, n);
+	}
+}
+
+void
+disk_read_blocks_r(struct disk *dk, void *data, u_int32_t block, u_int32_t nblocks)
+{
+	if (dk->dk_remap != NULL) {
+		remap_read(dk, data, block, nblocks);
+		return;
+	}
+	read_blocks(dk, data, block, nblocks);
+	if (dk->dk_cs != NULL)
+		csum_verify(dk, data, block, nblocks);
+}
+
+void
+disk_read_unchecked_r(struct disk *dk, void *data, u_int32_t block, u_int32_t nblocks)
+{
+	read_blocks(dk, data, block, nblocks);
+}
+
+void
+disk_read_r(struct disk *dk, void *data, u_int32_t block)
+{
+	disk_read_blocks_r(dk, data, block, 1);
+}
+
+/*
+ * Start reading blocks into the host's cache without waiting for them.
+ * Only a hint: errors are ignored.
+ */
+void
+disk_readahead_r(struct disk *dk, u_int32_t block, u_int32_t nblocks)
+{
+	assert(dk->dk_fd>=0);
+	if (dk->dk_unit)
+		return;	// the page cache is not used
+	posix_fadvise(dk->dk_fd, BLOCKOFF(block), BLOCKLEN(nblocks), POSIX_FADV_WILLNEED);
+}
+
+void
+disk_read(void *data, u_int32_t block)
+{
+	disk_read_r(curdisk, data, block);
+}
+
+void
+disk_sync_r(struct disk *dk)
+{
+	struct dsync *ds = dk->dk_sync;
+	u_int64_t n;
+
+	csum_flush(dk);	/* the sums go with the blocks */
+	pthread_mutex_lock(&ds->ds_synclock);
+	n = __atomic_exchange_n(&ds->ds_dirty, 0, __ATOMIC_ACQ_REL);
+	if (n > 0) {
+		if (fdatasync(dk->dk_fd)) {
+			err(1, "fdatasync");
+		}
+		ds->ds_syncs++;
+		ds->ds_blocks += n;
+	}
+	pthread_mutex_unlock(&ds->ds_synclock);
+}
+
+void
+disk_commit_r(struct disk *dk)
+{
+	csum_flush(dk);
+	if (dk->dk_sync->ds_policy == DISK_SYNC_CMD)
+		disk_sync_r(dk);
+}
+
+static void *
+flusher(void *arg)
+{
+	struct disk *dk = arg;
+	struct dsync *ds = dk->dk_sync;
+	struct timespec ts;
+
+	pthread_mutex_lock(&ds->ds_lock);
+	while (!ds->ds_stop) {
+		if (ds->ds_maxdirty == 0 || __atomic_load_n(&ds->ds_dirty, __ATOMIC_ACQUIRE) < ds->ds_maxdirty) {
+			if (ds->ds_interval == 0) {
+				pthread_cond_wait(&ds->ds_wake, &ds->ds_lock);
+			} else {
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_sec += ds->ds_interval / 1000;
+				ts.tv_nsec += (ds->ds_interval % 1000) * 1000000L;
+				if (ts.tv_nsec >= 1000000000L) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000L;
+				}
+				pthread_cond_timedwait(&ds->ds_wake, &ds->ds_lock, &ts);
+			}
+			if (ds->ds_stop)
+				break;
+		}
+		pthread_mutex_unlock(&ds->ds_lock);
+		disk_sync_r(dk);
+		pthread_mutex_lock(&ds->ds_lock);
+	}
+	pthread_mutex_unlock(&ds->ds_lock);
+	return NULL;
+}
+
+/* stop the flusher, if any, with what it had to do done */
+static void
+flusher_stop(struct disk *dk)
+{
+	struct dsync *ds = dk->dk_sync;
+
+	if (ds->ds_policy != DISK_SYNC_GROUP)
+		return;
+	pthread_mutex_lock(&ds->ds_lock);
+	ds->ds_stop = 1;
+	pthread_cond_signal(&ds->ds_wake);
+	pthread_mutex_unlock(&ds->ds_lock);
+	pthread_join(ds->ds_thread, NULL);
+	ds->ds_stop = 0;
+}
+
+void
+disk_sync_policy(struct disk *dk, int policy, u_int32_t interval, u_int32_t maxdirty)
+{
+	struct dsync *ds = dk->dk_sync;
+
+	flusher_stop(dk);
+	if (ds->ds_policy != DISK_SYNC_NONE)
+		disk_sync_r(dk);	// owed under the old one
+
+	pthread_mutex_lock(&ds->ds_lock);
+	ds->ds_policy = policy;
+	ds->ds_interval = interval;
+	ds->ds_maxdirty = maxdirty;
+	pthread_mutex_unlock(&ds->ds_lock);
+	if (policy == DISK_SYNC_GROUP && pthread_create(&ds->ds_thread, NULL, flusher, dk))
+		errx(1, "can't start the flusher");
+}
+
+void
+disk_sync_stat(struct disk *dk, struct disk_syncstat *st)
+{
+	struct dsync *ds = dk->dk_sync;
+
+	pthread_mutex_lock(&ds->ds_synclock);
+	st->ds_policy = ds->ds_policy;
+	st->ds_interval = ds->ds_interval;
+	st->ds_maxdirty = ds->ds_maxdirty;
+	st->ds_syncs = ds->ds_syncs;
+	st->ds_blocks = ds->ds_blocks;
+	st->ds_dirty = __atomic_load_n(&ds->ds_dirty, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ds->ds_synclock);
+}
+
+void
+disk_close_r(struct disk *dk)
+{
+	struct dsync *ds = dk->dk_sync;
+
+	assert(dk->dk_fd>=0);
+	flusher_stop(dk);
+	csum_flush(dk);
+	if (ds->ds_policy != DISK_SYNC_NONE)
+		disk_sync_r(dk);
+	pthread_mutex_destroy(&ds->ds_synclock);
+	pthread_cond_destroy(&ds->ds_wake);
+	pthread_mutex_destroy(&ds->ds_lock);
+	free(ds);
+	dk->dk_sync = NULL;
+	if (dk->dk_map != NULL && munmap((void *)dk->dk_map, dk->dk_maplen)) {
+		err(1, "munmap");
+	}
+	dk->dk_map = NULL;
+	dk->dk_maplen = 0;
+	if (close(dk->dk_fd)) {
 		err(1, "close");
 	}
-	fd = -1;
+	dk->dk_fd = -1;
+	pool_free(dk->dk_pool);
+	dk->dk_pool = NULL;
+	if (dk->dk_cs != NULL) {
+		pthread_mutex_destroy(&dk->dk_cs->cs_lock);
+		free(dk->dk_cs->cs_page);
+		free(dk->dk_cs->cs_dirty);
+		free(dk->dk_cs);
+		dk->dk_cs = NULL;
+	}
+}
+
+void
+disk_close(void)
+{
+	disk_close_r(curdisk);
 }
@@ -1,6 +1,22 @@
 #ifndef _SFS_DISK_H_
 #define _SFS_DISK_H_
 
+/*
+ * One open disk image.
+ */
+struct disk {
+	int dk_fd;
+	struct dcsum *dk_cs;	/* block checksums, if attached */
+	void (*dk_prewrite)(void *arg, u_int32_t block);	/* see below */
+	u_int32_t (*dk_remap)(void *arg, u_int32_t block);
+	void *dk_arg;
+	u_int32_t dk_unit;	/* direct I/O: bytes per transfer, else 0 */
+	struct dpool *dk_pool;	/* aligned buffers */
+	struct dsync *dk_sync;	/* durability policy */
+	const char *dk_map;	/* DISK_RDONLY: the image, mapped */
+	size_t dk_maplen;
+};
+
 void disk_open(const char *path);
 
 u_int32_t disk_blocksize(void);
@@ -10,4 +26,110 @@ void disk_read(void *data, u_int32_t block);
 
 void disk_close(void);
 
+/*
+ * Reentrant variants working on an explicit disk.
+ * The functions above work on the selected disk; disk_select()
+ * changes it and returns the previous one.
+ */
+void disk_open_r(struct disk *dk, const char *path);
+int disk_open_flags_r(struct disk *dk, const char *path, int flags);
+void disk_write_r(struct disk *dk, const void *data, u_int32_t block);
+void disk_read_r(struct disk *dk, void *data, u_int32_t block);
+void disk_close_r(struct disk *dk);
+
+/* nblocks consecutive blocks at once, and a hint to fetch them soon */
+void disk_read_blocks_r(struct disk *dk, void *data, u_int32_t block, u_int32_t nblocks);
+void disk_readahead_r(struct disk *dk, u_int32_t block, u_int32_t nblocks);
+
+/*
+ * Block checksums. Once a table of ntable blocks at start is attached
+ * (or created, for a new disk of zeros), every write keeps it current
+ * and every read is checked against it; a mismatch is reported and
+ * counted once a second read fails too. The table is paged in as it
+ * is used, and changes to it reach the disk at disk_commit_r(), or
+ * a sync or close. disk_csum_check() returns 1 if the block matches,
+ * 0 if not, -1 if it is not covered. disk_csum_reread_r() reads one
+ * that did not match again, the way reads do, and returns 1 once it
+ * matches.
+ */
+void disk_csum_attach(struct disk *dk, u_int32_t start, u_int32_t ntable, u_int32_t disksize);
+void disk_csum_create(struct disk *dk, u_int32_t start, u_int32_t ntable, u_int32_t disksize);
+int disk_csum_check(struct disk *dk, const void *data, u_int32_t block);
+int disk_csum_reread_r(struct disk *dk, void *data, u_int32_t block);
+u_int32_t disk_csum_errors(struct disk *dk);
+void disk_read_unchecked_r(struct disk *dk, void *data, u_int32_t block, u_int32_t nblocks);
+
+/*
+ * Hooks for snapshots, called with dk_arg. dk_prewrite runs before
+ * disk_write_r() overwrites a block; disk_write_nohook_r() skips it,
+ * for blocks no snapshot keeps. On a disk with dk_remap, a read of a
+ * block comes from the block it maps to, and writes are not allowed.
+ */
+void disk_write_nohook_r(struct disk *dk, const void *data, u_int32_t block);
+
+/*
+ * Direct I/O. A disk opened with DISK_DIRECT bypasses the host's page
+ * cache and moves whole aligned units of dk_unit bytes: 4 KB, or less
+ * if the image size is not a multiple of it. Blocks that are not a
+ * whole aligned unit in aligned memory go through buffers from the
+ * disk's pool. Callers moving runs of blocks can borrow DISK_BUFSIZE
+ * bytes of aligned memory from the same pool, with any disk.
+ */
+#define DISK_DIRECT   0x1
+#define DISK_BUFSIZE  (64*1024)
+
+/*
+ * One writer, many readers. A disk opened for writing holds an
+ * exclusive flock on the image until it is closed; while it does,
+ * opening the image for writing again, from any process, fails:
+ * disk_open_flags_r() returns -1 with errno EBUSY (as it does, with the
+ * host's errno, for an image it can't open at all). DISK_RDONLY opens
+ * it without the lock and maps it read-only, so any number of readers
+ * share the host's pages of it beside the writer, and see its writes
+ * as they land, the checksum table at the end of each command. It
+ * takes precedence over DISK_DIRECT, and the disk cannot be written.
+ */
+#define DISK_RDONLY   0x2
+
+/*
+ * A DISK_RDONLY disk opened with DISK_SHARED follows the writer's
+ * changes as they come, and lets it know: disk_shared_r() on the
+ * writer's disk returns 1 while any such reader has the image open.
+ */
+#define DISK_SHARED   0x4
+
+int disk_shared_r(struct disk *dk);
+
+void *disk_buf_get(struct disk *dk);
+void disk_buf_put(struct disk *dk, void *buf);
+
+/*
+ * Durability. Written blocks are only sure to be on the host's disk
+ * once it is synced: never by itself with DISK_SYNC_NONE, at every
+ * disk_commit_r() (the end of a command) with DISK_SYNC_CMD, and with
+ * DISK_SYNC_GROUP by a flusher thread every interval ms, or sooner
+ * once maxdirty blocks wait (either may be 0 for no limit). Closing
+ * the disk syncs it unless the policy is DISK_SYNC_NONE. Callers set
+ * the policy of a disk one at a time.
+ */
+#define DISK_SYNC_NONE   0
+#define DISK_SYNC_CMD    1
+#define DISK_SYNC_GROUP  2
+
+struct disk_syncstat {
+	int ds_policy;
+	u_int32_t ds_interval;		/* ms */
+	u_int32_t ds_maxdirty;		/* blocks */
+	u_int64_t ds_syncs;		/* fdatasync calls */
+	u_int64_t ds_blocks;		/* blocks written before them */
+	u_int64_t ds_dirty;		/* written since */
+};
+
+void disk_sync_policy(struct disk *dk, int policy, u_int32_t interval, u_int32_t maxdirty);
+void disk_sync_r(struct disk *dk);
+void disk_commit_r(struct disk *dk);
+void disk_sync_stat(struct disk *dk, struct disk_syncstat *st);
+
+struct disk *disk_select(struct disk *dk);
+
 #endif /*_SFS_DISK_H_*/
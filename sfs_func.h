@@ -1,21 +1,159 @@
 #ifndef _SFS_FUNC_H_
 #define _SFS_FUNC_H_
 
+#include <stdio.h>
+
+/* sfs_mkfs() flags */
+#define SFS_MKFS_PACKED  0x1	/* 128-byte inodes in an inode table */
+#define SFS_MKFS_CSUM    0x2	/* checksum every block */
+
+/* sfs_cpin_flags_r() flags */
+#define SFS_CPIN_COMPRESS  0x1	/* store the file compressed */
+#define SFS_CPIN_UPDATE    0x2	/* refresh a file already there, writing only changed blocks */
+
+/* sfs_open_r() flags, as for open(2) */
+#define SFS_O_RDONLY   0x0
+#define SFS_O_WRONLY   0x1
+#define SFS_O_RDWR     0x2
+#define SFS_O_ACCMODE  0x3
+#define SFS_O_CREAT    0x4	/* make it if it is not there */
+#define SFS_O_TRUNC    0x8	/* empty it first */
+#define SFS_O_APPEND   0x10	/* every write goes at the end */
+
+#define SFS_OPEN_MAX   16	/* open files per handle */
+
+/* sfs_rmv_flags_r() flags */
+#define SFS_RM_RECURSIVE  0x1	/* directories too, with everything in them */
+
+/* sfs_mount_flags_r() flags */
+#define SFS_MOUNT_DIRECT  0x1	/* bypass the host's page cache */
+#define SFS_MOUNT_RDONLY  0x2	/* read-only, beside another process's writer */
+
 void sfs_mount(const char* path);
 void sfs_umount();
 void sfs_ls(const char* path);
 void sfs_cd(const char* path);
+void sfs_lsr(const char* path);
+void sfs_du(const char* path);
+void sfs_find(const char* path, const char *pattern);
 
 void sfs_mkdir(const char* path);
+void sfs_mkdirv(int n, char *const paths[]);
 void sfs_rmdir(const char* path);
 void sfs_touch(const char* path);
+void sfs_touchv(int n, char *const paths[]);
 void sfs_rm(const char* path);
+void sfs_rmv(int n, char *const patterns[]);
+void sfs_rmv_flags(int n, char *const patterns[], int flags);
 void sfs_mv(const char* src_name, const char* dst_name);
+void sfs_cp(const char* src_name, const char* dst_name);
 void sfs_dump();
+void sfs_df();
+void sfs_mkfs(const char *path, unsigned long long nblocks, const char *volname, int flags);
+void sfs_dedup(const char *arg);
+void sfs_scrub();
+void sfs_mksnap(const char *name);
+void sfs_lssnap();
+void sfs_rmsnap(const char *name);
+void sfs_frag();
+void sfs_sync(const char *policy);
+void sfs_defrag();
 void sfs_fsck();
 void sfs_bitmap();
 
 void sfs_cpin(const char* local_path, const char* path);
-void sfs_cpout(const char* path, const char* local_path);
+void sfs_cpout(const char* local_path, const char* path);
+
+int sfs_open(const char *path, int flags);
+int sfs_read(int fd, void *buf, int n);
+int sfs_write(int fd, const void *buf, int n);
+int sfs_lseek(int fd, int offset, int whence);
+int sfs_ftruncate(int fd, int length);
+int sfs_close(int fd);
+void sfs_cat(const char* path);
+void sfs_append(const char* path, const char *text);
+void sfs_truncate(const char* path, int length);
+
+/*
+ * Reentrant variants: each takes an explicit mount handle,
+ * so one process can keep several images mounted at once.
+ * Handles are not shared between threads; give each thread its own
+ * with sfs_mnt_dup() and the volume is locked underneath.
+ * The functions above work on a single default handle.
+ */
+struct sfs_mnt;
+
+struct sfs_mnt *sfs_mnt_alloc(void);
+struct sfs_mnt *sfs_mnt_dup(struct sfs_mnt *mp);	/* same volume, own cwd */
+void sfs_mnt_setout(struct sfs_mnt *mp, FILE *out);	/* default stdout */
+int sfs_mnt_mounted(struct sfs_mnt *mp);	/* 1 if a volume is mounted */
+const char *sfs_mnt_image(struct sfs_mnt *mp, int *flags);	/* its image path, or NULL */
+void sfs_mnt_free(struct sfs_mnt *mp);
+
+void sfs_mount_r(struct sfs_mnt *mp, const char* path);
+void sfs_mount_snap_r(struct sfs_mnt *mp, const char* path, const char *name);	/* read-only */
+void sfs_mount_flags_r(struct sfs_mnt *mp, const char* path, const char *name, int flags);
+void sfs_umount_r(struct sfs_mnt *mp);
+void sfs_ls_r(struct sfs_mnt *mp, const char* path);
+void sfs_cd_r(struct sfs_mnt *mp, const char* path);
+
+/*
+ * Walks of the tree under path (NULL for the cwd), shared out over
+ * threads: ls -R, du (bytes per directory, subdirectories included)
+ * and find (paths whose last name matches an fnmatch(3) pattern).
+ * Output is in the same order however the work was shared.
+ */
+void sfs_lsr_r(struct sfs_mnt *mp, const char* path);
+void sfs_du_r(struct sfs_mnt *mp, const char* path);
+void sfs_find_r(struct sfs_mnt *mp, const char* path, const char *pattern);
+
+/*
+ * The v variants take many names in the cwd and do them in one pass
+ * over its directory blocks; sfs_rmv_r() names are fnmatch(3) patterns.
+ */
+void sfs_mkdir_r(struct sfs_mnt *mp, const char* path);
+void sfs_mkdirv_r(struct sfs_mnt *mp, int n, char *const paths[]);
+void sfs_rmdir_r(struct sfs_mnt *mp, const char* path);
+void sfs_touch_r(struct sfs_mnt *mp, const char* path);
+void sfs_touchv_r(struct sfs_mnt *mp, int n, char *const paths[]);
+void sfs_rm_r(struct sfs_mnt *mp, const char* path);
+void sfs_rmv_r(struct sfs_mnt *mp, int n, char *const patterns[]);
+void sfs_rmv_flags_r(struct sfs_mnt *mp, int n, char *const patterns[], int flags);
+void sfs_mv_r(struct sfs_mnt *mp, const char* src_name, const char* dst_name);
+void sfs_cp_r(struct sfs_mnt *mp, const char* src_name, const char* dst_name);	/* clone, shares blocks */
+void sfs_dump_r(struct sfs_mnt *mp);
+void sfs_df_r(struct sfs_mnt *mp);
+void sfs_fsck_r(struct sfs_mnt *mp);
+void sfs_bitmap_r(struct sfs_mnt *mp);
+
+void sfs_cpin_r(struct sfs_mnt *mp, const char* local_path, const char* path);
+void sfs_cpin_flags_r(struct sfs_mnt *mp, const char* local_path, const char* path, int flags);
+void sfs_cpout_r(struct sfs_mnt *mp, const char* local_path, const char* path);
+
+/*
+ * Open files in the cwd, in a table per handle. On failure the calls
+ * return the negative error code the commands print (-1 no such file,
+ * -8 invalid argument, ...). Writes are held in the handle and reach
+ * the volume when they move past its buffer, on ftruncate and on close.
+ * Compressed files open read only.
+ */
+int sfs_open_r(struct sfs_mnt *mp, const char *path, int flags);
+int sfs_read_r(struct sfs_mnt *mp, int fd, void *buf, int n);
+int sfs_write_r(struct sfs_mnt *mp, int fd, const void *buf, int n);
+int sfs_lseek_r(struct sfs_mnt *mp, int fd, int offset, int whence);	/* SEEK_SET, SEEK_CUR, SEEK_END */
+int sfs_ftruncate_r(struct sfs_mnt *mp, int fd, int length);
+int sfs_close_r(struct sfs_mnt *mp, int fd);
+void sfs_cat_r(struct sfs_mnt *mp, const char* path);
+void sfs_append_r(struct sfs_mnt *mp, const char* path, const char *text);	/* text and a newline */
+void sfs_truncate_r(struct sfs_mnt *mp, const char* path, int length);
+void sfs_mkfs_r(struct sfs_mnt *mp, const char *path, unsigned long long nblocks, const char *volname, int flags);
+void sfs_dedup_r(struct sfs_mnt *mp, const char *arg);	/* "on", "off" or NULL */
+void sfs_scrub_r(struct sfs_mnt *mp);
+void sfs_mksnap_r(struct sfs_mnt *mp, const char *name);
+void sfs_lssnap_r(struct sfs_mnt *mp);
+void sfs_rmsnap_r(struct sfs_mnt *mp, const char *name);
+void sfs_frag_r(struct sfs_mnt *mp);
+void sfs_sync_r(struct sfs_mnt *mp, const char *policy);
+void sfs_defrag_r(struct sfs_mnt *mp);
 
 #endif /*_SFS_FUNC_H_*/
@@ -15,15 +15,20 @@
 #include <unistd.h>
 #include <errno.h>
 #include <err.h>
+#include <pthread.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <sched.h>
 /***********/
 
 #include "sfs_types.h"
 #include "sfs_func.h"
 #include "sfs_disk.h"
+#include "sfs_lz.h"
 #include "sfs.h"
 
 
-void dump_directory();
+void dump_directory(struct sfs_mnt *mp, struct sfs_dir dir_entry[]);
 
 /* BIT operation Macros */
 /* a=target variable, b=bit number to act upon 0-n */
@@ -32,8 +37,313 @@ void dump_directory();
 #define BIT_FLIP(a,b) ((a) ^= (1<<(b)))
 #define BIT_CHECK(a,b) ((a) & (1<<(b)))
 
-static struct sfs_super spb;	// superblock
-static struct sfs_dir sd_cwd = { SFS_NOINO }; // current working directory
+/*
+ * Per-inode reader-writer lock, created on first use and freed
+ * when the last holder lets go.
+ *
+ * Lock order: a directory is always locked before anything found in
+ * it, so locks are taken top-down along the tree. "." and ".." are
+ * never locked as children of the directory that holds them; the
+ * parent lock is dropped first.
+ */
+struct ilock {
+	u_int32_t il_ino;
+	int il_refs;
+	pthread_rwlock_t il_rw;
+	struct ilock *il_next;
+};
+
+#define SFS_ILOCK_BUCKETS 128
+
+#define IL_READ  0
+#define IL_WRITE 1
+
+#define SFS_ITLOCKS 16
+
+/*
+ * The freemap is paged: a bitmap block is read in the first time its
+ * shard is used, and past SFS_BMPAGES loaded ones those not used
+ * lately are dropped again. Every change is written through, so a page
+ * is never dirty and can go at any time. Shards share SFS_BMLOCKS
+ * locks; sv_bmfree keeps each shard's free count once it is known,
+ * loaded or not, so allocation skips full shards without reading them.
+ */
+#define SFS_BMLOCKS 64
+#define SFS_BMPAGES 8192
+#define BM_UNKNOWN (-1)		// sv_bmfree of a shard never loaded
+
+/*
+ * A snapshot in memory: its log as a hash of block -> copy, open
+ * addressed, and the newest log block as it is on disk.
+ */
+#define SNAP_NOBLOCK 0xffffffff
+
+struct snap {
+	u_int32_t *sn_key;		// SNAP_NOBLOCK if empty
+	u_int32_t *sn_val;
+	u_int32_t sn_mask;
+	u_int32_t sn_count;
+	struct sfs_snaplog sn_log;
+};
+
+/*
+ * The dedup table is paged like the freemap, but a page stays dirty
+ * until ddt_sync so that a clone writes each table block once. Only
+ * volumes up to SFS_DDMAXBLOCKS get the hash index dedup needs.
+ */
+#define SFS_DDPAGES 1024
+#define SFS_DDMAXBLOCKS (1u << 22)
+#define DD_NOPAGE 0xffffffff
+
+struct ddpage {
+	u_int32_t dp_tb;		// table block held, DD_NOPAGE if none
+	int dp_dirty;
+	struct sfs_ddent dp_ent[SFS_DDPERBLOCK];
+};
+
+struct ddidx {
+	u_int32_t di_hash;
+	u_int32_t di_block;		// 0 if empty
+};
+
+/*
+ * Mounted volume, shared by every handle attached to it.
+ * Mounting an image that is already mounted in this process attaches
+ * to the same volume, so its state stays warm and consistent.
+ * The freemap is split into shards, one per bitmap block.
+ */
+struct sfs_vol {
+	struct disk sv_disk;		// disk image
+	struct sfs_super sv_spb;	// superblock
+	int sv_refs;			// attached handles
+	dev_t sv_dev;			// identity of the image file
+	ino_t sv_ino;
+	char *sv_path;			// as it was mounted
+	struct sfs_vol *sv_next;	// mounted volumes
+
+	/* superblock free count */
+	pthread_mutex_t sv_sblock;	// sv_reserved, superblock writes
+	u_int32_t sv_reserved;		// blocks promised to running operations
+	int sv_sbdirty;
+
+	/* Bitmap */
+	u_int8_t **sv_bmpage;		// per shard, NULL if not loaded
+	u_int8_t *sv_bmref;		// used since the clock last passed
+	u_int32_t sv_bm_size;
+	int sv_nshard;
+	pthread_mutex_t sv_bmlock[SFS_BMLOCKS];	// shard % SFS_BMLOCKS
+	int *sv_bmfree;			// free bits per bitmap block, or BM_UNKNOWN
+	int sv_bmhint;			// no free bits in the shards below
+	pthread_mutex_t sv_bmclock;	// the eviction hand
+	int sv_bmhand;
+	int sv_bmloaded;		// pages in memory
+
+	/* inode locks */
+	pthread_mutex_t sv_ilmtx[SFS_ILOCK_BUCKETS];
+	struct ilock *sv_ilocks[SFS_ILOCK_BUCKETS];
+
+	/* packed inode table (SFS_FEAT_ITABLE) */
+	int sv_packed;
+	u_int8_t *sv_imap;		// slots in use
+	pthread_mutex_t sv_imaplock;
+	pthread_mutex_t sv_itlock[SFS_ITLOCKS];	// table block read-modify-write
+	u_int32_t sv_inlinemax;		// largest file kept inline
+
+	/* dedup (SFS_FEAT_DEDUP) */
+	pthread_mutex_t sv_ddlock;	// table, index and import stats
+	struct ddpage *sv_ddpage;	// SFS_DDPAGES table blocks, NULL if no table
+	u_int32_t *sv_dddirty;		// pages to write at ddt_sync
+	u_int32_t sv_ddndirty;
+	struct ddidx *sv_ddidx;		// hash -> block, NULL if not indexed
+	u_int32_t sv_ddmask;
+	u_int32_t sv_ddcount;
+	int sv_dedup;			// cpin shares duplicate blocks
+	u_int64_t sv_impbytes;		// cpin since mount
+	u_int64_t sv_impblocks;
+	u_int64_t sv_imphits;		// blocks that were already there
+	double sv_impsecs;
+
+	/* snapshots (SFS_FEAT_SNAP) */
+	pthread_rwlock_t sv_snaplock;	// read: a change in flight; write: taking a snapshot
+	pthread_mutex_t sv_snmtx;	// table, maps and logs
+	struct sfs_snap sv_snaptab[SFS_MAXSNAP];	// the table block
+	struct snap sv_snap[SFS_MAXSNAP];	// same slots
+	int sv_order[SFS_MAXSNAP];	// slots, oldest first
+	int sv_nsnap;
+	int sv_newest;			// slot, -1 if none
+	u_int8_t *sv_fresh;		// blocks taken since the newest snapshot
+	u_int32_t *sv_freshep;		// per shard: sv_epoch its sv_fresh bits are for
+	u_int32_t sv_epoch;		// one more for every snapshot taken
+	int sv_rdonly;
+	int sv_shared;			// SFS_MOUNT_RDONLY: beside another process's writer
+	int sv_writing;			// changes in flight; sv_sblock
+	int sv_genout;			// and readers were told of them
+	struct sfs_vol *sv_base;	// a snapshot mount: the volume,
+	int sv_view;			// and the slot
+};
+
+/*
+ * Mount handle: one user of a mounted volume.
+ * A handle belongs to one thread at a time; threads sharing an image
+ * each take their own with sfs_mnt_dup().
+ * The plain sfs_* entry points work on a single default handle.
+ */
+struct sfs_mnt {
+	struct sfs_vol *sm_vol;		// mounted volume
+	struct disk *sm_dk;		// == &sm_vol->sv_disk
+	struct sfs_dir sm_cwd;		// current working directory
+
+	FILE *sm_out;			// command output
+
+	/* for cpin, cpout */
+	int sm_hostfd;
+	int sm_filesize;
+
+	struct sfs_file *sm_files[SFS_OPEN_MAX];	// open files, by fd
+};
+
+static struct sfs_mnt default_mnt = {
+	.sm_cwd = { SFS_NOINO },
+	.sm_hostfd = -1,
+};
+
+static struct sfs_vol *vol_list;	// mounted volumes
+static pthread_mutex_t vol_lock = PTHREAD_MUTEX_INITIALIZER;	// vol_list, sv_refs
+
+struct sfs_mnt *sfs_mnt_alloc(void)
+{
+	struct sfs_mnt *mp = (struct sfs_mnt*)malloc(sizeof(struct sfs_mnt));
+	if (mp == NULL)
+		err(1, "malloc");
+
+	bzero(mp, sizeof(struct sfs_mnt));
+	mp->sm_cwd.sfd_ino = SFS_NOINO;
+	mp->sm_out = stdout;
+	mp->sm_hostfd = -1;
+	return mp;
+}
+
+struct sfs_mnt *sfs_mnt_dup(struct sfs_mnt *mp)
+{
+	struct sfs_mnt *nmp = sfs_mnt_alloc();
+
+	nmp->sm_out = mp->sm_out;
+	if (mp->sm_cwd.sfd_ino == SFS_NOINO)
+		return nmp;
+
+	pthread_mutex_lock(&vol_lock);
+	mp->sm_vol->sv_refs++;
+	pthread_mutex_unlock(&vol_lock);
+
+	nmp->sm_vol = mp->sm_vol;
+	nmp->sm_dk = mp->sm_dk;
+	nmp->sm_cwd = mp->sm_cwd;
+	return nmp;
+}
+
+void sfs_mnt_setout(struct sfs_mnt *mp, FILE *out)
+{
+	mp->sm_out = out;
+}
+
+int sfs_mnt_mounted(struct sfs_mnt *mp)
+{
+	return mp->sm_vol != NULL;
+}
+
+/*
+ * The image a handle has mounted, and with *flags, how: a snapshot
+ * gives its image's volume, which its mount keeps open. NULL if none.
+ */
+const char *sfs_mnt_image(struct sfs_mnt *mp, int *flags)
+{
+	struct sfs_vol *vp = mp->sm_vol;
+
+	if (vp == NULL)
+		return NULL;
+	if (vp->sv_base != NULL)
+		vp = vp->sv_base;
+	*flags = vp->sv_shared ? SFS_MOUNT_RDONLY : 0;
+	return vp->sv_path;
+}
+
+void sfs_mnt_free(struct sfs_mnt *mp)
+{
+	sfs_umount_r(mp);
+	free(mp);
+}
+
+static struct ilock *inode_lock(struct sfs_mnt *mp, u_int32_t ino, int write)
+{
+	struct sfs_vol *vp = mp->sm_vol;
+	int b = ino % SFS_ILOCK_BUCKETS;
+	struct ilock *il;
+
+	pthread_mutex_lock(&vp->sv_ilmtx[b]);
+	for (il = vp->sv_ilocks[b]; il != NULL; il = il->il_next){
+		if (il->il_ino == ino)
+			break;
+	}
+	if (il == NULL){
+		il = (struct ilock*)malloc(sizeof(struct ilock));
+		if (il == NULL)
+			err(1, "malloc");
+		il->il_ino = ino;
+		il->il_refs = 0;
+		pthread_rwlock_init(&il->il_rw, NULL);
+		il->il_next = vp->sv_ilocks[b];
+		vp->sv_ilocks[b] = il;
+	}
+	il->il_refs++;
+	pthread_mutex_unlock(&vp->sv_ilmtx[b]);
+
+	if (write)
+		pthread_rwlock_wrlock(&il->il_rw);
+	else
+		pthread_rwlock_rdlock(&il->il_rw);
+	return il;
+}
+
+static void inode_unlock(struct sfs_mnt *mp, struct ilock *il)
+{
+	struct sfs_vol *vp = mp->sm_vol;
+	int b;
+	struct ilock **pp;
+
+	if (il == NULL)
+		return;
+	b = il->il_ino % SFS_ILOCK_BUCKETS;
+
+	pthread_rwlock_unlock(&il->il_rw);
+
+	pthread_mutex_lock(&vp->sv_ilmtx[b]);
+	if (--il->il_refs == 0){
+		for (pp = &vp->sv_ilocks[b]; *pp != il; pp = &(*pp)->il_next)
+			;
+		*pp = il->il_next;
+		pthread_rwlock_destroy(&il->il_rw);
+		free(il);
+	}
+	pthread_mutex_unlock(&vp->sv_ilmtx[b]);
+}
+
+/*
+ * Lock an inode found in the directory held by *plp.
+ * "." is the directory itself and is already held (returns NULL).
+ * ".." is an ancestor, so the directory lock is dropped first
+ * and *plp becomes NULL.
+ */
+static struct ilock *inode_lock_child(struct sfs_mnt *mp, struct ilock **plp, struct sfs_dir *de, int write)
+{
+	if (!strcmp(de->sfd_name, "."))
+		return NULL;
+
+	if (!strcmp(de->sfd_name, "..")){
+		inode_unlock(mp, *plp);
+		*plp = NULL;
+	}
+	return inode_lock(mp, de->sfd_ino, write);
+}
 
 
 /* for cpin, cpout */
@@ -41,104 +351,158 @@ static struct sfs_dir sd_cwd = { SFS_NOINO }; // current working directory
 #define EINTR 0
 #endif
 
-static int hostfd = -1;
-static int filesize;
 
-void custom_disk_open(const char *path){
-    assert(hostfd<0);
-    hostfd = open(path, O_RDWR);
+/*
+ * Host files for cpin and cpout. These fail with an error code rather
+ * than exit, since a server session shares the process: -12 or -18 if
+ * the file can't be opened or created, -14 if I/O on it fails.
+ */
+int custom_disk_open(struct sfs_mnt *mp, const char *path){
+    assert(mp->sm_hostfd<0);
+    mp->sm_hostfd = open(path, O_RDWR);
 
-    if (hostfd<0){
-        err(1, "%s", path);
+    if (mp->sm_hostfd<0){
+        return -12;
     }
+    return 0;
 }
 
-void custom_disk_open2(const char *path){
-    assert(hostfd<0);
-    hostfd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+int custom_disk_open2(struct sfs_mnt *mp, const char *path){
+    assert(mp->sm_hostfd<0);
+    mp->sm_hostfd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
 
-    if (hostfd<0){
-        err(1, "%s", path);
+    if (mp->sm_hostfd<0){
+        return -18;
     }
+    return 0;
 }
 
-void custom_disk_write(const void *data, u_int32_t loc){
+// writes nblocks blocks' worth, or what is left of the file
+int custom_disk_write_blocks(struct sfs_mnt *mp, const void *data, u_int32_t loc, u_int32_t nblocks){
     const char *cdata = data;
-    u_int32_t tot=0;
+    u_int32_t tot=0, want;
     int len;
 
-    assert(hostfd>=0);
+    assert(mp->sm_hostfd>=0);
 
-    if (lseek(hostfd, loc*SFS_BLOCKSIZE, SEEK_SET)<0){    // set file offset
-        err(1, "lssek");
-    }
+    want = nblocks*SFS_BLOCKSIZE;
+    if (want > mp->sm_filesize)
+        want = mp->sm_filesize;
 
-    while (tot < filesize){    // write one block size
-        len = write(hostfd, cdata + tot, 1);
+    while (tot < want){
+        len = pwrite(mp->sm_hostfd, cdata + tot, want - tot, loc*SFS_BLOCKSIZE + tot);
         if (len<0){
             if (errno==EINTR || errno==EAGAIN){
                 continue;
             }
-            err(1, "write");
+            return -14;
         }
         if (len==0){
-            err(1, "write returned 0?");
+            return -14;
         }
         tot += len;
-		if (tot % SFS_BLOCKSIZE == 0){
-			filesize -= tot;
-			return;
-		}
     }
-	filesize -= tot;
-	return;
+	mp->sm_filesize -= tot;
+	return 0;
+}
+
+int custom_disk_write(struct sfs_mnt *mp, const void *data, u_int32_t loc){
+	return custom_disk_write_blocks(mp, data, loc, 1);
 }
 
-int custom_disk_read(void *data, u_int32_t loc){
+// reads one block, or what is left of the file; -14 on an error
+int custom_disk_read(struct sfs_mnt *mp, void *data, u_int32_t loc){
     char *cdata = data;
-    int tot=0;
+    int tot=0, want;
     int len;
 
-    assert(hostfd>=0);
+    assert(mp->sm_hostfd>=0);
 
-    if (lseek(hostfd, loc*SFS_BLOCKSIZE, SEEK_SET)<0){ // set file offset
-        err(1, "lseek");
-    }
+    want = (mp->sm_filesize < SFS_BLOCKSIZE) ? mp->sm_filesize : SFS_BLOCKSIZE;
 
-    while (tot < filesize){
-        len = read(hostfd, cdata+tot, 1);
+    while (tot < want){
+        len = pread(mp->sm_hostfd, cdata+tot, want-tot, loc*SFS_BLOCKSIZE + tot);
 
         if (len < 0){
             if (errno==EINTR || errno==EAGAIN){
                 continue;
             }
-            err(1, "read");
+            return -14;
         }
+        if (len == 0)
+            break;	// file got shorter
 		tot += len;
-		if (tot % SFS_BLOCKSIZE == 0){
-			filesize -= tot;
-			return tot;
-		}
     }
-	filesize -= tot;
+	mp->sm_filesize -= tot;
     return tot;
 }
 
 
-void custom_disk_close(void){
-    assert(hostfd>=0);
-    if (close(hostfd)){
-        err(1, "close");
+int custom_disk_close(struct sfs_mnt *mp){
+    int error = 0;
+
+    assert(mp->sm_hostfd>=0);
+    if (close(mp->sm_hostfd)){
+        error = -14;
     }
-    hostfd = -1;
+    mp->sm_hostfd = -1;
+    return error;
+}
+
+/*
+ * Read-ahead for reading a file's blocks in order. The blocks ahead of
+ * the reader are asked for in a window that starts small and doubles
+ * each time the reader gets halfway into it, so short files cost
+ * nothing extra and long ones keep the image busy while the host file
+ * is written. A jump starts over with the small window.
+ */
+#define RA_MINWIN 4
+#define RA_MAXWIN 64
+#define RA_MAXRUN 32	// blocks per read
+
+struct rahead {
+	u_int32_t ra_next;	// where a sequential reader comes next
+	u_int32_t ra_ahead;	// blocks before this are asked for
+	u_int32_t ra_win;
+};
+
+static void rahead_init(struct rahead *ra){
+	ra->ra_next = 0;
+	ra->ra_ahead = 0;
+	ra->ra_win = RA_MINWIN;
+}
+
+/* the reader is at blocks[pos] of the file's n blocks (0 is a hole) */
+static void rahead_advance(struct sfs_mnt *mp, struct rahead *ra, const u_int32_t *blocks, u_int32_t n, u_int32_t pos){
+	u_int32_t end, run;
+
+	if (pos != ra->ra_next){	// not sequential
+		ra->ra_win = RA_MINWIN;
+		ra->ra_ahead = pos;
+	}
+	if (ra->ra_ahead < pos)
+		ra->ra_ahead = pos;
+	if (ra->ra_ahead >= n || pos + ra->ra_win/2 < ra->ra_ahead)
+		return;
+
+	end = pos + ra->ra_win;
+	if (end > n)
+		end = n;
+	while (ra->ra_ahead < end){	// one request per contiguous run
+		if (!blocks[ra->ra_ahead]){	// hole
+			ra->ra_ahead++;
+			continue;
+		}
+		for (run=1; ra->ra_ahead+run < end && blocks[ra->ra_ahead+run] == blocks[ra->ra_ahead]+run; run++)
+			;
+		disk_readahead_r(mp->sm_dk, blocks[ra->ra_ahead], run);
+		ra->ra_ahead += run;
+	}
+	if (ra->ra_win < RA_MAXWIN)
+		ra->ra_win *= 2;
 }
 
 
-/* Bitmap */
-static u_int8_t *BITMAP;
-static int bm_size;
-static int token_border;
-static int bit_border;
 
 
 
@@ -175,1241 +539,5769 @@ static int bit_border;
 
 // }
 
-u_int32_t take_free_block(){
-	
-	int token_num, bit_num=-1;
-	for (token_num=0; token_num<bm_size; token_num++){
-		if ( (token_num != token_border) && (BITMAP[token_num] == 255) )
-			continue;
+/*
+ * Blocks taken since the newest snapshot was, which no snapshot can
+ * be using: the first write to one need not keep its old contents.
+ * The bits of a shard are cleared when it is first used after a new
+ * snapshot, so taking one is O(1). Set with the shard lock held.
+ */
+static void mark_fresh(struct sfs_vol *vp, u_int32_t blockno){
 
-		int i;
-		if (token_num == token_border){	// crossed the token_border
-			for (i=0; i<bit_border; i++){
-				if (!BIT_CHECK(BITMAP[token_num], i)){
-					bit_num = i;
-					BIT_SET(BITMAP[token_num], i);	// mark as in use
-					// write bitmap back to disk
-					for (i=0; i<SFS_BITBLOCKS(spb.sp_nblocks); i++){
-						disk_write( &BITMAP[i*SFS_BLOCKSIZE], i+2);
-					}
-					break;
-				}
-			}
-			if (bit_num == -1){
-				return 0;	// no more free block
-			}
-			break;
-		} else{	// in token_border (free block must here)
-			int bflag=0;
-			for (i=0; i<8; i++){
-				if (!BIT_CHECK(BITMAP[token_num], i)){
-					bit_num = i;
-					BIT_SET(BITMAP[token_num], i);	// mark as in use
-					// write bitmap back to disk
-					for (i=0; i<SFS_BITBLOCKS(spb.sp_nblocks); i++){
-						disk_write( &BITMAP[i*SFS_BLOCKSIZE], i+2);
-					}
-					bflag = 1;
-					break;
-				}
-			}
-			if (bflag)
-				break;
-		}
-	}
-	if (bit_num == -1){
-		return 0;	// no more free block
+	int shard = blockno / SFS_BLOCKBITS;
+
+	if (vp->sv_fresh == NULL)
+		return;
+	if (vp->sv_freshep[shard] != vp->sv_epoch){
+		bzero(&vp->sv_fresh[shard * SFS_BLOCKSIZE], SFS_BLOCKSIZE);
+		__atomic_store_n(&vp->sv_freshep[shard], vp->sv_epoch, __ATOMIC_RELEASE);
 	}
+	__atomic_fetch_or(&vp->sv_fresh[blockno/8], 1 << (blockno%8), __ATOMIC_RELAXED);
+}
 
-	return (token_num * 8) + bit_num;	// free block number
+/*
+ * The fresh bits cost a bit per block, so a volume only has them once
+ * it has a snapshot: at mount, or at the first mksnap, with changes
+ * held off. The blocks taken before are not fresh for it anyway.
+ */
+static void fresh_alloc(struct sfs_vol *vp){
+
+	vp->sv_fresh = (u_int8_t*)malloc(vp->sv_bm_size);
+	vp->sv_freshep = (u_int32_t*)malloc(sizeof(u_int32_t) * vp->sv_nshard);
+	if (vp->sv_fresh == NULL || vp->sv_freshep == NULL)
+		err(1, "malloc");
+	bzero(vp->sv_freshep, sizeof(u_int32_t) * vp->sv_nshard);
 }
 
-void release_block(u_int32_t blockno){
-	/*
-		n in -> n/8 token, n%8 shift_nbit
-	*/
+static int block_fresh(struct sfs_vol *vp, u_int32_t blockno){
 
-	// convert
-	int token_num = blockno/8;
-	int shift_nbit = blockno%8;
+	int shard = blockno / SFS_BLOCKBITS;
 
-	BIT_CLEAR(BITMAP[token_num], shift_nbit);	// clear target bit
+	if (__atomic_load_n(&vp->sv_freshep[shard], __ATOMIC_ACQUIRE) != vp->sv_epoch)
+		return 0;
+	return BIT_CHECK(__atomic_load_n(&vp->sv_fresh[blockno/8], __ATOMIC_RELAXED), blockno%8);
+}
 
-	int i;
-	for (i=0; i<SFS_BITBLOCKS(spb.sp_nblocks); i++){
-		disk_write( &BITMAP[i*SFS_BLOCKSIZE], i+2);
+/* free bits of a loaded shard; bits past the end of the volume are not blocks */
+static int shard_free(struct sfs_vol *vp, int shard){
+
+	const u_int8_t *pg = vp->sv_bmpage[shard];
+	u_int32_t first = (u_int32_t)shard * SFS_BLOCKBITS, blockno;
+	u_int64_t w;
+	int i, nfree = 0;
+
+	if (vp->sv_spb.sp_nblocks - first >= SFS_BLOCKBITS){
+		for (i=0; i<SFS_BLOCKSIZE; i+=8){
+			memcpy(&w, &pg[i], 8);
+			nfree += 64 - __builtin_popcountll(w);
+		}
+		return nfree;
+	}
+	for (blockno=first; blockno<vp->sv_spb.sp_nblocks; blockno++){
+		if (!BIT_CHECK(pg[(blockno-first)/8], blockno%8))
+			nfree++;
 	}
+	return nfree;
 }
 
-void error_message(const char *message, const char *path, int error_code) {
-	switch (error_code) {
-	case -1:
-		printf("%s: %s: No such file or directory\n",message, path); return;
-	case -2:
-		printf("%s: %s: Not a directory\n",message, path); return;
-	case -3:
-		printf("%s: %s: Directory full\n",message, path); return;
-	case -4:
-		printf("%s: %s: No block available\n",message, path); return;
-	case -5:
-		printf("%s: %s: Not a directory\n",message, path); return;
-	case -6:
-		printf("%s: %s: Already exists\n",message, path); return;
-	case -7:
-		printf("%s: %s: Directory not empty\n",message, path); return;
-	case -8:
-		printf("%s: %s: Invalid argument\n",message, path); return;
-	case -9:
-		printf("%s: %s: Is a directory\n",message, path); return;
-	case -10:
-		printf("%s: %s: Is not a file\n",message, path); return;
-	case -11:
-		printf("%s: input file size exceeds the max file size\n", message); return;
-	case -12:
-		printf("%s: can't open %s input file\n", message, path); return;
-	default:
-		printf("unknown error code\n");
-		return;
+/*
+ * Drop loaded pages not used since the hand last passed them, until
+ * there are SFS_BMPAGES. Shards whose lock is busy are passed over,
+ * so this never waits, and a caller holding some can call it.
+ */
+static void bm_evict(struct sfs_vol *vp){
+
+	pthread_mutex_t *lk;
+	int n, shard;
+
+	if (pthread_mutex_trylock(&vp->sv_bmclock))
+		return;	// someone else is at it
+	for (n=0; n<2*vp->sv_nshard && __atomic_load_n(&vp->sv_bmloaded, __ATOMIC_RELAXED) > SFS_BMPAGES; n++){
+		shard = vp->sv_bmhand;
+		vp->sv_bmhand = (shard + 1) % vp->sv_nshard;
+		if (__atomic_load_n(&vp->sv_bmpage[shard], __ATOMIC_RELAXED) == NULL)
+			continue;	// looked at again under the lock
+		lk = &vp->sv_bmlock[shard % SFS_BMLOCKS];
+		if (pthread_mutex_trylock(lk))
+			continue;
+		if (vp->sv_bmpage[shard] != NULL){
+			if (vp->sv_bmref[shard]){
+				vp->sv_bmref[shard] = 0;
+			} else{
+				free(vp->sv_bmpage[shard]);
+				__atomic_store_n(&vp->sv_bmpage[shard], NULL, __ATOMIC_RELAXED);
+				__atomic_fetch_sub(&vp->sv_bmloaded, 1, __ATOMIC_RELAXED);
+			}
+		}
+		pthread_mutex_unlock(lk);
 	}
+	pthread_mutex_unlock(&vp->sv_bmclock);
 }
 
-void sfs_mount(const char* path)
-{
-	if( sd_cwd.sfd_ino !=  SFS_NOINO )
-	{
-		//umount
-		disk_close();
-		printf("%s, unmounted\n", spb.sp_volname);
-		bzero(&spb, sizeof(struct sfs_super));
-		sd_cwd.sfd_ino = SFS_NOINO;
+/*
+ * The bitmap block of a shard, read in if it is not loaded.
+ * Called with the shard lock held; the page stays until it is let go.
+ */
+static u_int8_t *bm_page(struct sfs_vol *vp, int shard){
+
+	u_int8_t *pg = vp->sv_bmpage[shard];
+
+	if (pg == NULL){
+		pg = (u_int8_t*)malloc(SFS_BLOCKSIZE);
+		if (pg == NULL)
+			err(1, "malloc");
+		disk_read_r(&vp->sv_disk, pg, SFS_MAP_LOCATION+shard);
+		__atomic_store_n(&vp->sv_bmpage[shard], pg, __ATOMIC_RELAXED);
+		if (vp->sv_bmfree[shard] == BM_UNKNOWN)
+			__atomic_store_n(&vp->sv_bmfree[shard], shard_free(vp, shard), __ATOMIC_SEQ_CST);
+		if (__atomic_add_fetch(&vp->sv_bmloaded, 1, __ATOMIC_RELAXED) > SFS_BMPAGES)
+			bm_evict(vp);
 	}
+	vp->sv_bmref[shard] = 1;
+	return pg;
+}
 
-	printf("Disk image: %s\n", path);
-
-	disk_open(path);
-	disk_read( &spb, SFS_SB_LOCATION );
-
-	printf("Superblock magic: %x\n", spb.sp_magic);
-
-	assert( spb.sp_magic == SFS_MAGIC );
-	
-	printf("Number of blocks: %d\n", spb.sp_nblocks);
-	printf("Volume name: %s\n", spb.sp_volname);
-	printf("%s, mounted\n", spb.sp_volname);
-	
-	sd_cwd.sfd_ino = 1;		//init at root
-	sd_cwd.sfd_name[0] = '/';
-	sd_cwd.sfd_name[1] = '\0';
+/*
+ * Let go of a page if it was not loaded before, for a pass over the
+ * whole bitmap that should not push out the pages allocation uses.
+ * Called with the shard lock held.
+ */
+static void bm_putback(struct sfs_vol *vp, int shard, int loaded){
 
-	bm_size = sizeof(u_int8_t) * SFS_BLOCKSIZE * SFS_BITBLOCKS(spb.sp_nblocks);	// set bitmap size
-	BITMAP = (u_int8_t*)malloc(bm_size);	// allocate bitmap loading space
-	token_border = (SFS_BITMAPSIZE(spb.sp_nblocks) / 8) + 1;
-	bit_border = SFS_BITMAPSIZE(spb.sp_nblocks) % 8;
+	if (loaded || vp->sv_bmpage[shard] == NULL)
+		return;
+	free(vp->sv_bmpage[shard]);
+	__atomic_store_n(&vp->sv_bmpage[shard], NULL, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&vp->sv_bmloaded, 1, __ATOMIC_RELAXED);
 }
 
-void sfs_umount() {
+/*
+ * Take the first n free bits of one shard into blocks, or as many as
+ * it has. Returns how many it took.
+ * Called with the shard lock held.
+ */
+static u_int32_t take_from_shard(struct sfs_vol *vp, int shard, u_int32_t *blocks, u_int32_t n){
 
-	if( sd_cwd.sfd_ino !=  SFS_NOINO )
-	{
-		//umount
-		disk_close();
-		printf("%s, unmounted\n", spb.sp_volname);
-		bzero(&spb, sizeof(struct sfs_super));
-		sd_cwd.sfd_ino = SFS_NOINO;
+	u_int8_t *pg = bm_page(vp, shard);
+	u_int32_t first = (u_int32_t)shard * SFS_BLOCKBITS;
+	u_int32_t got = 0;
+	int token_num, i;
+
+	for (token_num=0; token_num<SFS_BLOCKSIZE && got<n; token_num++){
+		if (pg[token_num] == 255)
+			continue;
 
-		//remove bitmap loading space
-		bm_size = 0;
-		token_border = 0;
-		bit_border = 0;
-		free(BITMAP);
+		for (i=0; i<8 && got<n; i++){
+			u_int32_t blockno = first + (token_num * 8) + i;
+			if (blockno >= vp->sv_spb.sp_nblocks)
+				goto done;	// past the end of the volume
+			if (!BIT_CHECK(pg[token_num], i)){
+				BIT_SET(pg[token_num], i);	// mark as in use
+				mark_fresh(vp, blockno);
+				blocks[got++] = blockno;
+			}
+		}
+	}
+done:
+	if (got){
+		// write the bitmap block back to disk, once for all of them
+		disk_write_nohook_r(&vp->sv_disk, pg, SFS_MAP_LOCATION+shard);
+		vp->sv_bmfree[shard] -= got;
+		__atomic_fetch_sub(&vp->sv_spb.sp_nfree, got, __ATOMIC_RELAXED);
+		vp->sv_sbdirty = 1;
 	}
+	return got;
 }
 
-void sfs_touch(const char* path)
-{
-
-	int empty_dtre_found=0;
-	int empty_direct_ptr=0;
+/*
+ * First fit starts at sv_bmhint, so a big volume that is full at the
+ * front is not walked from shard 0 every time. A shard seen full
+ * moves the hint past it and one given a block back moves it down;
+ * each rechecks after the other's move, so the hint never passes a
+ * shard with a free block.
+ */
+static void hint_lower(struct sfs_vol *vp, int shard){
 
-	struct sfs_dir *modified_drtblock;
-	u_int32_t origin_drtblock_no;
-	u_int32_t fbn;
+	int h = __atomic_load_n(&vp->sv_bmhint, __ATOMIC_SEQ_CST);
 
-	struct sfs_inode ci;
-	disk_read( &ci, sd_cwd.sfd_ino );
+	while (h > shard && !__atomic_compare_exchange_n(&vp->sv_bmhint, &h, shard, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		;
+}
 
-	//for consistency
-	assert( ci.sfi_type == SFS_TYPE_DIR );
+static void hint_full(struct sfs_vol *vp, int shard){
 
+	int h = shard;
 
-	// check if the path already exists
-	// cwd inode direct ptr loop
-	int i;
-	struct sfs_dir *tempdrte;
-	for (i=0; i<SFS_NDIRECT; i++){
-		// if direct ptr in use,
-		if (ci.sfi_direct[i]){
-			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
-			disk_read( cdtrb, ci.sfi_direct[i] );
+	if (__atomic_compare_exchange_n(&vp->sv_bmhint, &h, shard + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) &&
+	    __atomic_load_n(&vp->sv_bmfree[shard], __ATOMIC_SEQ_CST) != 0)
+		hint_lower(vp, shard);
+}
 
-			// cwd directory entry loop
-			int j;
-			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
-				if (!empty_dtre_found && (cdtrb[j].sfd_ino == SFS_NOINO)){	// fisrt empty directory entry found
-					empty_dtre_found = 1;
-					tempdrte = &cdtrb[j];
-					modified_drtblock = cdtrb;
-					origin_drtblock_no = ci.sfi_direct[i];
-				}
+/*
+ * First fit over the shards for n blocks. Shards another thread is
+ * allocating from are skipped on the first pass, so concurrent
+ * allocators spread out instead of queueing on the first shard with
+ * space. Returns how many it took; fewer than n only when the volume
+ * is full.
+ */
+static u_int32_t vol_take_blocks(struct sfs_vol *vp, u_int32_t *blocks, u_int32_t n){
+
+	int pass, shard;
+	u_int32_t got = 0;
+
+	for (pass=0; pass<2; pass++){
+		for (shard=__atomic_load_n(&vp->sv_bmhint, __ATOMIC_SEQ_CST); shard<vp->sv_nshard; shard++){
+			if (__atomic_load_n(&vp->sv_bmfree[shard], __ATOMIC_RELAXED) == 0){
+				hint_full(vp, shard);
+				continue;
+			}
 
-				// if directory entry in use, and path already exists
-				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, path) == 0) ){
-					error_message("touch", path, -6);
-					return;
-				}
+			if (pass == 0){
+				if (pthread_mutex_trylock(&vp->sv_bmlock[shard % SFS_BMLOCKS]))
+					continue;
+			} else{
+				pthread_mutex_lock(&vp->sv_bmlock[shard % SFS_BMLOCKS]);
 			}
-			if (empty_dtre_found)
-				break;
+			got += take_from_shard(vp, shard, &blocks[got], n - got);
+			pthread_mutex_unlock(&vp->sv_bmlock[shard % SFS_BMLOCKS]);
 
-		} else {
-			empty_direct_ptr = i;
-			break;
+			if (got == n)
+				return got;
 		}
 	}
+	return got;
+}
 
+static u_int32_t vol_take_block(struct sfs_vol *vp){
 
-	if(!empty_dtre_found && !empty_direct_ptr){	// directory full
-		error_message("touch", path, -3);
-		return;
-	}
+	u_int32_t blockno;
 
-	// clear loaded bitmap
-	bzero(BITMAP, bm_size);
-	// load bitmap
-	for (i=0; i<SFS_BITBLOCKS(spb.sp_nblocks); i++){
-		disk_read( &BITMAP[i*SFS_BLOCKSIZE], i+2);
-	}
+	if (vol_take_blocks(vp, &blockno, 1) == 0)
+		return 0;	// no more free block
+	return blockno;
+}
 
-	/* for new file i-node*/
+u_int32_t take_free_block(struct sfs_mnt *mp){
+	return vol_take_block(mp->sm_vol);
+}
 
-	// path not exists
-	struct sfs_inode new_inode;
-	bzero(&new_inode,SFS_BLOCKSIZE); // initalize sfi_direct[] and sfi_indirect
-	new_inode.sfi_size = 0;
-	new_inode.sfi_type = SFS_TYPE_FILE;
+/* n blocks at once, each bitmap block written once; see vol_take_blocks */
+static u_int32_t take_free_blocks(struct sfs_mnt *mp, u_int32_t *blocks, u_int32_t n){
+	return vol_take_blocks(mp->sm_vol, blocks, n);
+}
 
-	// print_bitmap();
+static void vol_release_block(struct sfs_vol *vp, u_int32_t blockno){
+	/*
+		n in -> n/8 token, n%8 shift_nbit
+	*/
 
-	fbn = take_free_block();	// find first free block, get free block number, and mark the bitmap
-	if (!fbn){	// no more free block
-		error_message("touch", path, -4);
-		return;
+	// convert
+	int shard = blockno/SFS_BLOCKBITS;
+	int token_num = (blockno%SFS_BLOCKBITS)/8;
+	int shift_nbit = blockno%8;
+	u_int8_t *pg;
+
+	pthread_mutex_lock(&vp->sv_bmlock[shard % SFS_BMLOCKS]);
+	pg = bm_page(vp, shard);
+	if (BIT_CHECK(pg[token_num], shift_nbit)){
+		BIT_CLEAR(pg[token_num], shift_nbit);	// clear target bit
+		__atomic_fetch_add(&vp->sv_bmfree[shard], 1, __ATOMIC_SEQ_CST);
+		hint_lower(vp, shard);
+		__atomic_fetch_add(&vp->sv_spb.sp_nfree, 1, __ATOMIC_RELAXED);
+		vp->sv_sbdirty = 1;
 	}
-	u_int32_t cifbn = fbn;
+	disk_write_nohook_r(&vp->sv_disk, pg, SFS_MAP_LOCATION+shard);
+	pthread_mutex_unlock(&vp->sv_bmlock[shard % SFS_BMLOCKS]);
+}
 
+void release_block(struct sfs_mnt *mp, u_int32_t blockno){
+	vol_release_block(mp->sm_vol, blockno);
+}
 
-	/* for directory block (current or new) */
-	if(!empty_dtre_found){
-		// new direct ptr -> new directory block allocate
-		struct sfs_dir new_dtrb[SFS_DENTRYPERBLOCK];
-		int i;
-		for(i=0; i<SFS_DENTRYPERBLOCK; i++){
-			new_dtrb[i].sfd_ino = SFS_NOINO;
-		}
+static int blockno_cmp(const void *a, const void *b){
 
-		fbn = take_free_block();
-		if (!fbn){	// no more free block
-			error_message("touch", path, -4);
-			return;
-		}
+	u_int32_t x = *(const u_int32_t*)a, y = *(const u_int32_t*)b;
 
-		new_dtrb[0].sfd_ino = cifbn;
-		bzero(new_dtrb[0].sfd_name, SFS_NAMELEN);
-		strncpy(new_dtrb[0].sfd_name, path, SFS_NAMELEN);
-		disk_write(new_dtrb, fbn);
+	return (x > y) - (x < y);
+}
 
-		ci.sfi_direct[empty_direct_ptr] = fbn;	// parent direct ptr update (for new directory block)
-	} else{	// found empty directory entry
-		tempdrte->sfd_ino = cifbn;
-		bzero(tempdrte->sfd_name, SFS_NAMELEN);
-		strncpy(tempdrte->sfd_name, path, SFS_NAMELEN);
-		disk_write(modified_drtblock, origin_drtblock_no);
+/*
+ * Give back n blocks at once. They are sorted so each shard is locked
+ * and its bitmap block written once, however many of them it holds.
+ */
+static void release_blocks(struct sfs_mnt *mp, u_int32_t *blocks, u_int32_t n){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	u_int32_t i, freed;
+	u_int8_t *pg;
+	int shard;
+
+	qsort(blocks, n, sizeof(u_int32_t), blockno_cmp);
+	for (i=0; i<n; ){
+		shard = blocks[i]/SFS_BLOCKBITS;
+		freed = 0;
+		pthread_mutex_lock(&vp->sv_bmlock[shard % SFS_BMLOCKS]);
+		pg = bm_page(vp, shard);
+		for ( ; i<n && blocks[i]/SFS_BLOCKBITS == (u_int32_t)shard; i++){
+			if (BIT_CHECK(pg[(blocks[i]%SFS_BLOCKBITS)/8], blocks[i]%8)){
+				BIT_CLEAR(pg[(blocks[i]%SFS_BLOCKBITS)/8], blocks[i]%8);
+				freed++;
+			}
+		}
+		if (freed){
+			__atomic_fetch_add(&vp->sv_bmfree[shard], freed, __ATOMIC_SEQ_CST);
+			hint_lower(vp, shard);
+			__atomic_fetch_add(&vp->sv_spb.sp_nfree, freed, __ATOMIC_RELAXED);
+			vp->sv_sbdirty = 1;
+		}
+		disk_write_nohook_r(&vp->sv_disk, pg, SFS_MAP_LOCATION+shard);
+		pthread_mutex_unlock(&vp->sv_bmlock[shard % SFS_BMLOCKS]);
 	}
+}
 
-	// child i-node write back
-	disk_write(&new_inode, cifbn);
+/*
+ * Promise n blocks to an operation before it does any I/O, so it
+ * cannot run out halfway. Returns 0, or -4 if they are not there.
+ * The promise is conservative: blocks taken under it still count as
+ * reserved until unreserve_blocks().
+ */
+static int reserve_blocks(struct sfs_mnt *mp, u_int32_t n){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	int ret = 0;
+
+	pthread_mutex_lock(&vp->sv_sblock);
+	if (__atomic_load_n(&vp->sv_spb.sp_nfree, __ATOMIC_RELAXED) < vp->sv_reserved + n)
+		ret = -4;
+	else
+		vp->sv_reserved += n;
+	pthread_mutex_unlock(&vp->sv_sblock);
+	return ret;
+}
 
-	/* for parent i-node */
+static void unreserve_blocks(struct sfs_mnt *mp, u_int32_t n){
 
-	ci.sfi_size += sizeof(struct sfs_dir);	// file size up (one directory entry added)
-	disk_write( &ci, sd_cwd.sfd_ino );
+	struct sfs_vol *vp = mp->sm_vol;
 
+	pthread_mutex_lock(&vp->sv_sblock);
+	vp->sv_reserved -= n;
+	pthread_mutex_unlock(&vp->sv_sblock);
 }
 
-void sfs_cd(const char* path)
-{
+/* note on disk that the image uses a feature; written by sb_sync */
+static void sb_setfeature(struct sfs_vol *vp, u_int32_t feat){
 
-	// get cwd's inode
-	struct sfs_inode ci;
-	disk_read( &ci, sd_cwd.sfd_ino );
+	pthread_mutex_lock(&vp->sv_sblock);
+	if (!(vp->sv_spb.sp_features & feat)){
+		vp->sv_spb.sp_features |= feat;
+		vp->sv_sbdirty = 1;
+	}
+	pthread_mutex_unlock(&vp->sv_sblock);
+}
 
-	//for consistency
-	assert( ci.sfi_type == SFS_TYPE_DIR );
+/*
+ * Write the superblock; sv_sblock held. Readers not told of the
+ * changes in flight go on seeing the sp_gen from before them.
+ */
+static void sb_write(struct sfs_vol *vp){
 
-	// if path null
-	if (path == NULL){
-		sd_cwd.sfd_ino = 1;
-		sd_cwd.sfd_name[0] = '/';
-		sd_cwd.sfd_name[1] = '\0';
-		return;
-	}
+	struct sfs_super spb = vp->sv_spb;
 
-	// if path not null
-	// cwd inode direct ptr loop
-	int i;
-	for (i=0; i<SFS_NDIRECT; i++){
-		// if direct ptr in use,
-		if (ci.sfi_direct[i]){
-			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
-			disk_read( cdtrb, ci.sfi_direct[i] );
+	if (spb.sp_gen % 2 && !vp->sv_genout)
+		spb.sp_gen--;
+	vp->sv_sbdirty = 0;
+	disk_write_r(&vp->sv_disk, &spb, SFS_SB_LOCATION);
+}
 
-			// cwd directory entry loop
-			int j;
-			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
-				// if directory entry in use, and path found
-				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, path) == 0) ){
-					struct sfs_inode pathi;
-					disk_read( &pathi, cdtrb[j].sfd_ino );
+static void sb_sync(struct sfs_vol *vp){
 
-					// if directory
-					if (pathi.sfi_type == SFS_TYPE_DIR){
-						// change cwd
-						sd_cwd.sfd_ino = cdtrb[j].sfd_ino;
-						bzero(sd_cwd.sfd_name, SFS_NAMELEN);
-						strncpy(sd_cwd.sfd_name, cdtrb[j].sfd_name, SFS_NAMELEN);
-						return;
-					} else{	// if not a directory
-						error_message("cd", path, -2);
-						return;
-					}
-				}
-			}
+	pthread_mutex_lock(&vp->sv_sblock);
+	if (vp->sv_sbdirty)
+		sb_write(vp);
+	pthread_mutex_unlock(&vp->sv_sblock);
+}
 
+/*
+ * Snapshots (see sfs.h). Live blocks never move: the snapshot side
+ * takes the copy, so inode numbers and every handle's cwd stay valid.
+ * The maps, logs and table are under sv_snmtx, and their own blocks
+ * are written past the hook.
+ */
+static u_int32_t snap_find(struct snap *sn, u_int32_t blockno){
+
+	u_int32_t h;
+
+	if (sn->sn_key == NULL)
+		return SNAP_NOBLOCK;
+	for (h = (blockno * 2654435761u) & sn->sn_mask; sn->sn_key[h] != SNAP_NOBLOCK; h = (h + 1) & sn->sn_mask){
+		if (sn->sn_key[h] == blockno)
+			return sn->sn_val[h];
+	}
+	return SNAP_NOBLOCK;
+}
+
+static void snap_insert(struct snap *sn, u_int32_t blockno, u_int32_t copy){
+
+	u_int32_t *okey = sn->sn_key, *oval = sn->sn_val;
+	u_int32_t osize = okey ? sn->sn_mask + 1 : 0, size, h, i;
+
+	if ((sn->sn_count + 1) * 2 > osize){
+		size = osize ? osize * 2 : 64;
+		sn->sn_key = (u_int32_t*)malloc(size * sizeof(u_int32_t));
+		sn->sn_val = (u_int32_t*)malloc(size * sizeof(u_int32_t));
+		if (sn->sn_key == NULL || sn->sn_val == NULL)
+			err(1, "malloc");
+		memset(sn->sn_key, 0xff, size * sizeof(u_int32_t));
+		sn->sn_mask = size - 1;
+		sn->sn_count = 0;
+		for (i=0; i<osize; i++){
+			if (okey[i] != SNAP_NOBLOCK)
+				snap_insert(sn, okey[i], oval[i]);
 		}
+		free(okey);
+		free(oval);
 	}
+	for (h = (blockno * 2654435761u) & sn->sn_mask; sn->sn_key[h] != SNAP_NOBLOCK; h = (h + 1) & sn->sn_mask)
+		;
+	sn->sn_key[h] = blockno;
+	sn->sn_val[h] = copy;
+	sn->sn_count++;
+}
 
-	// path not found
-	error_message("cd", path, -1);
-	return;
+static void snap_free(struct snap *sn){
+
+	free(sn->sn_key);
+	free(sn->sn_val);
+	bzero(sn, sizeof(struct snap));
 }
 
-void sfs_ls(const char* path)
-{
+static void snap_table_write(struct sfs_vol *vp){
 
-	// get cwd's inode
-	struct sfs_inode ci;
-	disk_read( &ci, sd_cwd.sfd_ino );
+	disk_write_nohook_r(&vp->sv_disk, vp->sv_snaptab, vp->sv_spb.sp_snap);
+}
 
-	//for consistency
-	assert( ci.sfi_type == SFS_TYPE_DIR );
+/* sv_order and sv_newest from the table */
+static void snap_sort(struct sfs_vol *vp){
 
-	// if path null
-	if (path == NULL){
-		// cwd inode direct ptr loop
-		int i;
-		for (i=0; i<SFS_NDIRECT; i++){
-			// if direct ptr in use,
-			if (ci.sfi_direct[i]){
-				struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
-				disk_read( cdtrb, ci.sfi_direct[i] );
+	int i, j, slot;
 
-				// cwd directory entry loop
-				int j;
-				for (j=0; j<SFS_DENTRYPERBLOCK; j++){
-					// if directory entry is use
-					if (cdtrb[j].sfd_ino != SFS_NOINO){
-						struct sfs_inode tempi;
-						disk_read( &tempi, cdtrb[j].sfd_ino );
+	vp->sv_nsnap = 0;
+	for (slot=0; slot<SFS_MAXSNAP; slot++){
+		if (vp->sv_snaptab[slot].ss_name[0] == '\0')
+			continue;
+		for (i = vp->sv_nsnap++; i > 0; i--){
+			j = vp->sv_order[i-1];
+			if (vp->sv_snaptab[j].ss_seq < vp->sv_snaptab[slot].ss_seq)
+				break;
+			vp->sv_order[i] = j;
+		}
+		vp->sv_order[i] = slot;
+	}
+	vp->sv_newest = vp->sv_nsnap ? vp->sv_order[vp->sv_nsnap - 1] : -1;
+}
 
-						// if directory
-						if (tempi.sfi_type == SFS_TYPE_DIR){
-							printf("%s/\t", cdtrb[j].sfd_name);
-						} else{	// if file
-							printf("%s\t", cdtrb[j].sfd_name);
-						}
-					}
-				}
+/* at mount: read the table and every log */
+static void snap_load(struct sfs_vol *vp){
+
+	struct sfs_snaplog lb;
+	u_int32_t blockno, k;
+	int slot;
 
+	disk_read_r(&vp->sv_disk, vp->sv_snaptab, vp->sv_spb.sp_snap);
+	for (slot=0; slot<SFS_MAXSNAP; slot++){
+		if (vp->sv_snaptab[slot].ss_name[0] == '\0')
+			continue;
+		vp->sv_snaptab[slot].ss_nkept = 0;
+		for (blockno = vp->sv_snaptab[slot].ss_log; blockno; blockno = lb.sl_next){
+			disk_read_r(&vp->sv_disk, &lb, blockno);
+			if (blockno == vp->sv_snaptab[slot].ss_log)
+				vp->sv_snap[slot].sn_log = lb;
+			for (k=0; k<lb.sl_n; k++){
+				snap_insert(&vp->sv_snap[slot], lb.sl_map[k][0], lb.sl_map[k][1]);
+				vp->sv_snaptab[slot].ss_nkept++;
 			}
 		}
-		printf("\n");
-		return;
 	}
+	snap_sort(vp);
+}
 
-	// if path not null
-	// cwd inode direct ptr loop
-	int i;
-	for (i=0; i<SFS_NDIRECT; i++){
-		// if direct ptr in use,
-		if (ci.sfi_direct[i]){
-			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
-			disk_read( cdtrb, ci.sfi_direct[i] );
+/*
+ * Blocks the snapshot side takes leave what operations have reserved
+ * alone: when the volume is that full, the snapshot is given up
+ * instead of a change failing halfway.
+ */
+static u_int32_t snap_take_block(struct sfs_vol *vp){
 
-			// cwd directory entry loop
-			int j;
-			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
-				// if directory entry in use, and path found
-				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, path) == 0) ){
-					struct sfs_inode pathi;
-					disk_read( &pathi, cdtrb[j].sfd_ino );
+	if (__atomic_load_n(&vp->sv_spb.sp_nfree, __ATOMIC_RELAXED) <= vp->sv_reserved)
+		return 0;
+	return vol_take_block(vp);
+}
 
-					// if path is directory
-					if (pathi.sfi_type == SFS_TYPE_DIR){
-						// path inode direct ptr loop
-						int k;
-						for (k=0; k<SFS_NDIRECT; k++){
-							// if direct ptr in use,
-							if (pathi.sfi_direct[k]){
-								struct sfs_dir pdtrb[SFS_DENTRYPERBLOCK];
-								disk_read( pdtrb, pathi.sfi_direct[k] );
+/* a block of the snapshot side goes back, cleared like any other */
+static void snap_put_block(struct sfs_vol *vp, u_int32_t blockno){
 
-								// path directory entry loop
-								int l;
-								for (l=0; l<SFS_DENTRYPERBLOCK; l++){
-									// if directory entry in use
-									if (pdtrb[l].sfd_ino != SFS_NOINO){
-										struct sfs_inode tempi;
-										disk_read( &tempi, pdtrb[l].sfd_ino );
+	char zero[SFS_BLOCKSIZE];
 
-										// if directory
-										if (tempi.sfi_type == SFS_TYPE_DIR){
-											printf("%s/\t", pdtrb[l].sfd_name);
-										} else{	// if file
-											printf("%s\t", pdtrb[l].sfd_name);
-										}
-									}
-								}
+	bzero(zero, SFS_BLOCKSIZE);
+	disk_write_nohook_r(&vp->sv_disk, zero, blockno);
+	vol_release_block(vp, blockno);
+}
 
-							}
-						}
-					} else { // if path is file
-						printf("%s", cdtrb[j].sfd_name);
-					}
-					printf("\n");
-					return;
-				}
+/* log that slot's copy of blockno is at copy. Returns 0, or -4 */
+static int snap_log(struct sfs_vol *vp, int slot, u_int32_t blockno, u_int32_t copy){
+
+	struct sfs_snap *ss = &vp->sv_snaptab[slot];
+	struct snap *sn = &vp->sv_snap[slot];
+	u_int32_t lb;
+	int newblock = 0;
+
+	if (ss->ss_log == 0 || sn->sn_log.sl_n == SFS_SNAPLOGENT){
+		lb = snap_take_block(vp);
+		if (!lb)
+			return -4;
+		bzero(&sn->sn_log, SFS_BLOCKSIZE);
+		sn->sn_log.sl_next = ss->ss_log;
+		ss->ss_log = lb;
+		newblock = 1;
+	}
+	sn->sn_log.sl_map[sn->sn_log.sl_n][0] = blockno;
+	sn->sn_log.sl_map[sn->sn_log.sl_n][1] = copy;
+	sn->sn_log.sl_n++;
+	disk_write_nohook_r(&vp->sv_disk, &sn->sn_log, ss->ss_log);
+	if (newblock)
+		snap_table_write(vp);	// after the block it points to
+	snap_insert(sn, blockno, copy);
+	ss->ss_nkept++;
+	return 0;
+}
 
-			}
+/* keep blockno as it is now for the newest snapshot */
+static void snap_keep(struct sfs_vol *vp, u_int32_t blockno){
 
-		}
-	}
+	struct sfs_snap *ss = &vp->sv_snaptab[vp->sv_newest];
+	char data[SFS_BLOCKSIZE];
+	u_int32_t copy;
 
-	// path not found
-	error_message("ls", path, -1);
-	return;
+	disk_read_r(&vp->sv_disk, data, blockno);
+	copy = snap_take_block(vp);
+	if (copy){
+		disk_write_nohook_r(&vp->sv_disk, data, copy);
+		if (snap_log(vp, vp->sv_newest, blockno, copy) == 0)
+			return;
+		snap_put_block(vp, copy);
+	}
+	ss->ss_flags |= SFS_SNAP_BROKEN;
+	snap_table_write(vp);
+	warnx("%s: snapshot %s lost, no space to keep block %u", vp->sv_spb.sp_volname, ss->ss_name, blockno);
 }
 
+/* dk_prewrite of a mounted volume */
+static void snap_prewrite(void *arg, u_int32_t blockno){
 
+	struct sfs_vol *vp = arg;
 
-void sfs_mkdir(const char* org_path) 
-{
+	if (vp->sv_newest < 0 || block_fresh(vp, blockno))
+		return;
 
-	int empty_dtre_found=0;
-	int empty_direct_ptr=0;
+	pthread_mutex_lock(&vp->sv_snmtx);
+	if (vp->sv_newest >= 0 && !(vp->sv_snaptab[vp->sv_newest].ss_flags & SFS_SNAP_BROKEN)
+	    && snap_find(&vp->sv_snap[vp->sv_newest], blockno) == SNAP_NOBLOCK)
+		snap_keep(vp, blockno);
+	pthread_mutex_unlock(&vp->sv_snmtx);
+}
 
-	struct sfs_dir *modified_drtblock;
-	u_int32_t origin_drtblock_no;
-	u_int32_t fbn;
+/* dk_remap of a snapshot mount: its copy, or a newer snapshot's */
+static u_int32_t snap_remap(void *arg, u_int32_t blockno){
 
-	struct sfs_inode ci;
-	disk_read( &ci, sd_cwd.sfd_ino );
+	struct sfs_vol *view = arg, *vp = view->sv_base;
+	u_int32_t copy = SNAP_NOBLOCK;
+	int i;
 
-	//for consistency
-	assert( ci.sfi_type == SFS_TYPE_DIR );
+	pthread_mutex_lock(&vp->sv_snmtx);
+	for (i=0; i<vp->sv_nsnap && vp->sv_order[i] != view->sv_view; i++)
+		;
+	for (; i<vp->sv_nsnap && copy == SNAP_NOBLOCK; i++){
+		copy = snap_find(&vp->sv_snap[vp->sv_order[i]], blockno);
+	}
+	pthread_mutex_unlock(&vp->sv_snmtx);
+	return (copy == SNAP_NOBLOCK) ? blockno : copy;
+}
 
+/*
+ * Readers in other processes learn of changes from sp_gen: it is odd
+ * from the start of the first change in flight to the end of the
+ * last, so one that reads it even and the same as before has missed
+ * nothing (see vol_refresh). Handles here only need it in memory: it
+ * is written out at both ends only while a reader has the image
+ * open, or at the end if the start went out after all.
+ */
+static void gen_bump(struct sfs_vol *vp){
+
+	vp->sv_spb.sp_gen++;
+	if (vp->sv_spb.sp_gen % 2 ? disk_shared_r(&vp->sv_disk) :
+	    (vp->sv_genout || disk_shared_r(&vp->sv_disk))){
+		vp->sv_genout = vp->sv_spb.sp_gen % 2;
+		sb_write(vp);
+	}
+}
 
-	// check if the path already exists
-	// cwd inode direct ptr loop
-	int i;
-	struct sfs_dir *tempdrte;
-	for (i=0; i<SFS_NDIRECT; i++){
-		// if direct ptr in use,
-		if (ci.sfi_direct[i]){
-			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
-			disk_read( cdtrb, ci.sfi_direct[i] );
+/*
+ * Every change to the tree runs between these, so a snapshot, which
+ * waits for the changes in flight and holds off new ones, never sees
+ * one half done. Returns -15 on a read-only mount.
+ */
+static int write_begin(struct sfs_mnt *mp){
+
+	struct sfs_vol *vp = mp->sm_vol;
+
+	if (vp->sv_rdonly)
+		return -15;
+	pthread_rwlock_rdlock(&vp->sv_snaplock);
+	pthread_mutex_lock(&vp->sv_sblock);
+	if (vp->sv_writing++ == 0)
+		gen_bump(vp);
+	pthread_mutex_unlock(&vp->sv_sblock);
+	return 0;
+}
 
-			// cwd directory entry loop
-			int j;
-			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
-				if (!empty_dtre_found && (cdtrb[j].sfd_ino == SFS_NOINO)){	// fisrt empty directory entry found
-					empty_dtre_found = 1;
-					tempdrte = &cdtrb[j];
-					modified_drtblock = cdtrb;
-					origin_drtblock_no = ci.sfi_direct[i];
-				}
+static void write_end(struct sfs_mnt *mp){
 
-				// if directory entry in use, and path already exists
-				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, org_path) == 0) ){
-					error_message("mkdir", org_path, -6);
-					return;
-				}
-			}
-			if (empty_dtre_found)
-				break;
+	struct sfs_vol *vp = mp->sm_vol;
 
-		} else {
-			empty_direct_ptr = i;
-			break;
-		}
-	}
+	pthread_mutex_lock(&vp->sv_sblock);
+	if (--vp->sv_writing == 0)
+		gen_bump(vp);
+	pthread_mutex_unlock(&vp->sv_sblock);
+	pthread_rwlock_unlock(&vp->sv_snaplock);
+	disk_commit_r(mp->sm_dk);
+}
 
+/*
+ * Catch a reader mount up with the writer before a command: wait a
+ * while for changes in flight to land, then if any were made since it
+ * last looked, take the new superblock and forget what it read of the
+ * bitmap. The rest is read afresh by every command, checksums from
+ * the writer's own table, so a reader never has to remount. A command
+ * that overlaps a change may still see part of it.
+ */
+#define REFRESH_WAIT 1000	// ms
 
-	if(!empty_dtre_found && !empty_direct_ptr){	// directory full
-		error_message("mkdir", org_path, -3);
+static void vol_refresh(struct sfs_mnt *mp){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	struct sfs_super spb;
+	int i;
+
+	if (vp == NULL || !vp->sv_shared)
 		return;
+	for (i=0; ; i++){
+		// the writer's checksum of it may lag behind it
+		disk_read_unchecked_r(&vp->sv_disk, &spb, SFS_SB_LOCATION, 1);
+		if (spb.sp_gen % 2 == 0 || i == REFRESH_WAIT)
+			break;
+		usleep(1000);
 	}
 
-	int ndpfbn;
-	if(!empty_dtre_found){
-		ndpfbn = take_free_block();
-		if (!ndpfbn){	// no more free block
-			error_message("mkdir", org_path, -4);
-			return;
+	pthread_mutex_lock(&vp->sv_sblock);
+	if (spb.sp_gen != vp->sv_spb.sp_gen){
+		for (i=0; i<SFS_BMLOCKS; i++){
+			pthread_mutex_lock(&vp->sv_bmlock[i]);
+		}
+		for (i=0; i<vp->sv_nshard; i++){
+			bm_putback(vp, i, 0);
+			vp->sv_bmfree[i] = BM_UNKNOWN;
+		}
+		vp->sv_bmhint = 0;
+		for (i=SFS_BMLOCKS-1; i>=0; i--){
+			pthread_mutex_unlock(&vp->sv_bmlock[i]);
 		}
+		vp->sv_spb = spb;
 	}
+	pthread_mutex_unlock(&vp->sv_sblock);
+}
+
+/*
+ * Inode I/O. Without an inode table an inode is its whole block;
+ * with one it is a slot in a table block, rewritten in place.
+ */
+void inode_read(struct sfs_mnt *mp, struct sfs_inode *inode, u_int32_t ino){
 
-	// clear loaded bitmap
-	bzero(BITMAP, bm_size);
-	// load bitmap
-	for (i=0; i<SFS_BITBLOCKS(spb.sp_nblocks); i++){
-		disk_read( &BITMAP[i*SFS_BLOCKSIZE], i+2);
+	struct sfs_vol *vp = mp->sm_vol;
+	char tblock[SFS_BLOCKSIZE];
+	u_int32_t blockno;
+
+	if (!vp->sv_packed){
+		disk_read_r(mp->sm_dk, inode, ino);
+		return;
 	}
 
+	blockno = vp->sv_spb.sp_itable + ino/SFS_PINODEPERBLOCK;
+	pthread_mutex_lock(&vp->sv_itlock[blockno % SFS_ITLOCKS]);
+	disk_read_r(mp->sm_dk, tblock, blockno);
+	pthread_mutex_unlock(&vp->sv_itlock[blockno % SFS_ITLOCKS]);
 
-	/* for child direcory i-node*/
+	bzero(inode, SFS_BLOCKSIZE);
+	memcpy(inode, &tblock[(ino%SFS_PINODEPERBLOCK) * SFS_PINODESIZE], SFS_PINODESIZE);
+}
 
-	// path not exists
-	struct sfs_inode new_inode;
-	bzero(&new_inode,SFS_BLOCKSIZE); // initalize sfi_direct[] and sfi_indirect
-	new_inode.sfi_size = sizeof(struct sfs_dir) * 2;
-	new_inode.sfi_type = SFS_TYPE_DIR;
+void inode_write(struct sfs_mnt *mp, const struct sfs_inode *inode, u_int32_t ino){
 
-	// print_bitmap();
+	struct sfs_vol *vp = mp->sm_vol;
+	char tblock[SFS_BLOCKSIZE];
+	u_int32_t blockno;
 
-	fbn = take_free_block();	// find first free block, get free block number, and mark the bitmap
-	if (!fbn){	// no more free block
-		error_message("mkdir", org_path, -4);
+	if (!vp->sv_packed){
+		disk_write_r(mp->sm_dk, inode, ino);
 		return;
 	}
-	u_int32_t cifbn = fbn;
 
+	blockno = vp->sv_spb.sp_itable + ino/SFS_PINODEPERBLOCK;
+	pthread_mutex_lock(&vp->sv_itlock[blockno % SFS_ITLOCKS]);
+	disk_read_r(mp->sm_dk, tblock, blockno);
+	memcpy(&tblock[(ino%SFS_PINODEPERBLOCK) * SFS_PINODESIZE], inode, SFS_PINODESIZE);
+	disk_write_r(mp->sm_dk, tblock, blockno);
+	pthread_mutex_unlock(&vp->sv_itlock[blockno % SFS_ITLOCKS]);
+}
 
-	/* for child directory directory block */
+/*
+ * Read many inodes that are likely neighbours (a directory's children)
+ * keeping the last table block around. Only for callers holding the
+ * directory, so the inodes cannot change under them.
+ */
+struct iblk {
+	u_int32_t ib_blockno;
+	char ib_data[SFS_BLOCKSIZE];
+};
 
-	struct sfs_dir new_chdtrb[SFS_DENTRYPERBLOCK];
-	for(i=0; i<SFS_DENTRYPERBLOCK; i++){
-		new_chdtrb[i].sfd_ino = SFS_NOINO;
-	}
+static void inode_read_cached(struct sfs_mnt *mp, struct iblk *ib, struct sfs_inode *inode, u_int32_t ino){
 
-	fbn = take_free_block();
-	if (!fbn){	// no more free block
-		error_message("mkdir", org_path, -4);
+	struct sfs_vol *vp = mp->sm_vol;
+	u_int32_t blockno;
+
+	if (!vp->sv_packed){
+		disk_read_r(mp->sm_dk, inode, ino);
 		return;
 	}
-	u_int32_t cdfbn = fbn;
 
-	bzero(new_chdtrb[0].sfd_name, SFS_NAMELEN);
-	bzero(new_chdtrb[1].sfd_name, SFS_NAMELEN);
-	strncpy(new_chdtrb[0].sfd_name, ".", SFS_NAMELEN);
-	strncpy(new_chdtrb[1].sfd_name, "..", SFS_NAMELEN);
-	new_chdtrb[0].sfd_ino = cifbn;
-	new_chdtrb[1].sfd_ino = sd_cwd.sfd_ino;
-	new_inode.sfi_direct[0] = cdfbn;
+	blockno = vp->sv_spb.sp_itable + ino/SFS_PINODEPERBLOCK;
+	if (ib->ib_blockno != blockno){
+		pthread_mutex_lock(&vp->sv_itlock[blockno % SFS_ITLOCKS]);
+		disk_read_r(mp->sm_dk, ib->ib_data, blockno);
+		pthread_mutex_unlock(&vp->sv_itlock[blockno % SFS_ITLOCKS]);
+		ib->ib_blockno = blockno;
+	}
+	bzero(inode, SFS_BLOCKSIZE);
+	memcpy(inode, &ib->ib_data[(ino%SFS_PINODEPERBLOCK) * SFS_PINODESIZE], SFS_PINODESIZE);
+}
 
+/*
+ * Find an inode for a new file in directory near. With an inode table
+ * the search starts at near's slot, so siblings share table blocks.
+ * Returns 0 if there is none.
+ */
+u_int32_t take_free_inode(struct sfs_mnt *mp, u_int32_t near){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	u_int32_t n, ino;
+
+	if (!vp->sv_packed)
+		return take_free_block(mp);
+
+	pthread_mutex_lock(&vp->sv_imaplock);
+	for (n=0; n<vp->sv_spb.sp_ninodes; n++){
+		ino = (near + n) % vp->sv_spb.sp_ninodes;
+		if (!BIT_CHECK(vp->sv_imap[ino/8], ino%8)){
+			BIT_SET(vp->sv_imap[ino/8], ino%8);
+			pthread_mutex_unlock(&vp->sv_imaplock);
+			return ino;
+		}
+	}
+	pthread_mutex_unlock(&vp->sv_imaplock);
+	return 0;
+}
 
+/* n inodes at once; returns how many it found */
+static u_int32_t take_free_inodes(struct sfs_mnt *mp, u_int32_t near, u_int32_t *inos, u_int32_t n){
 
-	/* for parent directory block (current or new) */
+	struct sfs_vol *vp = mp->sm_vol;
+	u_int32_t i, got = 0, ino;
 
-	if(!empty_dtre_found){
-		// new direct ptr -> new directory block allocate
-		struct sfs_dir new_dtrb[SFS_DENTRYPERBLOCK];
-		bzero(new_dtrb, SFS_BLOCKSIZE);
-		int i;
-		for(i=0; i<SFS_DENTRYPERBLOCK; i++){
-			new_dtrb[i].sfd_ino = SFS_NOINO;
+	if (!vp->sv_packed)
+		return take_free_blocks(mp, inos, n);
+
+	pthread_mutex_lock(&vp->sv_imaplock);
+	for (i=0; i<vp->sv_spb.sp_ninodes && got<n; i++){
+		ino = (near + i) % vp->sv_spb.sp_ninodes;
+		if (!BIT_CHECK(vp->sv_imap[ino/8], ino%8)){
+			BIT_SET(vp->sv_imap[ino/8], ino%8);
+			inos[got++] = ino;
 		}
+	}
+	pthread_mutex_unlock(&vp->sv_imaplock);
+	return got;
+}
 
-		new_dtrb[0].sfd_ino = cifbn;
-		bzero(new_dtrb[0].sfd_name, SFS_NAMELEN);
-		strncpy(new_dtrb[0].sfd_name, org_path, SFS_NAMELEN);
-		disk_write(new_dtrb, ndpfbn);
+/* the inode itself must already be written back zeroed */
+void release_inode(struct sfs_mnt *mp, u_int32_t ino){
 
-		ci.sfi_direct[empty_direct_ptr] = ndpfbn;	// parent direct ptr update (for new directory block)
-	} else{	// found empty directory entry
-		tempdrte->sfd_ino = cifbn;
-		bzero(tempdrte->sfd_name, SFS_NAMELEN);
-		strncpy(tempdrte->sfd_name, org_path, SFS_NAMELEN);
-		disk_write(modified_drtblock, origin_drtblock_no);
+	struct sfs_vol *vp = mp->sm_vol;
+
+	if (!vp->sv_packed){
+		release_block(mp, ino);
+		return;
 	}
 
-	// child directory directory block write back
-	disk_write(new_chdtrb, cdfbn);
-	// child i-node write back
-	disk_write(&new_inode, cifbn);
+	pthread_mutex_lock(&vp->sv_imaplock);
+	BIT_CLEAR(vp->sv_imap[ino/8], ino%8);
+	pthread_mutex_unlock(&vp->sv_imaplock);
+}
 
-	/* for parent i-node */
+/*
+ * Take n consecutive free blocks, for tables that are addressed by
+ * their first block and for defrag. Returns the first, or 0.
+ */
+static u_int32_t take_free_run(struct sfs_mnt *mp, u_int32_t n){
 
-	ci.sfi_size += sizeof(struct sfs_dir);	// file size up (one directory entry added)
-	disk_write( &ci, sd_cwd.sfd_ino );
+	struct sfs_vol *vp = mp->sm_vol;
+	u_int32_t blockno, first, end, start = 0, len = 0;
+	u_int8_t *pg;
+	int shard, loaded;
 
+	// every lock, in order; other allocators only ever hold one
+	for (shard=0; shard<SFS_BMLOCKS; shard++){
+		pthread_mutex_lock(&vp->sv_bmlock[shard]);
+	}
+	for (shard=0; shard<vp->sv_nshard && len<n; shard++){
+		first = (u_int32_t)shard * SFS_BLOCKBITS;
+		end = (vp->sv_spb.sp_nblocks - first < SFS_BLOCKBITS) ? vp->sv_spb.sp_nblocks : first + SFS_BLOCKBITS;
+		if (vp->sv_bmfree[shard] == 0){	// all used
+			len = 0;
+			continue;
+		}
+		if (vp->sv_bmfree[shard] == end - first){	// all free
+			if (len == 0)
+				start = first;
+			len += end - first;
+			continue;
+		}
+		loaded = vp->sv_bmpage[shard] != NULL;
+		pg = bm_page(vp, shard);
+		for (blockno=first; blockno<end && len<n; blockno++){
+			if (blockno % 8 == 0 && pg[(blockno-first)/8] == 255 && end - blockno >= 8){
+				len = 0;
+				blockno += 7;	// a full byte at once
+			} else if (BIT_CHECK(pg[(blockno-first)/8], blockno%8)){
+				len = 0;
+			} else if (len++ == 0){
+				start = blockno;
+			}
+		}
+		bm_putback(vp, shard, loaded);
+	}
+	if (len >= n){
+		for (shard=start/SFS_BLOCKBITS; shard<=(start+n-1)/SFS_BLOCKBITS; shard++){
+			first = (u_int32_t)shard * SFS_BLOCKBITS;
+			pg = bm_page(vp, shard);
+			for (blockno=(start > first ? start : first); blockno<start+n && blockno-first<SFS_BLOCKBITS; blockno++){
+				BIT_SET(pg[(blockno-first)/8], blockno%8);
+				mark_fresh(vp, blockno);
+				vp->sv_bmfree[shard]--;
+			}
+			disk_write_nohook_r(&vp->sv_disk, pg, SFS_MAP_LOCATION+shard);
+		}
+		__atomic_fetch_sub(&vp->sv_spb.sp_nfree, n, __ATOMIC_RELAXED);
+		vp->sv_sbdirty = 1;
+	}
+	for (shard=SFS_BMLOCKS-1; shard>=0; shard--){
+		pthread_mutex_unlock(&vp->sv_bmlock[shard]);
+	}
+	return (len >= n) ? start : 0;
 }
 
+/*
+ * Dedup and clones. The table on disk holds a reference count for
+ * every shared block, and a content hash for the data blocks dedup
+ * may share. Only SFS_DDPAGES of its blocks are in memory, each in the
+ * slot its number picks; a change marks its page dirty and ddt_sync
+ * writes the dirty ones before sv_ddlock is let go. The hashed blocks
+ * are indexed by hash in sv_ddidx, open addressed, built at mount from
+ * the whole table; that is why dedup is for volumes up to
+ * SFS_DDMAXBLOCKS only, while clones share blocks at any size. A hash
+ * match is only a hint and the block is compared before it is shared.
+ * A shared block is never written in place: a file changing one takes
+ * its own copy first.
+ */
+static u_int32_t block_hash(const void *data){
+
+	const char *p = data;
+	u_int64_t h = 0x9e3779b97f4a7c15ULL, w;
+	int i;
 
+	for (i=0; i<SFS_BLOCKSIZE; i+=8){
+		memcpy(&w, p + i, 8);
+		h ^= w * 0xff51afd7ed558ccdULL;
+		h = ((h << 31) | (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+	}
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+	return (u_int32_t)h;
+}
 
-void sfs_rmdir(const char* org_path) 
-{
-	// get cwd's inode
-	struct sfs_inode ci;
-	disk_read( &ci, sd_cwd.sfd_ino );
+static void ddt_index_alloc(struct sfs_vol *vp, u_int32_t size){
 
-	//for consistency
-	assert( ci.sfi_type == SFS_TYPE_DIR );
+	vp->sv_ddidx = (struct ddidx*)calloc(size, sizeof(struct ddidx));
+	if (vp->sv_ddidx == NULL)
+		err(1, "malloc");
+	vp->sv_ddmask = size - 1;
+}
 
-	// check invalid
-	if (!strcmp(org_path, ".")){
-		error_message("rmdir", ".", -8);
+static void ddt_link(struct sfs_vol *vp, u_int32_t blockno, u_int32_t hash){
+
+	struct ddidx *old = vp->sv_ddidx;
+	u_int32_t i, size = vp->sv_ddmask + 1;
+
+	if (old == NULL)
+		return;	// not indexed, too big for dedup
+	if ((vp->sv_ddcount + 1) * 2 > size){
+		// twice the size, at most half full
+		ddt_index_alloc(vp, size * 2);
+		vp->sv_ddcount = 0;
+		for (i=0; i<size; i++){
+			if (old[i].di_block)
+				ddt_link(vp, old[i].di_block, old[i].di_hash);
+		}
+		free(old);
+	}
+	for (i = hash & vp->sv_ddmask; vp->sv_ddidx[i].di_block; i = (i + 1) & vp->sv_ddmask)
+		;
+	vp->sv_ddidx[i].di_hash = hash;
+	vp->sv_ddidx[i].di_block = blockno;
+	vp->sv_ddcount++;
+}
+
+static void ddt_unlink(struct sfs_vol *vp, u_int32_t blockno, u_int32_t hash){
+
+	struct ddidx *idx = vp->sv_ddidx;
+	u_int32_t i, j, k, mask = vp->sv_ddmask;
+
+	if (idx == NULL)
 		return;
+	for (i = hash & mask; idx[i].di_block != blockno; i = (i + 1) & mask){
+		if (!idx[i].di_block)
+			return;
+	}
+	// close the gap: move back what would not be found past it
+	for (j = (i + 1) & mask; idx[j].di_block; j = (j + 1) & mask){
+		k = idx[j].di_hash & mask;
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		idx[i] = idx[j];
+		i = j;
 	}
+	idx[i].di_block = 0;
+	vp->sv_ddcount--;
+}
 
-	// find path
-	// cwd inode direct ptr loop
-	int i;
-	for (i=0; i<SFS_NDIRECT; i++){
-		// if direct ptr in use,
-		if (ci.sfi_direct[i]){
-			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
-			disk_read( cdtrb, ci.sfi_direct[i] );
+static void ddt_put(struct sfs_vol *vp, struct ddpage *dp){
 
-			// cwd directory entry loop
-			int j;
-			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
-				// if directory entry in use, and path found
-				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, org_path) == 0) ){
-					struct sfs_inode pathi;
-					disk_read( &pathi, cdtrb[j].sfd_ino );
+	disk_write_nohook_r(&vp->sv_disk, dp->dp_ent, vp->sv_spb.sp_ddt + dp->dp_tb);
+	dp->dp_dirty = 0;
+}
 
-					// if directory
-					if (pathi.sfi_type == SFS_TYPE_DIR){
+/* blockno's entry, valid until the next ddt_ent; sv_ddlock held */
+static struct sfs_ddent *ddt_ent(struct sfs_vol *vp, u_int32_t blockno){
 
-						// check if directory not empty
-						// child inode direct ptr loop
-						int k;
-						for (k=0; k<SFS_NDIRECT; k++){
-							if (pathi.sfi_direct[k]){
-								struct sfs_dir chdtrb[SFS_DENTRYPERBLOCK];
-								disk_read( chdtrb, pathi.sfi_direct[k]);
+	u_int32_t tb = blockno / SFS_DDPERBLOCK;
+	struct ddpage *dp = &vp->sv_ddpage[tb % SFS_DDPAGES];
 
-								// child directory entry loop
-								int l;
-								for (l=0; l<SFS_DENTRYPERBLOCK; l++){
-									if (chdtrb[l].sfd_ino != SFS_NOINO){
-										if ( (strcmp(chdtrb[l].sfd_name, ".") != 0) && (strcmp(chdtrb[l].sfd_name, "..") != 0) ){
-											error_message("rmdir", org_path, -7);
-											return;
-										}
-									}
-								}
-							}
-						}
+	if (dp->dp_tb != tb){
+		if (dp->dp_dirty)
+			ddt_put(vp, dp);
+		disk_read_r(&vp->sv_disk, dp->dp_ent, vp->sv_spb.sp_ddt + tb);
+		dp->dp_tb = tb;
+	}
+	return &dp->dp_ent[blockno % SFS_DDPERBLOCK];
+}
 
-						/* directory empty */
+/* write back every dirty page */
+static void ddt_sync(struct sfs_vol *vp){
 
-						// clear loaded bitmap
-						bzero(BITMAP, bm_size);
-						// load bitmap
-						for (k=0; k<SFS_BITBLOCKS(spb.sp_nblocks); k++){
-							disk_read( &BITMAP[k*SFS_BLOCKSIZE], k+2);
-						}
+	u_int32_t i;
 
-						/* directory entry i-node number release */
-						int tmpchinum = cdtrb[j].sfd_ino;
-						cdtrb[j].sfd_ino = SFS_NOINO;
-						disk_write(cdtrb, ci.sfi_direct[i]);
-						// puts("directory entry disk updated");
+	for (i=0; i<vp->sv_ddndirty; i++){
+		if (vp->sv_ddpage[vp->sv_dddirty[i]].dp_dirty)
+			ddt_put(vp, &vp->sv_ddpage[vp->sv_dddirty[i]]);
+	}
+	vp->sv_ddndirty = 0;
+}
 
-						ci.sfi_size -= sizeof(struct sfs_dir);	// decrease parent size info
-						disk_write(&ci, sd_cwd.sfd_ino);
-						// puts("parent inode disk updated");
+/* blockno's entry was changed; it goes to disk at ddt_sync */
+static void ddt_write(struct sfs_vol *vp, u_int32_t blockno){
 
-						/* directory block pointed by direct_ptr release */
-						for (k=0; k<SFS_NDIRECT; k++){
-							if (pathi.sfi_direct[k]){
-								// clear the datablock
+	u_int32_t slot = blockno / SFS_DDPERBLOCK % SFS_DDPAGES;
+
+	if (vp->sv_ddpage[slot].dp_dirty)
+		return;
+	if (vp->sv_ddndirty == SFS_DDPAGES)
+		ddt_sync(vp);	// the list also holds pages put since
+	vp->sv_ddpage[slot].dp_dirty = 1;
+	vp->sv_dddirty[vp->sv_ddndirty++] = slot;
+}
+
+static void ddt_alloc(struct sfs_vol *vp){
+
+	u_int32_t i;
+
+	vp->sv_ddpage = (struct ddpage*)malloc(SFS_DDPAGES * sizeof(struct ddpage));
+	vp->sv_dddirty = (u_int32_t*)malloc(SFS_DDPAGES * sizeof(u_int32_t));
+	if (vp->sv_ddpage == NULL || vp->sv_dddirty == NULL)
+		err(1, "malloc");
+	for (i=0; i<SFS_DDPAGES; i++){
+		vp->sv_ddpage[i].dp_tb = DD_NOPAGE;
+		vp->sv_ddpage[i].dp_dirty = 0;
+	}
+	vp->sv_ddndirty = 0;
+	vp->sv_ddcount = 0;
+	if (vp->sv_spb.sp_nblocks <= SFS_DDMAXBLOCKS)
+		ddt_index_alloc(vp, 64);
+}
+
+/* at mount: index the hashed blocks, if the volume is not too big */
+static void ddt_load(struct sfs_vol *vp){
+
+	struct sfs_ddent ent[SFS_DDPERBLOCK];
+	u_int32_t i, j;
+
+	ddt_alloc(vp);
+	if (vp->sv_ddidx == NULL)
+		return;
+	for (i=0; i<vp->sv_spb.sp_ddtblocks; i++){
+		disk_read_r(&vp->sv_disk, ent, vp->sv_spb.sp_ddt + i);
+		for (j=0; j<SFS_DDPERBLOCK; j++){
+			if (ent[j].dd_flags & SFS_DD_HASHED)
+				ddt_link(vp, i * SFS_DDPERBLOCK + j, ent[j].dd_hash);
+		}
+	}
+}
+
+/* make the table; called with sv_ddlock held */
+static int ddt_create(struct sfs_mnt *mp){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	u_int32_t n = (vp->sv_spb.sp_nblocks + SFS_DDPERBLOCK - 1) / SFS_DDPERBLOCK;
+	char zero[SFS_BLOCKSIZE];
+	u_int32_t start, i;
+
+	if (reserve_blocks(mp, n))
+		return -4;
+	start = take_free_run(mp, n);
+	unreserve_blocks(mp, n);
+	if (!start)
+		return -4;
+
+	bzero(zero, SFS_BLOCKSIZE);
+	for (i=0; i<n; i++){
+		disk_write_nohook_r(&vp->sv_disk, zero, start + i);
+	}
+	vp->sv_spb.sp_ddtblocks = n;
+	ddt_alloc(vp);
+
+	pthread_mutex_lock(&vp->sv_sblock);
+	vp->sv_spb.sp_ddt = start;
+	vp->sv_spb.sp_features |= SFS_FEAT_DEDUP;
+	vp->sv_sbdirty = 1;
+	pthread_mutex_unlock(&vp->sv_sblock);
+	sb_sync(vp);
+	return 0;
+}
+
+/*
+ * A block already holding data, with a reference taken for the
+ * caller; 0 if there is none.
+ */
+static u_int32_t dedup_find(struct sfs_mnt *mp, const void *data, u_int32_t hash){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	char block[SFS_BLOCKSIZE];
+	struct sfs_ddent *de;
+	u_int32_t i, blockno = 0;
+
+	pthread_mutex_lock(&vp->sv_ddlock);
+	if (vp->sv_ddidx == NULL)
+		goto out;
+	for (i = hash & vp->sv_ddmask; vp->sv_ddidx[i].di_block; i = (i + 1) & vp->sv_ddmask){
+		if (vp->sv_ddidx[i].di_hash != hash)
+			continue;
+		if (ddt_ent(vp, vp->sv_ddidx[i].di_block)->dd_refs == SFS_DDMAXREFS)
+			continue;
+		disk_read_r(mp->sm_dk, block, vp->sv_ddidx[i].di_block);
+		if (memcmp(block, data, SFS_BLOCKSIZE) == 0){
+			blockno = vp->sv_ddidx[i].di_block;
+			de = ddt_ent(vp, blockno);
+			de->dd_refs++;
+			ddt_write(vp, blockno);
+			break;
+		}
+	}
+	ddt_sync(vp);
+out:
+	pthread_mutex_unlock(&vp->sv_ddlock);
+	return blockno;
+}
+
+/* a new data block the caller holds the only reference to */
+static void dedup_add(struct sfs_mnt *mp, u_int32_t blockno, u_int32_t hash){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	struct sfs_ddent *de;
+
+	pthread_mutex_lock(&vp->sv_ddlock);
+	de = ddt_ent(vp, blockno);
+	de->dd_refs = 1;
+	de->dd_flags = SFS_DD_HASHED;
+	de->dd_hash = hash;
+	ddt_write(vp, blockno);
+	ddt_link(vp, blockno, hash);
+	ddt_sync(vp);
+	pthread_mutex_unlock(&vp->sv_ddlock);
+}
+
+/*
+ * Drop a reference to a data block. Returns 1 if it was the last one
+ * and the block is the caller's to free.
+ */
+static int block_unref(struct sfs_mnt *mp, u_int32_t blockno){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	struct sfs_ddent *de;
+	int last = 1;
+
+	if (vp->sv_ddpage == NULL)
+		return 1;
+
+	pthread_mutex_lock(&vp->sv_ddlock);
+	de = ddt_ent(vp, blockno);
+	if (de->dd_refs){
+		if (--de->dd_refs)
+			last = 0;
+		else if (de->dd_flags & SFS_DD_HASHED){
+			ddt_unlink(vp, blockno, de->dd_hash);
+			de->dd_flags = 0;
+		}
+		ddt_write(vp, blockno);
+		ddt_sync(vp);
+	}
+	pthread_mutex_unlock(&vp->sv_ddlock);
+	return last;
+}
+
+/* a file lets go of one of its data blocks */
+static void put_data_block(struct sfs_mnt *mp, u_int32_t blockno){
+
+	char tempdb[SFS_BLOCKSIZE];
+
+	if (!block_unref(mp, blockno))
+		return;	// still shared
+	// clear the datablock
+	bzero(tempdb, SFS_BLOCKSIZE);
+	disk_write_r(mp->sm_dk, tempdb, blockno);
+	// update bitmap
+	release_block(mp, blockno);
+}
+
+/*
+ * Take one more reference to each of n blocks (0 entries are holes),
+ * for a clone; a block with no entry had one owner. Either all are
+ * taken or none. Returns 0, or -4 if a count is full or there is no
+ * room for the table.
+ */
+static int block_ref(struct sfs_mnt *mp, const u_int32_t *blocks, int n){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	u_int16_t old[SFS_DBPERIDB];
+	struct sfs_ddent *de;
+	int i, error = 0;
+
+	assert(n <= SFS_DBPERIDB);
+	pthread_mutex_lock(&vp->sv_ddlock);
+	if (vp->sv_ddpage == NULL && ddt_create(mp)){
+		error = -4;
+		goto out;
+	}
+	for (i=0; i<n; i++){
+		if (!blocks[i])
+			continue;
+		de = ddt_ent(vp, blocks[i]);
+		old[i] = de->dd_refs;
+		if (old[i] == SFS_DDMAXREFS){
+			// undo in reverse, a block may be in the list twice
+			while (--i >= 0){
+				if (blocks[i]){
+					ddt_ent(vp, blocks[i])->dd_refs = old[i];
+					ddt_write(vp, blocks[i]);
+				}
+			}
+			error = -4;
+			break;
+		}
+		de->dd_refs = (old[i] ? old[i] : 1) + 1;
+		// a file's blocks are mostly neighbours: one write per page
+		ddt_write(vp, blocks[i]);
+	}
+	ddt_sync(vp);
+out:
+	pthread_mutex_unlock(&vp->sv_ddlock);
+	return error;
+}
+
+/*
+ * Is the caller the only owner of the block? If so it is about to be
+ * changed, so it leaves the dedup index first.
+ */
+static int block_own(struct sfs_mnt *mp, u_int32_t blockno){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	struct sfs_ddent *de;
+	int own = 1;
+
+	if (vp->sv_ddpage == NULL)
+		return 1;
+
+	pthread_mutex_lock(&vp->sv_ddlock);
+	de = ddt_ent(vp, blockno);
+	if (de->dd_refs > 1)
+		own = 0;
+	else if (de->dd_refs || de->dd_flags){
+		if (de->dd_flags & SFS_DD_HASHED)
+			ddt_unlink(vp, blockno, de->dd_hash);
+		de->dd_refs = 0;
+		de->dd_flags = 0;
+		ddt_write(vp, blockno);
+		ddt_sync(vp);
+	}
+	pthread_mutex_unlock(&vp->sv_ddlock);
+	return own;
+}
+
+/*
+ * A file lets go of its indirect block. Clones share it, and the
+ * blocks behind it are only let go of with the last reference.
+ */
+static void put_ptr_block(struct sfs_mnt *mp, u_int32_t blockno){
+
+	u_int32_t realblock[SFS_DBPERIDB];
+	int k;
+
+	if (!block_unref(mp, blockno))
+		return;	// still shared
+	disk_read_r(mp->sm_dk, realblock, blockno);	// get real direct_ptrs' block
+	for (k=0; k<SFS_DBPERIDB; k++){
+		if (realblock[k])
+			put_data_block(mp, realblock[k]);
+	}
+
+	bzero(realblock, SFS_BLOCKSIZE);	// clear real block
+	disk_write_r(mp->sm_dk, realblock, blockno);
+	release_block(mp, blockno);	// update bitmap
+}
+
+/*
+ * Read a file's indirect block into realblock, copying it first if
+ * it is shared, so the file may change it. Returns 0, or -4 if no
+ * block is available.
+ */
+static int ptr_block_own(struct sfs_mnt *mp, struct sfs_inode *inode, u_int32_t *realblock){
+
+	u_int32_t blockno;
+
+	disk_read_r(mp->sm_dk, realblock, inode->sfi_indirect);
+	if (block_own(mp, inode->sfi_indirect))
+		return 0;
+
+	// the copy is one more owner of every block behind it
+	blockno = take_free_block(mp);
+	if (!blockno)
+		return -4;
+	if (block_ref(mp, realblock, SFS_DBPERIDB)){
+		release_block(mp, blockno);
+		return -4;
+	}
+	disk_write_r(mp->sm_dk, realblock, blockno);
+	put_ptr_block(mp, inode->sfi_indirect);
+	inode->sfi_indirect = blockno;
+	return 0;
+}
+
+/*
+ * Make block index of a file its own before the file writes it: a
+ * block shared with another file, and the indirect block leading to
+ * it, are copied first. *blocknop is the block to write, 0 for a
+ * hole. The caller writes the inode back. Returns 0, or -4 if no
+ * block is available.
+ */
+int file_block_cow(struct sfs_mnt *mp, struct sfs_inode *inode, u_int32_t index, u_int32_t *blocknop){
+
+	u_int32_t realblock[SFS_DBPERIDB];
+	char data[SFS_BLOCKSIZE];
+	u_int32_t *ptr, blockno;
+
+	*blocknop = 0;
+	if (index < SFS_NDIRECT)
+		ptr = &inode->sfi_direct[index];
+	else{
+		if (!inode->sfi_indirect)
+			return 0;
+		if (ptr_block_own(mp, inode, realblock))
+			return -4;
+		ptr = &realblock[index - SFS_NDIRECT];
+	}
+
+	if (*ptr && !block_own(mp, *ptr)){
+		blockno = take_free_block(mp);
+		if (!blockno)
+			return -4;
+		disk_read_r(mp->sm_dk, data, *ptr);
+		disk_write_r(mp->sm_dk, data, blockno);
+		put_data_block(mp, *ptr);
+		*ptr = blockno;
+		if (index >= SFS_NDIRECT)
+			disk_write_r(mp->sm_dk, realblock, inode->sfi_indirect);
+	}
+	*blocknop = *ptr;
+	return 0;
+}
+
+/*
+ * Let go of every block of a file from block index on. The caller
+ * writes the inode back. Returns 0, or -4 if a shared indirect block
+ * could not be copied.
+ */
+static int file_truncate(struct sfs_mnt *mp, struct sfs_inode *inode, u_int32_t index){
+
+	u_int32_t realblock[SFS_DBPERIDB];
+	u_int32_t i;
+	int changed = 0;
+
+	for (i=index; i<SFS_NDIRECT; i++){
+		if (inode->sfi_direct[i]){
+			put_data_block(mp, inode->sfi_direct[i]);
+			inode->sfi_direct[i] = 0;
+		}
+	}
+	if (!inode->sfi_indirect)
+		return 0;
+	if (index <= SFS_NDIRECT){	// all of it
+		put_ptr_block(mp, inode->sfi_indirect);
+		inode->sfi_indirect = 0;
+		return 0;
+	}
+
+	if (ptr_block_own(mp, inode, realblock))
+		return -4;
+	for (i=index - SFS_NDIRECT; i<SFS_DBPERIDB; i++){
+		if (realblock[i]){
+			put_data_block(mp, realblock[i]);
+			realblock[i] = 0;
+			changed = 1;
+		}
+	}
+	if (changed)
+		disk_write_r(mp->sm_dk, realblock, inode->sfi_indirect);
+	return 0;
+}
+
+/*
+ * Move an inline file's data out to a data block, so the file can
+ * grow past SFS_INLINESIZE. Returns 0, or -4 if no block is available.
+ */
+int spill_inline(struct sfs_mnt *mp, struct sfs_inode *inode, u_int32_t ino){
+
+	char datablock[SFS_BLOCKSIZE];
+	u_int32_t blockno;
+
+	if (!(inode->sfi_flags & SFS_IFLAG_INLINE))
+		return 0;
+
+	blockno = take_free_block(mp);
+	if (!blockno)
+		return -4;
+
+	bzero(datablock, SFS_BLOCKSIZE);
+	memcpy(datablock, inode->sfi_inline, inode->sfi_size);
+	disk_write_r(mp->sm_dk, datablock, blockno);
+
+	bzero(inode->sfi_inline, SFS_INLINESIZE);
+	inode->sfi_flags &= ~SFS_IFLAG_INLINE;
+	inode->sfi_direct[0] = blockno;
+	inode_write(mp, inode, ino);
+	return 0;
+}
+
+void error_message(struct sfs_mnt *mp, const char *message, const char *path, int error_code) {
+	switch (error_code) {
+	case -1:
+		fprintf(mp->sm_out, "%s: %s: No such file or directory\n",message, path); return;
+	case -2:
+		fprintf(mp->sm_out, "%s: %s: Not a directory\n",message, path); return;
+	case -3:
+		fprintf(mp->sm_out, "%s: %s: Directory full\n",message, path); return;
+	case -4:
+		fprintf(mp->sm_out, "%s: %s: No block available\n",message, path); return;
+	case -5:
+		fprintf(mp->sm_out, "%s: %s: Not a directory\n",message, path); return;
+	case -6:
+		fprintf(mp->sm_out, "%s: %s: Already exists\n",message, path); return;
+	case -7:
+		fprintf(mp->sm_out, "%s: %s: Directory not empty\n",message, path); return;
+	case -8:
+		fprintf(mp->sm_out, "%s: %s: Invalid argument\n",message, path); return;
+	case -9:
+		fprintf(mp->sm_out, "%s: %s: Is a directory\n",message, path); return;
+	case -10:
+		fprintf(mp->sm_out, "%s: %s: Is not a file\n",message, path); return;
+	case -11:
+		fprintf(mp->sm_out, "%s: input file size exceeds the max file size\n", message); return;
+	case -12:
+		fprintf(mp->sm_out, "%s: can't open %s input file\n", message, path); return;
+	case -13:
+		fprintf(mp->sm_out, "%s: %s: Device busy\n", message, path); return;
+	case -14:
+		fprintf(mp->sm_out, "%s: %s: Input/output error\n", message, path); return;
+	case -15:
+		fprintf(mp->sm_out, "%s: %s: Read-only file system\n", message, path); return;
+	case -16:
+		fprintf(mp->sm_out, "%s: %s: Too many snapshots\n", message, path); return;
+	case -17:
+		fprintf(mp->sm_out, "%s: %s: Too many open files\n", message, path); return;
+	case -18:
+		fprintf(mp->sm_out, "%s: can't create %s output file\n", message, path); return;
+	case -19:
+		fprintf(mp->sm_out, "%s: %s: Volume too big for dedup\n", message, path); return;
+	default:
+		fprintf(mp->sm_out, "unknown error code\n");
+		return;
+	}
+}
+
+/*
+ * Open a volume, or with base, a read-only view of its snapshot in
+ * slot view: the blocks it kept, read through the live volume's maps.
+ */
+static struct sfs_vol *vol_open(struct sfs_mnt *mp, const char* path, struct stat *st, struct sfs_vol *base, int view, int flags, int *error)
+{
+	struct sfs_vol *vp = (struct sfs_vol*)malloc(sizeof(struct sfs_vol));
+	if (vp == NULL)
+		err(1, "malloc");
+	bzero(vp, sizeof(struct sfs_vol));
+	vp->sv_disk.dk_fd = -1;
+	vp->sv_dev = st->st_dev;
+	vp->sv_ino = st->st_ino;
+	vp->sv_newest = -1;
+
+	// only the writer locks the image; snapshots read it beside it
+	if (disk_open_flags_r(&vp->sv_disk, path, (base != NULL) ? DISK_RDONLY :
+	    (flags & SFS_MOUNT_RDONLY) ? DISK_RDONLY | DISK_SHARED :
+	    (flags & SFS_MOUNT_DIRECT) ? DISK_DIRECT : 0)){
+		free(vp);
+		*error = (errno == EBUSY) ? -13 : -12;	// another process writes it, or no access
+		return NULL;
+	}
+	vp->sv_path = strdup(path);
+	if (vp->sv_path == NULL)
+		err(1, "malloc");
+	if (flags & SFS_MOUNT_RDONLY){
+		vp->sv_rdonly = 1;
+		vp->sv_shared = 1;
+	}
+	if (base != NULL){
+		vp->sv_base = base;
+		vp->sv_view = view;
+		vp->sv_rdonly = 1;
+		vp->sv_disk.dk_remap = snap_remap;
+		vp->sv_disk.dk_arg = vp;
+		vp->sv_disk.dk_cs = base->sv_disk.dk_cs;	// shared, so it stays current
+	}
+	disk_read_r(&vp->sv_disk, &vp->sv_spb, SFS_SB_LOCATION );
+
+	if ( vp->sv_spb.sp_magic != SFS_MAGIC ){
+		fprintf(mp->sm_out, "Superblock magic: %x\n", vp->sv_spb.sp_magic);
+		vp->sv_disk.dk_cs = NULL;
+		disk_close_r(&vp->sv_disk);
+		free(vp->sv_path);
+		free(vp);
+		*error = -8;
+		return NULL;
+	}
+
+	// check every read from here on, the superblock too
+	if (base == NULL && (vp->sv_spb.sp_features & SFS_FEAT_CSUM)){
+		disk_csum_attach(&vp->sv_disk, vp->sv_spb.sp_csum, vp->sv_spb.sp_csumblocks, vp->sv_spb.sp_nblocks);
+		disk_read_r(&vp->sv_disk, &vp->sv_spb, SFS_SB_LOCATION );
+	}
+
+	// bitmap pages are read as they are used
+	vp->sv_nshard = SFS_BITBLOCKS(vp->sv_spb.sp_nblocks);
+	vp->sv_bm_size = sizeof(u_int8_t) * SFS_BLOCKSIZE * vp->sv_nshard;	// set bitmap size
+	vp->sv_bmpage = (u_int8_t**)calloc(vp->sv_nshard, sizeof(u_int8_t*));
+	vp->sv_bmref = (u_int8_t*)calloc(vp->sv_nshard, sizeof(u_int8_t));
+	vp->sv_bmfree = (int*)malloc(sizeof(int) * vp->sv_nshard);
+	if (vp->sv_bmpage == NULL || vp->sv_bmref == NULL || vp->sv_bmfree == NULL)
+		err(1, "malloc");
+
+	int i;
+	for (i=0; i<SFS_BMLOCKS; i++){
+		pthread_mutex_init(&vp->sv_bmlock[i], NULL);
+	}
+	for (i=0; i<vp->sv_nshard; i++){
+		vp->sv_bmfree[i] = BM_UNKNOWN;
+	}
+	pthread_mutex_init(&vp->sv_bmclock, NULL);
+	vp->sv_bmhint = 0;
+	for (i=0; i<SFS_ILOCK_BUCKETS; i++){
+		pthread_mutex_init(&vp->sv_ilmtx[i], NULL);
+	}
+	pthread_mutex_init(&vp->sv_sblock, NULL);
+	pthread_mutex_init(&vp->sv_ddlock, NULL);
+	pthread_mutex_init(&vp->sv_snmtx, NULL);
+
+	// a snapshot must not wait behind a steady stream of changes
+	pthread_rwlockattr_t rwa;
+	pthread_rwlockattr_init(&rwa);
+	pthread_rwlockattr_setkind_np(&rwa, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&vp->sv_snaplock, &rwa);
+	pthread_rwlockattr_destroy(&rwa);
+
+	// inode table: note which slots are taken, if any are to be
+	vp->sv_inlinemax = SFS_INLINESIZE;
+	if (vp->sv_spb.sp_features & SFS_FEAT_ITABLE){
+		char tblock[SFS_BLOCKSIZE];
+		struct sfs_inode *pi;
+		u_int32_t ino;
+
+		vp->sv_packed = 1;
+		vp->sv_inlinemax = SFS_PINLINESIZE;
+		if (!vp->sv_rdonly){
+			vp->sv_imap = (u_int8_t*)malloc((vp->sv_spb.sp_ninodes + 7) / 8);
+			if (vp->sv_imap == NULL)
+				err(1, "malloc");
+			bzero(vp->sv_imap, (vp->sv_spb.sp_ninodes + 7) / 8);
+		}
+		for (ino=0; ino<vp->sv_spb.sp_ninodes && !vp->sv_rdonly; ino++){
+			if (ino % SFS_PINODEPERBLOCK == 0)
+				disk_read_r(&vp->sv_disk, tblock, vp->sv_spb.sp_itable + ino/SFS_PINODEPERBLOCK);
+			pi = (struct sfs_inode*)&tblock[(ino%SFS_PINODEPERBLOCK) * SFS_PINODESIZE];
+			if (ino == SFS_NOINO || pi->sfi_type != SFS_TYPE_INVAL)
+				BIT_SET(vp->sv_imap[ino/8], ino%8);
+		}
+		pthread_mutex_init(&vp->sv_imaplock, NULL);
+		for (i=0; i<SFS_ITLOCKS; i++){
+			pthread_mutex_init(&vp->sv_itlock[i], NULL);
+		}
+	}
+
+	if (vp->sv_rdonly)
+		return vp;	// nothing below is for reading
+
+	if (vp->sv_spb.sp_features & SFS_FEAT_DEDUP){
+		ddt_load(vp);
+		vp->sv_dedup = (vp->sv_ddidx != NULL);
+	}
+
+	// every write goes past the snapshots first
+	vp->sv_epoch = 1;	// nothing is fresh yet
+	if (vp->sv_spb.sp_features & SFS_FEAT_SNAP){
+		fresh_alloc(vp);
+		snap_load(vp);
+	}
+	vp->sv_disk.dk_prewrite = snap_prewrite;
+	vp->sv_disk.dk_arg = vp;
+
+	// an image without a free count gets one, from a pass over the bitmap
+	if (!(vp->sv_spb.sp_features & SFS_FEAT_NFREE)){
+		u_int32_t nfree = 0;
+
+		for (i=0; i<vp->sv_nshard; i++){
+			pthread_mutex_lock(&vp->sv_bmlock[i % SFS_BMLOCKS]);
+			bm_page(vp, i);
+			nfree += vp->sv_bmfree[i];
+			bm_putback(vp, i, 0);
+			pthread_mutex_unlock(&vp->sv_bmlock[i % SFS_BMLOCKS]);
+		}
+		vp->sv_spb.sp_features |= SFS_FEAT_NFREE;
+		vp->sv_spb.sp_nfree = nfree;
+		vp->sv_sbdirty = 1;
+		sb_sync(vp);
+	}
+	return vp;
+}
+
+static void vol_close(struct sfs_vol *vp)
+{
+	int i;
+
+	//umount
+	if (!vp->sv_rdonly)
+		sb_sync(vp);
+	if (vp->sv_base != NULL)
+		vp->sv_disk.dk_cs = NULL;	// the volume's
+	disk_close_r(&vp->sv_disk);
+	pthread_mutex_destroy(&vp->sv_sblock);
+	pthread_mutex_destroy(&vp->sv_ddlock);
+	pthread_mutex_destroy(&vp->sv_snmtx);
+	pthread_rwlock_destroy(&vp->sv_snaplock);
+	for (i=0; i<SFS_MAXSNAP; i++){
+		snap_free(&vp->sv_snap[i]);
+	}
+	free(vp->sv_fresh);
+	free(vp->sv_freshep);
+	free(vp->sv_ddpage);
+	free(vp->sv_dddirty);
+	free(vp->sv_ddidx);
+	if (vp->sv_packed){
+		pthread_mutex_destroy(&vp->sv_imaplock);
+		for (i=0; i<SFS_ITLOCKS; i++){
+			pthread_mutex_destroy(&vp->sv_itlock[i]);
+		}
+		free(vp->sv_imap);
+	}
+
+	//remove bitmap loading space
+	for (i=0; i<SFS_BMLOCKS; i++){
+		pthread_mutex_destroy(&vp->sv_bmlock[i]);
+	}
+	pthread_mutex_destroy(&vp->sv_bmclock);
+	for (i=0; i<SFS_ILOCK_BUCKETS; i++){
+		pthread_mutex_destroy(&vp->sv_ilmtx[i]);
+	}
+	for (i=0; i<vp->sv_nshard; i++){
+		free(vp->sv_bmpage[i]);
+	}
+	free(vp->sv_bmpage);
+	free(vp->sv_bmref);
+	free(vp->sv_bmfree);
+	free(vp->sv_path);
+	free(vp);
+}
+
+/*
+ * Attach to the volume of the image at path, opening it unless it is
+ * mounted already. Returns it, or NULL after saying why.
+ */
+static struct sfs_vol *vol_get(struct sfs_mnt *mp, const char* path, int flags)
+{
+	struct sfs_vol *vp;
+	struct stat st;
+	int shared = (flags & SFS_MOUNT_RDONLY) != 0, error = 0;
+
+	if (stat(path, &st) < 0){
+		error_message(mp, "mount", path, -1);
+		return NULL;
+	}
+
+	// readers attach to a reader, writers to the writer
+	pthread_mutex_lock(&vol_lock);
+	for (vp = vol_list; vp != NULL; vp = vp->sv_next){
+		if (vp->sv_dev == st.st_dev && vp->sv_ino == st.st_ino && vp->sv_base == NULL && vp->sv_shared == shared)
+			break;
+	}
+	if (vp != NULL){	// already mounted: attach
+		vp->sv_refs++;
+	} else if ( (vp = vol_open(mp, path, &st, NULL, 0, flags, &error)) != NULL ){
+		vp->sv_refs = 1;
+		vp->sv_next = vol_list;
+		vol_list = vp;
+	}
+	pthread_mutex_unlock(&vol_lock);
+
+	if (vp == NULL)	// bad magic number, or written elsewhere
+		error_message(mp, "mount", path, error);
+	return vp;
+}
+
+/* let go of a volume; the last handle closes it */
+static void vol_put(struct sfs_vol *vp)
+{
+	struct sfs_vol **vpp, *base = vp->sv_base;
+	int last;
+
+	pthread_mutex_lock(&vol_lock);
+	last = (--vp->sv_refs == 0);
+	if (last){
+		for (vpp = &vol_list; *vpp != vp; vpp = &(*vpp)->sv_next)
+			;
+		*vpp = vp->sv_next;
+	}
+	pthread_mutex_unlock(&vol_lock);
+
+	if (last){
+		vol_close(vp);
+		if (base != NULL)
+			vol_put(base);	// a snapshot mount held it
+	}
+}
+
+static void mount_done(struct sfs_mnt *mp, struct sfs_vol *vp)
+{
+	fprintf(mp->sm_out, "Superblock magic: %x\n", vp->sv_spb.sp_magic);
+	fprintf(mp->sm_out, "Number of blocks: %u\n", vp->sv_spb.sp_nblocks);
+	fprintf(mp->sm_out, "Volume name: %s\n", vp->sv_spb.sp_volname);
+	if (vp->sv_base != NULL)
+		fprintf(mp->sm_out, "%s@%s, mounted read-only\n", vp->sv_spb.sp_volname,
+			vp->sv_base->sv_snaptab[vp->sv_view].ss_name);
+	else if (vp->sv_shared)
+		fprintf(mp->sm_out, "%s, mounted read-only\n", vp->sv_spb.sp_volname);
+	else
+		fprintf(mp->sm_out, "%s, mounted\n", vp->sv_spb.sp_volname);
+	if (vp->sv_disk.dk_unit)
+		fprintf(mp->sm_out, "Direct I/O, %u-byte units\n", vp->sv_disk.dk_unit);
+
+	mp->sm_vol = vp;
+	mp->sm_dk = &vp->sv_disk;
+
+	mp->sm_cwd.sfd_ino = 1;		//init at root
+	mp->sm_cwd.sfd_name[0] = '/';
+	mp->sm_cwd.sfd_name[1] = '\0';
+}
+
+void sfs_mount_r(struct sfs_mnt *mp, const char* path)
+{
+	sfs_mount_flags_r(mp, path, NULL, 0);
+}
+
+/* the slot of the snapshot called name, or -1; sv_snmtx held */
+static int snap_lookup(struct sfs_vol *vp, const char *name)
+{
+	int slot;
+
+	for (slot=0; slot<SFS_MAXSNAP; slot++){
+		if (vp->sv_snaptab[slot].ss_name[0] != '\0' && !strcmp(vp->sv_snaptab[slot].ss_name, name))
+			return slot;
+	}
+	return -1;
+}
+
+/* a snapshot reads through every newer one, so any of them lost loses it */
+static int snap_lost(struct sfs_vol *vp, int slot)
+{
+	int i;
+
+	for (i=0; vp->sv_order[i] != slot; i++)
+		;
+	for (; i<vp->sv_nsnap; i++){
+		if (vp->sv_snaptab[vp->sv_order[i]].ss_flags & SFS_SNAP_BROKEN)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Mount snapshot name of the image at path, read-only. The image's
+ * volume stays open underneath while any of its snapshots is mounted.
+ */
+void sfs_mount_snap_r(struct sfs_mnt *mp, const char* path, const char *name)
+{
+	sfs_mount_flags_r(mp, path, name, 0);
+}
+
+/*
+ * Mount the image at path, or with name, its snapshot called that.
+ * Flags apply when the image is not mounted yet; a snapshot is read
+ * through a read-only map of the image. With SFS_MOUNT_RDONLY the
+ * image is mounted read-only beside whichever process writes it, and
+ * follows its changes (see vol_refresh).
+ */
+void sfs_mount_flags_r(struct sfs_mnt *mp, const char* path, const char *name, int flags)
+{
+	struct sfs_vol *base, *vp;
+	struct stat st;
+	int slot, error = -1;
+
+	sfs_umount_r(mp);
+
+	fprintf(mp->sm_out, "Disk image: %s\n", path);
+
+	// a snapshot's maps are the writer's
+	if (name != NULL && (flags & SFS_MOUNT_RDONLY)){
+		error_message(mp, "mount", name, -8);
+		return;
+	}
+	if ((base = vol_get(mp, path, flags)) == NULL)
+		return;
+	if (name == NULL){
+		mount_done(mp, base);
+		return;
+	}
+
+	pthread_mutex_lock(&vol_lock);
+	pthread_mutex_lock(&base->sv_snmtx);
+	slot = snap_lookup(base, name);
+	if (slot >= 0)
+		error = snap_lost(base, slot) ? -14 : 0;
+	pthread_mutex_unlock(&base->sv_snmtx);
+	if (error){
+		pthread_mutex_unlock(&vol_lock);
+		error_message(mp, "mount", name, error);
+		vol_put(base);
+		return;
+	}
+
+	for (vp = vol_list; vp != NULL; vp = vp->sv_next){
+		if (vp->sv_base == base && vp->sv_view == slot)
+			break;
+	}
+	if (vp != NULL){	// already mounted: attach, it holds the volume
+		vp->sv_refs++;
+	} else{
+		st.st_dev = base->sv_dev;
+		st.st_ino = base->sv_ino;
+		if ( (vp = vol_open(mp, path, &st, base, slot, 0, &error)) != NULL ){
+			vp->sv_refs = 1;
+			vp->sv_next = vol_list;
+			vol_list = vp;
+			base = NULL;	// now the snapshot's
+		}
+	}
+	pthread_mutex_unlock(&vol_lock);
+
+	if (base != NULL)
+		vol_put(base);
+	if (vp == NULL){
+		error_message(mp, "mount", name, -8);
+		return;
+	}
+	mount_done(mp, vp);
+}
+
+void sfs_umount_r(struct sfs_mnt *mp) {
+
+	if( mp->sm_cwd.sfd_ino !=  SFS_NOINO )
+	{
+		struct sfs_vol *vp = mp->sm_vol;
+		int fd;
+
+		for (fd=0; fd<SFS_OPEN_MAX; fd++){
+			if (mp->sm_files[fd] != NULL)
+				sfs_close_r(mp, fd);
+		}
+
+		if (vp->sv_base != NULL)
+			fprintf(mp->sm_out, "%s@%s, unmounted\n", vp->sv_spb.sp_volname,
+				vp->sv_base->sv_snaptab[vp->sv_view].ss_name);
+		else
+			fprintf(mp->sm_out, "%s, unmounted\n", vp->sv_spb.sp_volname);
+		mp->sm_cwd.sfd_ino = SFS_NOINO;
+		mp->sm_vol = NULL;
+		mp->sm_dk = NULL;
+
+		vol_put(vp);
+	}
+}
+
+/*
+ * Directory changes for many names at once. The cwd's directory
+ * blocks are read in one pass and every name is resolved against
+ * them; each block changed is written once and the cwd inode once.
+ */
+#define DIR_MAXENT (SFS_NDIRECT * SFS_DENTRYPERBLOCK)
+#define DIR_HASH   256		// name table size, power of 2 above DIR_MAXENT
+#define DE_PENDING 0xffffffffU	// slot claimed, inode not taken yet
+
+static u_int32_t dir_hash(const char *name){
+
+	u_int32_t h = 2166136261U;
+	size_t i, len = strnlen(name, SFS_NAMELEN);
+
+	for (i=0; i<len; i++){
+		h = (h ^ (unsigned char)name[i]) * 16777619U;
+	}
+	return h & (DIR_HASH - 1);
+}
+
+/* the entry in the name table named name, or NULL */
+static struct sfs_dir *dir_lookup(struct sfs_dir *const *ht, const char *name){
+
+	u_int32_t h;
+
+	for (h = dir_hash(name); ht[h] != NULL; h = (h + 1) & (DIR_HASH - 1)){
+		if (strncmp(ht[h]->sfd_name, name, SFS_NAMELEN) == 0)
+			return ht[h];
+	}
+	return NULL;
+}
+
+static void dir_insert(struct sfs_dir **ht, struct sfs_dir *de){
+
+	u_int32_t h;
+
+	for (h = dir_hash(de->sfd_name); ht[h] != NULL; h = (h + 1) & (DIR_HASH - 1))
+		;
+	ht[h] = de;
+}
+
+/*
+ * Give back what directory ino no longer needs after entries leave
+ * it. The empty blocks at the end go without anything moving, so a
+ * listing keeps its order and new names fill the same slots they
+ * always did. When the blocks left are still more than DIR_SPARSE
+ * times what the live entries need, or when repack is set (defrag),
+ * the live entries are repacked in order into as few blocks as they
+ * need, so a scan reads no more blocks than there are entries for.
+ * Block 0 is always kept. The directory is write locked; dir is its
+ * inode and is written back if it changes.
+ */
+#define DIR_SPARSE 2
+
+static void dir_shrink(struct sfs_mnt *mp, u_int32_t ino, struct sfs_inode *dir, int repack)
+{
+	struct sfs_dir db[SFS_NDIRECT][SFS_DENTRYPERBLOCK], live[DIR_MAXENT];
+	u_int32_t blks[SFS_NDIRECT];
+	int idx[SFS_NDIRECT];
+	char zero[SFS_BLOCKSIZE];
+	int nblk = 0, nlive = 0, keep = 1, need, b, j;
+
+	for (b=0; b<SFS_NDIRECT; b++){
+		if (!dir->sfi_direct[b])
+			continue;
+		disk_read_r(mp->sm_dk, db[nblk], dir->sfi_direct[b]);
+		for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+			if (db[nblk][j].sfd_ino != SFS_NOINO){
+				live[nlive++] = db[nblk][j];
+				keep = nblk + 1;
+			}
+		}
+		idx[nblk] = b;
+		blks[nblk++] = dir->sfi_direct[b];
+	}
+	need = (nlive + SFS_DENTRYPERBLOCK - 1) / SFS_DENTRYPERBLOCK;
+	if (need == 0)
+		need = 1;
+
+	if ((repack && keep > need) || keep > DIR_SPARSE * need){
+		// the kept blocks first, then the inode, and only then are
+		// the others cleared; only blocks whose content moved are written
+		bzero(&live[nlive], (DIR_MAXENT - nlive) * sizeof(struct sfs_dir));
+		for (b=0; b<need; b++){
+			if (memcmp(db[b], &live[b * SFS_DENTRYPERBLOCK], SFS_BLOCKSIZE))
+				disk_write_r(mp->sm_dk, &live[b * SFS_DENTRYPERBLOCK], blks[b]);
+		}
+		bzero(dir->sfi_direct, sizeof(dir->sfi_direct));
+		memcpy(dir->sfi_direct, blks, need * sizeof(u_int32_t));
+		keep = need;
+	} else{
+		if (keep == nblk)
+			return;
+		for (b=keep; b<nblk; b++){
+			dir->sfi_direct[idx[b]] = 0;
+		}
+	}
+
+	// the inode first, and only then are the blocks cleared
+	inode_write(mp, dir, ino);
+	bzero(zero, SFS_BLOCKSIZE);
+	for (b=keep; b<nblk; b++){
+		disk_write_r(mp->sm_dk, zero, blks[b]);
+	}
+	release_blocks(mp, &blks[keep], nblk - keep);
+}
+
+/* new files (type SFS_TYPE_FILE) or directories, named names[0..n-1] */
+static void dir_create(struct sfs_mnt *mp, const char *cmd, char *const names[], int n, int type)
+{
+	struct sfs_dir db[SFS_NDIRECT][SFS_DENTRYPERBLOCK];
+	struct sfs_dir *slot[DIR_MAXENT], *freeslot[DIR_MAXENT], *ht[DIR_HASH], *de;
+	const char *slotname[DIR_MAXENT];
+	int dirty[SFS_NDIRECT], isnew[SFS_NDIRECT];
+	u_int32_t inos[DIR_MAXENT], blks[SFS_NDIRECT + DIR_MAXENT];
+	u_int32_t nslot = 0, nnew = 0, nblks, npre, nres = 0, gi = 0, gb = 0, k;
+	u_int32_t nfree = 0, fhead = 0;
+	struct sfs_inode ci, new_inode;
+	int i, b, j, deb;
+
+	if (write_begin(mp)){
+		for (i=0; i<n; i++)
+			error_message(mp, cmd, names[i], -15);
+		return;
+	}
+	struct ilock *pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_WRITE);
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+	bzero(dirty, sizeof(dirty));
+	bzero(isnew, sizeof(isnew));
+	bzero(ht, sizeof(ht));
+
+	// free slots in scan order, and the names taken
+	for (b=0; b<SFS_NDIRECT; b++){
+		if (!ci.sfi_direct[b])
+			continue;
+		disk_read_r(mp->sm_dk, db[b], ci.sfi_direct[b]);
+		for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+			if (db[b][j].sfd_ino == SFS_NOINO)
+				freeslot[nfree++] = &db[b][j];
+			else
+				dir_insert(ht, &db[b][j]);
+		}
+	}
+
+	// claim the first free slot for each name; names claimed earlier
+	// count as taken
+	for (i=0; i<n; i++){
+		if (dir_lookup(ht, names[i]) != NULL){
+			error_message(mp, cmd, names[i], -6);
+			continue;
+		}
+
+		if (fhead == nfree){
+			// every block is full: start one in the first free pointer
+			for (b=0; b<SFS_NDIRECT && (ci.sfi_direct[b] || isnew[b]); b++)
+				;
+			if (b == SFS_NDIRECT){	// directory full
+				error_message(mp, cmd, names[i], -3);
+				continue;
+			}
+			bzero(db[b], SFS_BLOCKSIZE);
+			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+				db[b][j].sfd_ino = SFS_NOINO;
+				freeslot[nfree++] = &db[b][j];
+			}
+			isnew[b] = 1;
+			nnew++;
+		}
+
+		de = freeslot[fhead++];
+		deb = (de - &db[0][0]) / SFS_DENTRYPERBLOCK;
+		de->sfd_ino = DE_PENDING;
+		bzero(de->sfd_name, SFS_NAMELEN);
+		strncpy(de->sfd_name, names[i], SFS_NAMELEN);
+		dir_insert(ht, de);
+		dirty[deb] = 1;
+		slot[nslot] = de;
+		slotname[nslot++] = names[i];
+	}
+	if (nslot == 0)
+		goto out;
+
+	// blocks needed: an inode per name, the new directory blocks, and
+	// for directories a first block each
+	nblks = nnew + ((type == SFS_TYPE_DIR) ? nslot : 0);
+	nres = nslot + nblks;
+	if (reserve_blocks(mp, nres)){
+		nres = 0;
+		goto full;
+	}
+
+	// all in bulk, in the order one name at a time takes them: new
+	// parent blocks before the inodes for mkdir, after them for touch
+	npre = (type == SFS_TYPE_DIR) ? nnew : 0;
+	gb = take_free_blocks(mp, blks, npre);
+	if (gb == npre)
+		gi = take_free_inodes(mp, mp->sm_cwd.sfd_ino, inos, nslot);
+	if (gi == nslot)
+		gb += take_free_blocks(mp, &blks[gb], nblks - gb);
+	if (gi < nslot || gb < nblks){	// no more free block
+		for (k=0; k<gi; k++)
+			release_inode(mp, inos[k]);
+		for (k=0; k<gb; k++)
+			release_block(mp, blks[k]);
+		goto full;
+	}
+
+	for (b=0, k=0; b<SFS_NDIRECT; b++){
+		if (isnew[b])
+			ci.sfi_direct[b] = blks[k++];	// parent direct ptr update (for new directory block)
+	}
+
+	// the new inodes first, so no entry points at one not yet written
+	for (k=0; k<nslot; k++){
+		slot[k]->sfd_ino = inos[k];
+
+		bzero(&new_inode,SFS_BLOCKSIZE); // initalize sfi_direct[] and sfi_indirect
+		new_inode.sfi_type = type;
+		if (type == SFS_TYPE_DIR){
+			struct sfs_dir new_chdtrb[SFS_DENTRYPERBLOCK];
+			bzero(new_chdtrb, SFS_BLOCKSIZE);
+			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+				new_chdtrb[j].sfd_ino = SFS_NOINO;
+			}
+			strncpy(new_chdtrb[0].sfd_name, ".", SFS_NAMELEN);
+			strncpy(new_chdtrb[1].sfd_name, "..", SFS_NAMELEN);
+			new_chdtrb[0].sfd_ino = inos[k];
+			new_chdtrb[1].sfd_ino = mp->sm_cwd.sfd_ino;
+			disk_write_r(mp->sm_dk, new_chdtrb, blks[nnew + k]);
+
+			new_inode.sfi_size = sizeof(struct sfs_dir) * 2;
+			new_inode.sfi_direct[0] = blks[nnew + k];
+		}
+		inode_write(mp, &new_inode, inos[k]);
+	}
+
+	for (b=0; b<SFS_NDIRECT; b++){
+		if (dirty[b])
+			disk_write_r(mp->sm_dk, db[b], ci.sfi_direct[b]);
+	}
+
+	ci.sfi_size += nslot * sizeof(struct sfs_dir);	// file size up (one entry per name)
+	inode_write(mp, &ci, mp->sm_cwd.sfd_ino );
+	goto out;
+
+full:
+	for (k=0; k<nslot; k++){
+		error_message(mp, cmd, slotname[k], -4);
+	}
+out:
+	unreserve_blocks(mp, nres);
+	sb_sync(mp->sm_vol);
+	inode_unlock(mp, pl);
+	write_end(mp);
+}
+
+void sfs_touch_r(struct sfs_mnt *mp, const char* path)
+{
+	dir_create(mp, "touch", (char *const *)&path, 1, SFS_TYPE_FILE);
+}
+
+void sfs_touchv_r(struct sfs_mnt *mp, int n, char *const paths[])
+{
+	dir_create(mp, "touch", paths, n, SFS_TYPE_FILE);
+}
+
+void sfs_cd_r(struct sfs_mnt *mp, const char* path)
+{
+	vol_refresh(mp);
+
+	// get cwd's inode
+	struct ilock *pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_READ);
+	struct sfs_inode ci;
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+	// if path null
+	if (path == NULL){
+		mp->sm_cwd.sfd_ino = 1;
+		mp->sm_cwd.sfd_name[0] = '/';
+		mp->sm_cwd.sfd_name[1] = '\0';
+		goto out;
+	}
+
+	// if path not null
+	// cwd inode direct ptr loop
+	int i;
+	for (i=0; i<SFS_NDIRECT; i++){
+		// if direct ptr in use,
+		if (ci.sfi_direct[i]){
+			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
+			disk_read_r(mp->sm_dk, cdtrb, ci.sfi_direct[i] );
+
+			// cwd directory entry loop
+			int j;
+			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+				// if directory entry in use, and path found
+				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, path) == 0) ){
+					struct sfs_inode pathi;
+					inode_read(mp, &pathi, cdtrb[j].sfd_ino );
+
+					// if directory
+					if (pathi.sfi_type == SFS_TYPE_DIR){
+						// change cwd
+						mp->sm_cwd.sfd_ino = cdtrb[j].sfd_ino;
+						bzero(mp->sm_cwd.sfd_name, SFS_NAMELEN);
+						strncpy(mp->sm_cwd.sfd_name, cdtrb[j].sfd_name, SFS_NAMELEN);
+						goto out;
+					} else{	// if not a directory
+						error_message(mp, "cd", path, -2);
+						goto out;
+					}
+				}
+			}
+
+		}
+	}
+
+	// path not found
+	error_message(mp, "cd", path, -1);
+
+out:
+	inode_unlock(mp, pl);
+}
+
+void sfs_ls_r(struct sfs_mnt *mp, const char* path)
+{
+	vol_refresh(mp);
+
+	// get cwd's inode
+	struct ilock *pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_READ);
+	struct ilock *cl = NULL;
+	struct sfs_inode ci;
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+	struct iblk ib = { 0 };	// children's inodes, when packed
+
+	// if path null
+	if (path == NULL){
+		// cwd inode direct ptr loop
+		int i;
+		for (i=0; i<SFS_NDIRECT; i++){
+			// if direct ptr in use,
+			if (ci.sfi_direct[i]){
+				struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
+				disk_read_r(mp->sm_dk, cdtrb, ci.sfi_direct[i] );
+
+				// cwd directory entry loop
+				int j;
+				for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+					// if directory entry is use
+					if (cdtrb[j].sfd_ino != SFS_NOINO){
+						struct sfs_inode tempi;
+						inode_read_cached(mp, &ib, &tempi, cdtrb[j].sfd_ino );
+
+						// if directory
+						if (tempi.sfi_type == SFS_TYPE_DIR){
+							fprintf(mp->sm_out, "%s/\t", cdtrb[j].sfd_name);
+						} else{	// if file
+							fprintf(mp->sm_out, "%s\t", cdtrb[j].sfd_name);
+						}
+					}
+				}
+
+			}
+		}
+		fprintf(mp->sm_out, "\n");
+		goto out;
+	}
+
+	// if path not null
+	// cwd inode direct ptr loop
+	int i;
+	for (i=0; i<SFS_NDIRECT; i++){
+		// if direct ptr in use,
+		if (ci.sfi_direct[i]){
+			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
+			disk_read_r(mp->sm_dk, cdtrb, ci.sfi_direct[i] );
+
+			// cwd directory entry loop
+			int j;
+			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+				// if directory entry in use, and path found
+				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, path) == 0) ){
+					cl = inode_lock_child(mp, &pl, &cdtrb[j], IL_READ);
+					struct sfs_inode pathi;
+					inode_read(mp, &pathi, cdtrb[j].sfd_ino );
+
+					// if path is directory
+					if (pathi.sfi_type == SFS_TYPE_DIR){
+						// path inode direct ptr loop
+						int k;
+						for (k=0; k<SFS_NDIRECT; k++){
+							// if direct ptr in use,
+							if (pathi.sfi_direct[k]){
+								struct sfs_dir pdtrb[SFS_DENTRYPERBLOCK];
+								disk_read_r(mp->sm_dk, pdtrb, pathi.sfi_direct[k] );
+
+								// path directory entry loop
+								int l;
+								for (l=0; l<SFS_DENTRYPERBLOCK; l++){
+									// if directory entry in use
+									if (pdtrb[l].sfd_ino != SFS_NOINO){
+										struct sfs_inode tempi;
+										inode_read_cached(mp, &ib, &tempi, pdtrb[l].sfd_ino );
+
+										// if directory
+										if (tempi.sfi_type == SFS_TYPE_DIR){
+											fprintf(mp->sm_out, "%s/\t", pdtrb[l].sfd_name);
+										} else{	// if file
+											fprintf(mp->sm_out, "%s\t", pdtrb[l].sfd_name);
+										}
+									}
+								}
+
+							}
+						}
+					} else { // if path is file
+						fprintf(mp->sm_out, "%s", cdtrb[j].sfd_name);
+					}
+					fprintf(mp->sm_out, "\n");
+					goto out;
+				}
+
+			}
+
+		}
+	}
+
+	// path not found
+	error_message(mp, "ls", path, -1);
+
+out:
+	inode_unlock(mp, cl);
+	inode_unlock(mp, pl);
+}
+
+
+
+/*
+ * Parallel walk of the tree under a directory, for ls -R, du and find.
+ * Each directory is a task. A worker pushes the subdirectories it
+ * finds on its own queue and pops from the same end; a worker with
+ * nothing to do steals from the other end of another's queue.
+ * What a task prints is kept with it and printed in tree order once
+ * the walk is done, so the output does not depend on the timing.
+ */
+#define WALK_MAXWORKERS 8
+
+#define WALK_LS   0
+#define WALK_DU   1
+#define WALK_FIND 2
+
+struct wtask {
+	u_int32_t wt_ino;
+	char *wt_path;
+	struct wtask *wt_child, **wt_tailp;	// subdirectories, in directory order
+	struct wtask *wt_next;
+	char *wt_out;				// what it prints
+	size_t wt_outlen;
+	u_int64_t wt_bytes;			// du: it and its files, then with subdirectories
+};
+
+struct wqueue {
+	pthread_mutex_t wq_lock;
+	struct wtask **wq_task;			// tasks [wq_head, wq_tail)
+	int wq_head, wq_tail, wq_max;
+};
+
+struct walk {
+	struct sfs_mnt *wk_mp;
+	int wk_mode;				// WALK_*
+	const char *wk_pattern;			// find
+	int wk_nworker;
+	struct wqueue wk_q[WALK_MAXWORKERS];
+	u_int32_t wk_pending;			// tasks queued or running
+	int wk_printed;				// ls: a directory is out already
+};
+
+struct wworker {
+	struct walk *ww_walk;
+	int ww_id;
+	pthread_t ww_thread;
+};
+
+static struct wtask *wtask_new(u_int32_t ino, char *path){
+
+	struct wtask *t = (struct wtask*)calloc(1, sizeof(struct wtask));
+
+	if (t == NULL)
+		err(1, "malloc");
+	t->wt_ino = ino;
+	t->wt_path = path;
+	t->wt_tailp = &t->wt_child;
+	return t;
+}
+
+static void walk_push(struct walk *wk, int id, struct wtask *t){
+
+	struct wqueue *q = &wk->wk_q[id];
+
+	__atomic_add_fetch(&wk->wk_pending, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&q->wq_lock);
+	if (q->wq_tail == q->wq_max){
+		// slide down, or grow
+		memmove(q->wq_task, &q->wq_task[q->wq_head], (q->wq_tail - q->wq_head) * sizeof(struct wtask*));
+		q->wq_tail -= q->wq_head;
+		q->wq_head = 0;
+		if (q->wq_tail == q->wq_max){
+			q->wq_max = q->wq_max ? q->wq_max * 2 : 64;
+			q->wq_task = (struct wtask**)realloc(q->wq_task, q->wq_max * sizeof(struct wtask*));
+			if (q->wq_task == NULL)
+				err(1, "malloc");
+		}
+	}
+	q->wq_task[q->wq_tail++] = t;
+	pthread_mutex_unlock(&q->wq_lock);
+}
+
+/* the newest task of our own queue, else the oldest of another's; NULL when all are done */
+static struct wtask *walk_next(struct walk *wk, int id){
+
+	struct wqueue *q;
+	struct wtask *t;
+	int i;
+
+	for (;;){
+		for (i=0; i<wk->wk_nworker; i++){
+			q = &wk->wk_q[(id + i) % wk->wk_nworker];
+			t = NULL;
+			pthread_mutex_lock(&q->wq_lock);
+			if (q->wq_head < q->wq_tail)
+				t = (i == 0) ? q->wq_task[--q->wq_tail] : q->wq_task[q->wq_head++];
+			pthread_mutex_unlock(&q->wq_lock);
+			if (t != NULL)
+				return t;
+		}
+		if (__atomic_load_n(&wk->wk_pending, __ATOMIC_SEQ_CST) == 0)
+			return NULL;
+		sched_yield();	// another worker is still listing
+	}
+}
+
+static char *walk_path(const char *dir, const char *name){
+
+	size_t len = strlen(dir) + SFS_NAMELEN + 2;
+	char *path = (char*)malloc(len);
+
+	if (path == NULL)
+		err(1, "malloc");
+	snprintf(path, len, "%s/%.*s", dir, SFS_NAMELEN, name);
+	return path;
+}
+
+/*
+ * List one directory: read its blocks, then read ahead every child's
+ * inode before reading them, and for subdirectories their blocks
+ * before they are queued.
+ */
+static void walk_dir(struct walk *wk, int id, struct wtask *t){
+
+	struct sfs_mnt *mp = wk->wk_mp;
+	struct sfs_vol *vp = mp->sm_vol;
+	struct ilock *il = inode_lock(mp, t->wt_ino, IL_READ);
+	struct sfs_dir de[SFS_NDIRECT * SFS_DENTRYPERBLOCK];
+	struct sfs_inode di, ci;
+	struct iblk ib = { 0 };
+	struct wtask *ct;
+	u_int32_t blockno, last = 0;
+	int i, k, n = 0;
+	FILE *out;
+
+	inode_read(mp, &di, t->wt_ino);
+	if (di.sfi_type != SFS_TYPE_DIR)	// removed since its parent was listed
+		goto out;
+
+	for (i=0; i<SFS_NDIRECT; i++){
+		if (di.sfi_direct[i])
+			disk_read_r(mp->sm_dk, &de[SFS_DENTRYPERBLOCK * n++], di.sfi_direct[i]);
+	}
+	n *= SFS_DENTRYPERBLOCK;
+	for (i=0; i<n; i++){
+		if (de[i].sfd_ino == SFS_NOINO)
+			continue;
+		blockno = vp->sv_packed ? vp->sv_spb.sp_itable + de[i].sfd_ino/SFS_PINODEPERBLOCK : de[i].sfd_ino;
+		if (blockno != last)
+			disk_readahead_r(mp->sm_dk, blockno, 1);
+		last = blockno;
+	}
+
+	out = open_memstream(&t->wt_out, &t->wt_outlen);
+	if (out == NULL)
+		err(1, "open_memstream");
+	if (wk->wk_mode == WALK_LS)
+		fprintf(out, "%s:\n", t->wt_path);
+	t->wt_bytes = di.sfi_size;
+
+	for (i=0; i<n; i++){
+		if (de[i].sfd_ino == SFS_NOINO)
+			continue;
+		if (!strcmp(de[i].sfd_name, ".") || !strcmp(de[i].sfd_name, "..")){
+			if (wk->wk_mode == WALK_LS)
+				fprintf(out, "%s/\t", de[i].sfd_name);
+			continue;
+		}
+		inode_read_cached(mp, &ib, &ci, de[i].sfd_ino);
+
+		switch (wk->wk_mode){
+		case WALK_LS:
+			fprintf(out, (ci.sfi_type == SFS_TYPE_DIR) ? "%.*s/\t" : "%.*s\t", SFS_NAMELEN, de[i].sfd_name);
+			break;
+		case WALK_DU:
+			if (ci.sfi_type != SFS_TYPE_DIR)
+				t->wt_bytes += ci.sfi_size;
+			break;
+		case WALK_FIND:
+			if (fnmatch(wk->wk_pattern, de[i].sfd_name, 0) == 0)
+				fprintf(out, "%s/%.*s\n", t->wt_path, SFS_NAMELEN, de[i].sfd_name);
+			break;
+		}
+
+		if (ci.sfi_type == SFS_TYPE_DIR){
+			for (k=0; k<SFS_NDIRECT; k++){
+				if (ci.sfi_direct[k])
+					disk_readahead_r(mp->sm_dk, ci.sfi_direct[k], 1);
+			}
+			ct = wtask_new(de[i].sfd_ino, walk_path(t->wt_path, de[i].sfd_name));
+			*t->wt_tailp = ct;
+			t->wt_tailp = &ct->wt_next;
+			walk_push(wk, id, ct);
+		}
+	}
+	if (wk->wk_mode == WALK_LS)
+		fprintf(out, "\n");
+	fclose(out);
+out:
+	inode_unlock(mp, il);
+}
+
+static void *walk_worker(void *arg){
+
+	struct wworker *ww = (struct wworker*)arg;
+	struct walk *wk = ww->ww_walk;
+	struct wtask *t;
+
+	while ((t = walk_next(wk, ww->ww_id)) != NULL){
+		walk_dir(wk, ww->ww_id, t);
+		__atomic_sub_fetch(&wk->wk_pending, 1, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+/* print the tree in order and free it; du totals come up from the leaves */
+static u_int64_t walk_print(struct walk *wk, struct wtask *t){
+
+	FILE *out = wk->wk_mp->sm_out;
+	struct wtask *c, *next;
+	u_int64_t bytes;
+
+	if (wk->wk_mode == WALK_LS && t->wt_out != NULL){
+		if (wk->wk_printed++)
+			fprintf(out, "\n");
+		fwrite(t->wt_out, 1, t->wt_outlen, out);
+	} else if (wk->wk_mode == WALK_FIND && t->wt_out != NULL){
+		fwrite(t->wt_out, 1, t->wt_outlen, out);
+	}
+	for (c = t->wt_child; c != NULL; c = next){
+		next = c->wt_next;
+		t->wt_bytes += walk_print(wk, c);
+	}
+	if (wk->wk_mode == WALK_DU)
+		fprintf(out, "%llu\t%s\n", (unsigned long long)t->wt_bytes, t->wt_path);
+
+	bytes = t->wt_bytes;
+	free(t->wt_out);
+	free(t->wt_path);
+	free(t);
+	return bytes;
+}
+
+/* the directory to walk: path in the cwd, or the cwd. 0 if it is not one */
+static u_int32_t walk_start(struct sfs_mnt *mp, const char *cmd, const char *path){
+
+	struct ilock *pl;
+	struct sfs_inode ci, pathi;
+	struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
+	u_int32_t ino = 0;
+	int i, j;
+
+	if (path == NULL)
+		return mp->sm_cwd.sfd_ino;
+
+	pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_READ);
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+	for (i=0; i<SFS_NDIRECT && ino == 0; i++){
+		if (!ci.sfi_direct[i])
+			continue;
+		disk_read_r(mp->sm_dk, cdtrb, ci.sfi_direct[i] );
+		for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+			if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, path) == 0) ){
+				ino = cdtrb[j].sfd_ino;
+				break;
+			}
+		}
+	}
+
+	if (ino == 0){	// path not found
+		error_message(mp, cmd, path, -1);
+	} else{
+		inode_read(mp, &pathi, ino);
+		if (pathi.sfi_type != SFS_TYPE_DIR){
+			error_message(mp, cmd, path, -2);
+			ino = 0;
+		}
+	}
+	inode_unlock(mp, pl);
+	return ino;
+}
+
+static void walk_tree(struct sfs_mnt *mp, const char *cmd, const char *path, int mode, const char *pattern){
+
+	struct walk wk;
+	struct wworker ww[WALK_MAXWORKERS];
+	struct wtask *top;
+	u_int32_t ino;
+	long ncpu;
+	int i;
+
+	vol_refresh(mp);
+	if ((ino = walk_start(mp, cmd, path)) == 0)
+		return;
+
+	bzero(&wk, sizeof(wk));
+	wk.wk_mp = mp;
+	wk.wk_mode = mode;
+	wk.wk_pattern = pattern;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	wk.wk_nworker = (ncpu < 1) ? 1 : (ncpu > WALK_MAXWORKERS) ? WALK_MAXWORKERS : ncpu;
+	for (i=0; i<wk.wk_nworker; i++){
+		pthread_mutex_init(&wk.wk_q[i].wq_lock, NULL);
+		ww[i].ww_walk = &wk;
+		ww[i].ww_id = i;
+	}
+
+	top = wtask_new(ino, strdup(path ? path : "."));
+	if (top->wt_path == NULL)
+		err(1, "malloc");
+	walk_push(&wk, 0, top);
+
+	// this thread is worker 0
+	for (i=1; i<wk.wk_nworker; i++){
+		if (pthread_create(&ww[i].ww_thread, NULL, walk_worker, &ww[i]))
+			errx(1, "can't start walk worker");
+	}
+	walk_worker(&ww[0]);
+	for (i=1; i<wk.wk_nworker; i++){
+		pthread_join(ww[i].ww_thread, NULL);
+	}
+
+	walk_print(&wk, top);
+	for (i=0; i<wk.wk_nworker; i++){
+		pthread_mutex_destroy(&wk.wk_q[i].wq_lock);
+		free(wk.wk_q[i].wq_task);
+	}
+}
+
+void sfs_lsr_r(struct sfs_mnt *mp, const char* path)
+{
+	walk_tree(mp, "ls", path, WALK_LS, NULL);
+}
+
+void sfs_du_r(struct sfs_mnt *mp, const char* path)
+{
+	walk_tree(mp, "du", path, WALK_DU, NULL);
+}
+
+void sfs_find_r(struct sfs_mnt *mp, const char* path, const char *pattern)
+{
+	walk_tree(mp, "find", path, WALK_FIND, pattern);
+}
+
+
+
+void sfs_mkdir_r(struct sfs_mnt *mp, const char* org_path) 
+{
+	dir_create(mp, "mkdir", (char *const *)&org_path, 1, SFS_TYPE_DIR);
+}
+
+void sfs_mkdirv_r(struct sfs_mnt *mp, int n, char *const paths[])
+{
+	dir_create(mp, "mkdir", paths, n, SFS_TYPE_DIR);
+}
+
+
+
+void sfs_rmdir_r(struct sfs_mnt *mp, const char* org_path) 
+{
+	// get cwd's inode
+	if (write_begin(mp)){
+		error_message(mp, "rmdir", org_path, -15);
+		return;
+	}
+	struct ilock *pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_WRITE);
+	struct ilock *cl = NULL;
+	struct sfs_inode ci;
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+	// check invalid
+	if (!strcmp(org_path, ".")){
+		error_message(mp, "rmdir", ".", -8);
+		goto out;
+	}
+
+	// find path
+	// cwd inode direct ptr loop
+	int i;
+	for (i=0; i<SFS_NDIRECT; i++){
+		// if direct ptr in use,
+		if (ci.sfi_direct[i]){
+			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
+			disk_read_r(mp->sm_dk, cdtrb, ci.sfi_direct[i] );
+
+			// cwd directory entry loop
+			int j;
+			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+				// if directory entry in use, and path found
+				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, org_path) == 0) ){
+					cl = inode_lock_child(mp, &pl, &cdtrb[j], IL_WRITE);
+					struct sfs_inode pathi;
+					inode_read(mp, &pathi, cdtrb[j].sfd_ino );
+
+					// if directory
+					if (pathi.sfi_type == SFS_TYPE_DIR){
+
+						// check if directory not empty
+						// child inode direct ptr loop
+						int k;
+						for (k=0; k<SFS_NDIRECT; k++){
+							if (pathi.sfi_direct[k]){
+								struct sfs_dir chdtrb[SFS_DENTRYPERBLOCK];
+								disk_read_r(mp->sm_dk, chdtrb, pathi.sfi_direct[k]);
+
+								// child directory entry loop
+								int l;
+								for (l=0; l<SFS_DENTRYPERBLOCK; l++){
+									if (chdtrb[l].sfd_ino != SFS_NOINO){
+										if ( (strcmp(chdtrb[l].sfd_name, ".") != 0) && (strcmp(chdtrb[l].sfd_name, "..") != 0) ){
+											error_message(mp, "rmdir", org_path, -7);
+											goto out;
+										}
+									}
+								}
+							}
+						}
+
+						/* directory empty */
+
+
+						/* directory entry i-node number release */
+						int tmpchinum = cdtrb[j].sfd_ino;
+						cdtrb[j].sfd_ino = SFS_NOINO;
+						disk_write_r(mp->sm_dk, cdtrb, ci.sfi_direct[i]);
+						// puts("directory entry disk updated");
+
+						ci.sfi_size -= sizeof(struct sfs_dir);	// decrease parent size info
+						inode_write(mp, &ci, mp->sm_cwd.sfd_ino);
+						// puts("parent inode disk updated");
+						dir_shrink(mp, mp->sm_cwd.sfd_ino, &ci, 0);
+
+						/* directory block pointed by direct_ptr release */
+						for (k=0; k<SFS_NDIRECT; k++){
+							if (pathi.sfi_direct[k]){
+								// clear the datablock
 								char tempdtrb[SFS_BLOCKSIZE];
-								disk_read(tempdtrb, pathi.sfi_direct[k]);
+								disk_read_r(mp->sm_dk, tempdtrb, pathi.sfi_direct[k]);
 								bzero(tempdtrb, SFS_BLOCKSIZE);
-								disk_write(tempdtrb, pathi.sfi_direct[k]);
+								disk_write_r(mp->sm_dk, tempdtrb, pathi.sfi_direct[k]);
 								// update bitmap
-								release_block(pathi.sfi_direct[k]);
+								release_block(mp, pathi.sfi_direct[k]);
 								// puts("datablock(dirptr) disk released");
 							}
 						}
 
-						/* release child(target directory's) i-node */
-						bzero(&pathi, SFS_BLOCKSIZE);
-						disk_write( &pathi, tmpchinum );
-						release_block(tmpchinum);
-						// puts("child inode disk released");
+						/* release child(target directory's) i-node */
+						bzero(&pathi, SFS_BLOCKSIZE);
+						inode_write(mp, &pathi, tmpchinum );
+						release_inode(mp, tmpchinum);
+						// puts("child inode disk released");
+
+						goto out;
+
+					} else{	// if not a directory
+						error_message(mp, "rmdir", org_path, -2);
+						goto out;
+					}
+				}
+			}
+
+		}
+	}
+
+	// path not found
+	error_message(mp, "rmdir", org_path, -1);
+
+out:
+	sb_sync(mp->sm_vol);
+	inode_unlock(mp, cl);
+	inode_unlock(mp, pl);
+	write_end(mp);
+}
+
+void sfs_mv_r(struct sfs_mnt *mp, const char* src_name, const char* dst_name) 
+{
+
+	int srcfound=0, dstfound=0;
+
+	struct sfs_dir *modified_drtblock;
+	u_int32_t origin_drtblock_no;
+
+	// get cwd's inode
+	if (write_begin(mp)){
+		error_message(mp, "mv", dst_name, -15);
+		return;
+	}
+	struct ilock *pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_WRITE);
+	struct sfs_inode ci;
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+	// check invalid
+	if (!strcmp(src_name, ".") || !strcmp(dst_name, ".") ){
+		error_message(mp, "mv", ".", -8);
+		goto out;
+	}
+	if ( !strcmp(src_name, "..") || !strcmp(dst_name, "..") ){
+		error_message(mp, "mv", "..", -8);
+		goto out;
+	}
+
+	// find src_name
+	// cwd inode direct ptr loop
+	int i;
+	struct sfs_dir *tmpdtre;
+	for (i=0; i<SFS_NDIRECT; i++){
+		if (srcfound && dstfound)	// for lower stress
+			break;
+
+		// if direct ptr in use,
+		if (ci.sfi_direct[i]){
+			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
+			disk_read_r(mp->sm_dk, cdtrb, ci.sfi_direct[i] );
+
+			// cwd directory entry loop
+			int j;
+			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+				if (srcfound && dstfound)	// for lower stress
+					break;
+
+				// if directory entry in use
+				if (cdtrb[j].sfd_ino != SFS_NOINO){
+					// srcname found
+					if ( !srcfound && (strcmp(cdtrb[j].sfd_name, src_name) == 0) ){
+						srcfound = 1;
+						tmpdtre = &cdtrb[j];
+						modified_drtblock = cdtrb;
+						origin_drtblock_no = ci.sfi_direct[i];
+					}
+					// dstname found
+					if ( !dstfound && (strcmp(cdtrb[j].sfd_name, dst_name) == 0) ){
+						dstfound = 1;
+					}
+				}
+
+			}
+
+		}
+	}
+
+	if (!srcfound) {
+		error_message(mp, "mv", src_name, -1);
+		goto out;
+	}
+	if (dstfound) {
+		error_message(mp, "mv", dst_name, -6);
+		goto out;
+	}
+
+	// able to change the name
+	bzero(tmpdtre->sfd_name, SFS_NAMELEN);
+	strncpy(tmpdtre->sfd_name, dst_name, SFS_NAMELEN);
+
+	// write modified block on disk
+	disk_write_r(mp->sm_dk, modified_drtblock, origin_drtblock_no);
+
+out:
+	inode_unlock(mp, pl);
+	write_end(mp);
+}
+
+/*
+ * Clone src to dst in the current directory. The new inode points at
+ * the same data blocks and indirect block, with a reference taken on
+ * each, so a file of any size costs an inode and a directory entry.
+ * Whichever file is written later copies the blocks it changes.
+ */
+void sfs_cp_r(struct sfs_mnt *mp, const char* src_name, const char* dst_name)
+{
+
+	int srcfound=0, dstfound=0;
+	int empty_dtre_found=0;
+	int empty_direct_ptr=-1;
+
+	struct sfs_dir srcdtre, *tempdrte = NULL;
+	struct sfs_dir modified_drtblock[SFS_DENTRYPERBLOCK];
+	u_int32_t origin_drtblock_no = 0;
+	u_int32_t shared[SFS_NDIRECT + 1];
+	u_int32_t cifbn;
+
+	// get cwd's inode
+	if (write_begin(mp)){
+		error_message(mp, "cp", dst_name, -15);
+		return;
+	}
+	struct ilock *pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_WRITE);
+	struct ilock *cl = NULL;
+	u_int32_t nres = 0;
+	struct sfs_inode ci, new_inode;
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+	// check invalid
+	if (!strcmp(src_name, ".") || !strcmp(dst_name, ".") ){
+		error_message(mp, "cp", ".", -8);
+		goto out;
+	}
+	if ( !strcmp(src_name, "..") || !strcmp(dst_name, "..") ){
+		error_message(mp, "cp", "..", -8);
+		goto out;
+	}
+
+	// find src_name, dst_name and a free entry
+	// cwd inode direct ptr loop
+	int i;
+	for (i=0; i<SFS_NDIRECT; i++){
+		// if direct ptr in use,
+		if (ci.sfi_direct[i]){
+			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
+			disk_read_r(mp->sm_dk, cdtrb, ci.sfi_direct[i] );
+
+			// cwd directory entry loop
+			int j;
+			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+				if (cdtrb[j].sfd_ino == SFS_NOINO){
+					if (!empty_dtre_found){	// fisrt empty directory entry found
+						empty_dtre_found = 1;
+						memcpy(modified_drtblock, cdtrb, SFS_BLOCKSIZE);
+						tempdrte = &modified_drtblock[j];
+						origin_drtblock_no = ci.sfi_direct[i];
+					}
+					continue;
+				}
+				// srcname found
+				if ( !srcfound && (strcmp(cdtrb[j].sfd_name, src_name) == 0) ){
+					srcfound = 1;
+					srcdtre = cdtrb[j];
+				}
+				// dstname found
+				if ( !dstfound && (strcmp(cdtrb[j].sfd_name, dst_name) == 0) ){
+					dstfound = 1;
+				}
+			}
+
+		} else if (empty_direct_ptr < 0){
+			empty_direct_ptr = i;
+		}
+	}
+
+	if (!srcfound) {
+		error_message(mp, "cp", src_name, -1);
+		goto out;
+	}
+	if (dstfound) {
+		error_message(mp, "cp", dst_name, -6);
+		goto out;
+	}
+	if(!empty_dtre_found && empty_direct_ptr < 0){	// directory full
+		error_message(mp, "cp", dst_name, -3);
+		goto out;
+	}
+
+	cl = inode_lock_child(mp, &pl, &srcdtre, IL_READ);
+	inode_read(mp, &new_inode, srcdtre.sfd_ino );
+	if (new_inode.sfi_type != SFS_TYPE_FILE){
+		error_message(mp, "cp", src_name, -9);
+		goto out;
+	}
+
+	// blocks needed: inode, and a directory block if the last one is full
+	nres = 1 + !empty_dtre_found;
+	if (reserve_blocks(mp, nres)){
+		nres = 0;
+		error_message(mp, "cp", dst_name, -4);
+		goto out;
+	}
+
+	cifbn = take_free_inode(mp, mp->sm_cwd.sfd_ino);	// find a free inode near its directory
+	if (!cifbn){	// no more free block
+		error_message(mp, "cp", dst_name, -4);
+		goto out;
+	}
+
+	// an inline file's data is in the inode, and nothing is shared
+	if (!(new_inode.sfi_flags & SFS_IFLAG_INLINE)){
+		memcpy(shared, new_inode.sfi_direct, sizeof(new_inode.sfi_direct));
+		shared[SFS_NDIRECT] = new_inode.sfi_indirect;
+		if (block_ref(mp, shared, SFS_NDIRECT + 1)){
+			release_inode(mp, cifbn);
+			error_message(mp, "cp", dst_name, -4);
+			goto out;
+		}
+	}
+
+	// child i-node write back
+	inode_write(mp, &new_inode, cifbn);
+
+	/* for directory block (current or new) */
+	if(!empty_dtre_found){
+		// new direct ptr -> new directory block allocate
+		bzero(modified_drtblock, SFS_BLOCKSIZE);	// all SFS_NOINO
+		tempdrte = &modified_drtblock[0];
+		origin_drtblock_no = take_free_block(mp);	// reserved above
+		ci.sfi_direct[empty_direct_ptr] = origin_drtblock_no;	// parent direct ptr update (for new directory block)
+	}
+	tempdrte->sfd_ino = cifbn;
+	bzero(tempdrte->sfd_name, SFS_NAMELEN);
+	strncpy(tempdrte->sfd_name, dst_name, SFS_NAMELEN);
+	disk_write_r(mp->sm_dk, modified_drtblock, origin_drtblock_no);
+
+	/* for parent i-node */
+
+	ci.sfi_size += sizeof(struct sfs_dir);	// file size up (one directory entry added)
+	inode_write(mp, &ci, mp->sm_cwd.sfd_ino );
+
+out:
+	unreserve_blocks(mp, nres);
+	sb_sync(mp->sm_vol);
+	inode_unlock(mp, cl);
+	inode_unlock(mp, pl);
+	write_end(mp);
+}
+
+/*
+ * What a removal lets go of, given back together at the end so each
+ * bitmap and inode table block is written once. Inodes are locked for
+ * writing as they are reached, top down like every other walk, and
+ * stay locked until they are gone.
+ */
+struct rmtree {
+	u_int32_t *rt_ino;		// inodes to remove, in walk order
+	struct ilock **rt_lock;		// and their locks
+	u_int32_t rt_nino, rt_maxino;
+	u_int32_t *rt_block;		// blocks to give back
+	u_int32_t rt_nblock, rt_maxblock;
+};
+
+static void rt_add_inode(struct rmtree *rt, u_int32_t ino, struct ilock *il){
+
+	if (rt->rt_nino == rt->rt_maxino){
+		rt->rt_maxino = rt->rt_maxino ? rt->rt_maxino * 2 : 64;
+		rt->rt_ino = (u_int32_t*)realloc(rt->rt_ino, rt->rt_maxino * sizeof(u_int32_t));
+		rt->rt_lock = (struct ilock**)realloc(rt->rt_lock, rt->rt_maxino * sizeof(struct ilock*));
+		if (rt->rt_ino == NULL || rt->rt_lock == NULL)
+			err(1, "malloc");
+	}
+	rt->rt_ino[rt->rt_nino] = ino;
+	rt->rt_lock[rt->rt_nino++] = il;
+}
+
+static void rt_add_block(struct rmtree *rt, u_int32_t blockno){
+
+	if (rt->rt_nblock == rt->rt_maxblock){
+		rt->rt_maxblock = rt->rt_maxblock ? rt->rt_maxblock * 2 : 256;
+		rt->rt_block = (u_int32_t*)realloc(rt->rt_block, rt->rt_maxblock * sizeof(u_int32_t));
+		if (rt->rt_block == NULL)
+			err(1, "malloc");
+	}
+	rt->rt_block[rt->rt_nblock++] = blockno;
+}
+
+/* a file's blocks, as put_data_block() and put_ptr_block() would let go of them */
+static void rt_file(struct sfs_mnt *mp, struct rmtree *rt, const struct sfs_inode *inode){
+
+	u_int32_t realblock[SFS_DBPERIDB];
+	int k;
+
+	for (k=0; k<SFS_NDIRECT; k++){
+		if (inode->sfi_direct[k] && block_unref(mp, inode->sfi_direct[k]))
+			rt_add_block(rt, inode->sfi_direct[k]);
+	}
+	if (inode->sfi_indirect && block_unref(mp, inode->sfi_indirect)){
+		disk_read_r(mp->sm_dk, realblock, inode->sfi_indirect);
+		for (k=0; k<SFS_DBPERIDB; k++){
+			if (realblock[k] && block_unref(mp, realblock[k]))
+				rt_add_block(rt, realblock[k]);
+		}
+		rt_add_block(rt, inode->sfi_indirect);
+	}
+}
+
+/*
+ * Walk everything under the inodes queued so far, queueing what each
+ * directory holds behind them. A directory's blocks and its children's
+ * inodes are read ahead before they are needed.
+ */
+static void rt_walk(struct sfs_mnt *mp, struct rmtree *rt){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	struct sfs_dir dirb[SFS_DENTRYPERBLOCK];
+	struct sfs_inode inode;
+	u_int32_t i, ino;
+	int k, j;
+
+	for (i=0; i<rt->rt_nino; i++){
+		inode_read(mp, &inode, rt->rt_ino[i]);
+		if (inode.sfi_type != SFS_TYPE_DIR){
+			rt_file(mp, rt, &inode);
+			continue;
+		}
+
+		for (k=0; k<SFS_NDIRECT; k++){
+			if (inode.sfi_direct[k])
+				disk_readahead_r(mp->sm_dk, inode.sfi_direct[k], 1);
+		}
+		for (k=0; k<SFS_NDIRECT; k++){
+			if (!inode.sfi_direct[k])
+				continue;
+			disk_read_r(mp->sm_dk, dirb, inode.sfi_direct[k]);
+			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+				ino = dirb[j].sfd_ino;
+				if (ino == SFS_NOINO || !strcmp(dirb[j].sfd_name, ".") || !strcmp(dirb[j].sfd_name, ".."))
+					continue;
+				disk_readahead_r(mp->sm_dk, vp->sv_packed ? vp->sv_spb.sp_itable + ino/SFS_PINODEPERBLOCK : ino, 1);
+				rt_add_inode(rt, ino, inode_lock(mp, ino, IL_WRITE));
+			}
+			rt_add_block(rt, inode.sfi_direct[k]);
+		}
+	}
+}
+
+/*
+ * Clear and give back everything collected, then unlock the inodes.
+ * Freed blocks are cleared through the snapshot hook like any other.
+ */
+static void rt_release(struct sfs_mnt *mp, struct rmtree *rt){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	char zero[SFS_BLOCKSIZE], tblock[SFS_BLOCKSIZE];
+	u_int32_t i, blockno;
+
+	bzero(zero, SFS_BLOCKSIZE);
+	if (vp->sv_packed){
+		// zero the inodes a table block at a time, then free their slots
+		qsort(rt->rt_ino, rt->rt_nino, sizeof(u_int32_t), blockno_cmp);
+		for (i=0; i<rt->rt_nino; ){
+			blockno = vp->sv_spb.sp_itable + rt->rt_ino[i]/SFS_PINODEPERBLOCK;
+			pthread_mutex_lock(&vp->sv_itlock[blockno % SFS_ITLOCKS]);
+			disk_read_r(mp->sm_dk, tblock, blockno);
+			for ( ; i<rt->rt_nino && vp->sv_spb.sp_itable + rt->rt_ino[i]/SFS_PINODEPERBLOCK == blockno; i++){
+				bzero(&tblock[(rt->rt_ino[i]%SFS_PINODEPERBLOCK) * SFS_PINODESIZE], SFS_PINODESIZE);
+			}
+			disk_write_r(mp->sm_dk, tblock, blockno);
+			pthread_mutex_unlock(&vp->sv_itlock[blockno % SFS_ITLOCKS]);
+		}
+		pthread_mutex_lock(&vp->sv_imaplock);
+		for (i=0; i<rt->rt_nino; i++){
+			BIT_CLEAR(vp->sv_imap[rt->rt_ino[i]/8], rt->rt_ino[i]%8);
+		}
+		pthread_mutex_unlock(&vp->sv_imaplock);
+	} else{
+		for (i=0; i<rt->rt_nino; i++){	// an inode is a block
+			rt_add_block(rt, rt->rt_ino[i]);
+		}
+	}
+
+	for (i=0; i<rt->rt_nblock; i++){
+		disk_write_r(mp->sm_dk, zero, rt->rt_block[i]);
+	}
+	release_blocks(mp, rt->rt_block, rt->rt_nblock);
+
+	for (i=0; i<rt->rt_nino; i++){
+		inode_unlock(mp, rt->rt_lock[i]);
+	}
+	free(rt->rt_ino);
+	free(rt->rt_lock);
+	free(rt->rt_block);
+}
+
+/*
+ * Remove the files named names[0..n-1] from the cwd, or with glob
+ * every file matching one of them as fnmatch(3) patterns; with
+ * SFS_RM_RECURSIVE directories go too, with all they hold. Directory
+ * entries go first, then everything under them at once.
+ */
+static void dir_remove(struct sfs_mnt *mp, char *const names[], int n, int glob, int flags)
+{
+	struct sfs_dir db[SFS_NDIRECT][SFS_DENTRYPERBLOCK], *de;
+	struct rmtree rt;
+	struct ilock *c;
+	int dirty[SFS_NDIRECT], *matched;
+	struct sfs_inode ci, pathi;
+	int i, b, j, hit;
+
+	if (write_begin(mp)){
+		for (i=0; i<n; i++)
+			error_message(mp, "rm", names[i], -15);
+		return;
+	}
+	struct ilock *pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_WRITE);
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+	matched = calloc(n, sizeof(int));
+	if (matched == NULL)
+		err(1, "malloc");
+	bzero(dirty, sizeof(dirty));
+	bzero(&rt, sizeof(rt));
+
+	// cwd inode direct ptr loop
+	for (b=0; b<SFS_NDIRECT; b++){
+		if (!ci.sfi_direct[b])
+			continue;
+		disk_read_r(mp->sm_dk, db[b], ci.sfi_direct[b] );
+
+		// cwd directory entry loop
+		for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+			de = &db[b][j];
+			if (de->sfd_ino == SFS_NOINO)
+				continue;
+			for (i=0, hit=0; i<n; i++){
+				if (glob ? fnmatch(names[i], de->sfd_name, FNM_PERIOD) == 0 : strcmp(de->sfd_name, names[i]) == 0)
+					hit = matched[i] = 1;
+			}
+			if (!hit)
+				continue;
+
+			// "." and ".." are the directory and its parent
+			if (!strcmp(de->sfd_name, ".") || !strcmp(de->sfd_name, "..")){
+				error_message(mp, "rm", de->sfd_name, -9);
+				continue;
+			}
+			c = inode_lock(mp, de->sfd_ino, IL_WRITE);
+			inode_read(mp, &pathi, de->sfd_ino );
+			if (pathi.sfi_type != SFS_TYPE_FILE && !(flags & SFS_RM_RECURSIVE)){	// if not a file
+				inode_unlock(mp, c);
+				error_message(mp, "rm", de->sfd_name, -9);
+				continue;
+			}
+
+			/* directory entry i-node number release */
+			rt_add_inode(&rt, de->sfd_ino, c);
+			de->sfd_ino = SFS_NOINO;
+			dirty[b] = 1;
+		}
+	}
+
+	if (rt.rt_nino){
+		for (b=0; b<SFS_NDIRECT; b++){
+			if (dirty[b])
+				disk_write_r(mp->sm_dk, db[b], ci.sfi_direct[b]);
+		}
+		ci.sfi_size -= rt.rt_nino * sizeof(struct sfs_dir);	// decrease parent size info
+		inode_write(mp, &ci, mp->sm_cwd.sfd_ino);
+		dir_shrink(mp, mp->sm_cwd.sfd_ino, &ci, 0);
+
+		rt_walk(mp, &rt);
+	}
+	rt_release(mp, &rt);
+
+	// path not found
+	for (i=0; i<n; i++){
+		if (!matched[i])
+			error_message(mp, "rm", names[i], -1);
+	}
+	free(matched);
+
+	sb_sync(mp->sm_vol);
+	inode_unlock(mp, pl);
+	write_end(mp);
+}
+
+void sfs_rm_r(struct sfs_mnt *mp, const char* path) 
+{
+	dir_remove(mp, (char *const *)&path, 1, 0, 0);
+}
+
+void sfs_rmv_r(struct sfs_mnt *mp, int n, char *const patterns[])
+{
+	dir_remove(mp, patterns, n, 1, 0);
+}
+
+void sfs_rmv_flags_r(struct sfs_mnt *mp, int n, char *const patterns[], int flags)
+{
+	dir_remove(mp, patterns, n, 1, flags);
+}
+
+
+/*
+ * Put one block of a file being copied in at file block index:
+ * shared if dedup finds the data on the volume, else written to a new
+ * block. Makes the indirect block on first use. Returns 0, or -4 if
+ * the volume is full.
+ */
+static int place_block(struct sfs_mnt *mp, struct sfs_inode *inode, u_int32_t *realblock, int index, const char *data, u_int32_t *hits){
+
+	u_int32_t blockno = 0, hash = 0;
+	int shared;
+	int dedup = mp->sm_vol->sv_dedup;	// once: dedup off may come meanwhile
+
+	if (index >= SFS_NDIRECT && !inode->sfi_indirect){
+		// indirect ptr's realblock
+		inode->sfi_indirect = take_free_block(mp);
+		if (!inode->sfi_indirect)
+			return -4;
+	}
+
+	// the same data may be there already
+	if (dedup){
+		hash = block_hash(data);
+		blockno = dedup_find(mp, data, hash);
+	}
+	shared = (blockno != 0);
+	*hits += shared;
+
+	// find one free block
+	if (!shared)
+		blockno = take_free_block(mp);
+	if (!blockno)
+		return -4;
+
+	if (index < SFS_NDIRECT)
+		inode->sfi_direct[index] = blockno;	// link with i-node's direct ptr
+	else{
+		realblock[index - SFS_NDIRECT] = blockno;	// link with indirect ptr's realblock
+		disk_write_r(mp->sm_dk, realblock, inode->sfi_indirect);
+	}
+
+	// write into local one block
+	if (!shared){
+		disk_write_r(mp->sm_dk, data, blockno);
+		if (dedup)
+			dedup_add(mp, blockno, hash);
+	}
+	return 0;
+}
+
+/*
+ * Write data as block index of a file: over the block the file has
+ * there, copied first if it is shared, or into a new one for a hole.
+ * The caller writes the inode back. Returns 1, or -4 if no block is
+ * available.
+ */
+static int file_put_block(struct sfs_mnt *mp, struct sfs_inode *inode, u_int32_t index, const char *data, u_int32_t *hits){
+
+	u_int32_t realblock[SFS_DBPERIDB], blockno;
+
+	if (file_block_cow(mp, inode, index, &blockno))
+		return -4;
+	if (!blockno){	// a hole; the indirect block is the file's own by now
+		bzero(realblock, SFS_BLOCKSIZE);
+		if (index >= SFS_NDIRECT && inode->sfi_indirect)
+			disk_read_r(mp->sm_dk, realblock, inode->sfi_indirect);
+		return place_block(mp, inode, realblock, index, data, hits) ? -4 : 1;
+	}
+	disk_write_r(mp->sm_dk, data, blockno);
+	if (mp->sm_vol->sv_dedup)
+		dedup_add(mp, blockno, block_hash(data));
+	return 1;
+}
+
+/*
+ * Is the block all zeros? Each 64-byte chunk is ORed together with no
+ * branch inside, which the compiler turns into vector instructions.
+ */
+static int block_is_zero(const void *data){
+	const char *p = data;
+	u_int64_t acc, w;
+	int i, j;
+
+	for (i=0; i<SFS_BLOCKSIZE; i+=64){
+		acc = 0;
+		for (j=0; j<64; j+=8){
+			memcpy(&w, p + i + j, 8);
+			acc |= w;
+		}
+		if (acc)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Bring block index of a file being updated to data, or to a hole if
+ * data is NULL. A block the file owns is written over, a shared one is
+ * copied first, and a hole gets a new block. Returns 1 if a block was
+ * written, 0 if not, or -4 if no block is available.
+ */
+static int update_block(struct sfs_mnt *mp, struct sfs_inode *inode, u_int32_t index, const char *data, u_int32_t *hits){
+
+	u_int32_t realblock[SFS_DBPERIDB], blockno;
+
+	if (data != NULL)
+		return file_put_block(mp, inode, index, data, hits);
+
+	bzero(realblock, SFS_BLOCKSIZE);
+	if (index >= SFS_NDIRECT && inode->sfi_indirect)
+		disk_read_r(mp->sm_dk, realblock, inode->sfi_indirect);
+	blockno = (index < SFS_NDIRECT) ? inode->sfi_direct[index] : realblock[index - SFS_NDIRECT];
+	if (!blockno)
+		return 0;
+	if (index < SFS_NDIRECT)
+		inode->sfi_direct[index] = 0;
+	else{
+		if (ptr_block_own(mp, inode, realblock))
+			return -4;
+		realblock[index - SFS_NDIRECT] = 0;
+		disk_write_r(mp->sm_dk, realblock, inode->sfi_indirect);
+	}
+	put_data_block(mp, blockno);
+	return 0;
+}
+
+/*
+ * cpin -u of a file that is there already: the host file is laid out
+ * as a new copy would be, and only the blocks that differ from the
+ * file's are written. Blocks past the new end are let go of. A file
+ * stored another way (inline, or compressed when the copy is not) is
+ * emptied first. The caller holds the file write locked.
+ *
+ * Nothing can fail once the file is being changed: the host file is
+ * read and compared with the file first, a block is reserved for each
+ * one that differs, and the indirect block is made the file's own
+ * before any data moves.
+ */
+#define UPD_KEEP  0	// block as it is
+#define UPD_DATA  1	// write the new data
+#define UPD_HOLE  2	// let the block go
+
+static void cpin_update(struct sfs_mnt *mp, const char *local_path, const char *path, u_int32_t ino, int flags)
+{
+	struct sfs_inode inode;
+	u_int32_t realblock[SFS_DBPERIDB];
+	char datablock[SFS_CZBLOCKS * SFS_BLOCKSIZE];
+	char zblock[SFS_CZBLOCKS * SFS_BLOCKSIZE];
+	char old[SFS_BLOCKSIZE];
+	char *host, *data;
+	u_int8_t *todo = NULL;
+	u_int32_t ndata, nres = 0, index, blockno, clen, nblocks = 0, hits = 0, comp = 0;
+	int total = 0, totalfs = mp->sm_filesize;
+	int start, len, n, k, r, zero, hole = 0, sparse = 0, chunk = 1, recast;
+	struct timespec t0, t1;
+
+	inode_read(mp, &inode, ino);
+	if (inode.sfi_type != SFS_TYPE_FILE){
+		error_message(mp, "cpin", local_path, -10);
+		return;
+	}
+
+	// the whole host file, so a read error can't stop it halfway
+	ndata = (totalfs + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE;
+	host = (char*)malloc(ndata * SFS_BLOCKSIZE + 1);
+	if (host == NULL)
+		err(1, "malloc");
+	bzero(host, ndata * SFS_BLOCKSIZE);
+	for (n=0; n<ndata; n++){
+		len = custom_disk_read(mp, &host[n * SFS_BLOCKSIZE], n);
+		if (len < 0){
+			error_message(mp, "cpin", path, len);
+			free(host);
+			return;
+		}
+		if (len < SFS_BLOCKSIZE){	// got shorter
+			total += len;
+			break;
+		}
+		total += len;
+	}
+	totalfs = total;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	/* tiny file: the data goes in the inode */
+	ndata = (totalfs + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE;
+	if (totalfs <= mp->sm_vol->sv_inlinemax){
+		if ((inode.sfi_flags & SFS_IFLAG_INLINE) && inode.sfi_size == total &&
+		    memcmp(inode.sfi_inline, host, total) == 0)
+			goto done;
+		file_truncate(mp, &inode, 0);	// all of it: takes no block
+		bzero(inode.sfi_inline, SFS_INLINESIZE);
+		memcpy(inode.sfi_inline, host, total);
+		inode.sfi_flags &= ~(SFS_IFLAG_INLINE | SFS_IFLAG_COMP);
+		if (total > 0)
+			inode.sfi_flags |= SFS_IFLAG_INLINE;
+		goto done;
+	}
+
+	if (flags & SFS_CPIN_COMPRESS){
+		comp = SFS_IFLAG_COMP;
+		chunk = SFS_CZBLOCKS;
+	}
+	recast = (inode.sfi_flags & (SFS_IFLAG_INLINE | SFS_IFLAG_COMP)) != comp;
+	todo = (u_int8_t*)malloc(ndata);
+	if (todo == NULL)
+		err(1, "malloc");
+
+	// chunks are cut and compressed as cpin does, so an unchanged
+	// chunk comes out as the same blocks; each goes back in its place
+	// in host, k blocks of data, then holes for the rest of the chunk
+	for (index=0, start=0; start < totalfs; index+=n, start+=len){
+		n = (totalfs - start + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE;
+		if (n > chunk)
+			n = chunk;
+		len = (totalfs - start < n * SFS_BLOCKSIZE) ? totalfs - start : n * SFS_BLOCKSIZE;
+		bzero(datablock, chunk * SFS_BLOCKSIZE);
+		memcpy(datablock, &host[start], len);
+		zero = 1;
+		for (k=0; k<n; k++){
+			zero = zero && block_is_zero(&datablock[k * SFS_BLOCKSIZE]);
+		}
+
+		k = n;
+		if (zero){
+			hole = 1;
+			k = 0;
+		} else{
+			if (hole)	// data after a hole, which fsck can't see
+				sparse = 1;
+			if (n > 1){
+				clen = sfs_lz_compress(datablock, len, zblock + 4, (n - 1) * SFS_BLOCKSIZE - 4);
+				if (clen){
+					memcpy(zblock, &clen, 4);
+					k = (4 + clen + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE;
+					bzero(zblock + 4 + clen, k * SFS_BLOCKSIZE - 4 - clen);
+					memcpy(&host[start], zblock, k * SFS_BLOCKSIZE);
+				}
+			}
+		}
+		for (r=0; r<n; r++)
+			todo[index + r] = (r < k) ? UPD_DATA : UPD_HOLE;
+	}
+
+	// what differs from the file, emptied first if stored another way;
+	// each block of new data is a new one or the copy of a shared one
+	bzero(realblock, SFS_BLOCKSIZE);
+	if (!recast && inode.sfi_indirect)
+		disk_read_r(mp->sm_dk, realblock, inode.sfi_indirect);
+	for (index=0; index<ndata; index++){
+		blockno = 0;
+		if (!recast)
+			blockno = (index < SFS_NDIRECT) ? inode.sfi_direct[index] : realblock[index - SFS_NDIRECT];
+		data = &host[index * SFS_BLOCKSIZE];
+		if (todo[index] == UPD_HOLE){
+			if (!blockno)
+				todo[index] = UPD_KEEP;
+			continue;
+		}
+		if (blockno){
+			disk_read_r(mp->sm_dk, old, blockno);
+			if (memcmp(old, data, SFS_BLOCKSIZE) == 0){
+				todo[index] = UPD_KEEP;
+				continue;
+			}
+		}
+		nres++;
+	}
+	nres += (ndata > SFS_NDIRECT);	// the indirect block, new or copied
+	if (reserve_blocks(mp, nres)){
+		error_message(mp, "cpin", local_path, -4);
+		free(todo);
+		free(host);
+		return;
+	}
+
+	if (recast){
+		file_truncate(mp, &inode, 0);
+		bzero(inode.sfi_inline, SFS_INLINESIZE);
+		inode.sfi_flags = (inode.sfi_flags & ~(SFS_IFLAG_INLINE | SFS_IFLAG_COMP)) | comp;
+	}
+
+	// a clone's pointer block is copied now, the one step that can
+	// fail (a full count), while the file is still as it was
+	if (inode.sfi_indirect && ndata > SFS_NDIRECT && ptr_block_own(mp, &inode, realblock)){
+		inode_write(mp, &inode, ino);
+		error_message(mp, "cpin", local_path, -4);
+		unreserve_blocks(mp, nres);
+		free(todo);
+		free(host);
+		return;
+	}
+
+	if (sparse)
+		sb_setfeature(mp->sm_vol, SFS_FEAT_SPARSE);
+	for (index=0; index<ndata; index++){
+		if (todo[index] == UPD_KEEP)
+			continue;
+		data = (todo[index] == UPD_DATA) ? &host[index * SFS_BLOCKSIZE] : NULL;
+		r = update_block(mp, &inode, index, data, &hits);
+		assert(r >= 0);	// reserved above
+		nblocks += r;
+	}
+
+	// what was past the new end; the pointer block is the file's own
+	file_truncate(mp, &inode, ndata);
+
+done:
+	inode.sfi_size = total;
+	inode_write(mp, &inode, ino);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pthread_mutex_lock(&mp->sm_vol->sv_ddlock);
+	mp->sm_vol->sv_impbytes += total;
+	mp->sm_vol->sv_impblocks += nblocks;
+	mp->sm_vol->sv_imphits += hits;
+	mp->sm_vol->sv_impsecs += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	pthread_mutex_unlock(&mp->sm_vol->sv_ddlock);
+	unreserve_blocks(mp, nres);
+	free(todo);
+	free(host);
+}
+
+void sfs_cpin_flags_r(struct sfs_mnt *mp, const char* local_path, const char* path, int flags) 
+{
+
+	// host path check; it stays open for the copy
+	if (custom_disk_open(mp, path)){
+		error_message(mp, "cpin", path, -12);
+		return;
+	}
+
+	// total mp->sm_filesize check
+	mp->sm_filesize = lseek(mp->sm_hostfd, 0, SEEK_END);
+	if (mp->sm_filesize > SFS_MAXFILESIZE){
+		error_message(mp, "cpin", "", -11);
+		custom_disk_close(mp);
+		return;
+	}
+
+
+
+	int empty_dtre_found=0;
+	int empty_direct_ptr=0;
+
+	struct sfs_dir *modified_drtblock;
+	u_int32_t origin_drtblock_no;
+	u_int32_t fbn;
+
+	if (write_begin(mp)){
+		error_message(mp, "cpin", local_path, -15);
+		custom_disk_close(mp);
+		return;
+	}
+	struct ilock *pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_WRITE);
+	u_int32_t nres = 0;
+	struct ilock *cl = NULL;
+	struct sfs_inode ci;
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+
+
+	// check if the local path already exists
+	// cwd inode direct ptr loop
+	int i;
+	struct sfs_dir *tempdrte;
+	for (i=0; i<SFS_NDIRECT; i++){
+		// if direct ptr in use,
+		if (ci.sfi_direct[i]){
+			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
+			disk_read_r(mp->sm_dk, cdtrb, ci.sfi_direct[i] );
+
+			// cwd directory entry loop
+			int j;
+			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+				if (!empty_dtre_found && (cdtrb[j].sfd_ino == SFS_NOINO)){	// fisrt empty directory entry found
+					empty_dtre_found = 1;
+					tempdrte = &cdtrb[j];
+					modified_drtblock = cdtrb;
+					origin_drtblock_no = ci.sfi_direct[i];
+				}
+
+				// if directory entry in use, and local_path already exists
+				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, local_path) == 0) ){
+					if (flags & SFS_CPIN_UPDATE){
+						// update it in place, holding it instead of the directory
+						cl = inode_lock_child(mp, &pl, &cdtrb[j], IL_WRITE);
+						inode_unlock(mp, pl);
+						pl = NULL;
+						cpin_update(mp, local_path, path, cdtrb[j].sfd_ino, flags);
+						goto out;
+					}
+					error_message(mp, "cpin", local_path, -6);
+					goto out;
+				}
+			}
+			if (empty_dtre_found)
+				break;
+
+		} else {
+			empty_direct_ptr = i;
+			break;
+		}
+	}
+
+
+	if(!empty_dtre_found && !empty_direct_ptr){	// directory full
+		error_message(mp, "cpin", path, -3);
+		goto out;
+	}
+
+	// blocks needed: inode, data, the indirect block for big files, and
+	// a directory block if the last one is full
+	u_int32_t ndata = (mp->sm_filesize + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE;
+	if (mp->sm_filesize <= mp->sm_vol->sv_inlinemax)
+		ndata = 0;	// fits in the inode
+	nres = 1 + ndata + (ndata > SFS_NDIRECT) + !empty_dtre_found;
+	if (reserve_blocks(mp, nres)){
+		nres = 0;
+		error_message(mp, "cpin", local_path, -4);
+		goto out;
+	}
+
+
+	int ndpfbn;
+	if (!empty_dtre_found){
+		ndpfbn = take_free_block(mp);
+		if (!ndpfbn){	// no more free block
+			error_message(mp, "cpin", local_path, -4);
+			goto out;
+		}
+	}
+
+
+
+
+
+
+	/* for new file i-node*/
+
+	// path not exists
+	struct sfs_inode new_inode;
+	bzero(&new_inode,SFS_BLOCKSIZE); // initalize sfi_direct[] and sfi_indirect
+	new_inode.sfi_size = 0;
+	new_inode.sfi_type = SFS_TYPE_FILE;
+
+	fbn = take_free_inode(mp, mp->sm_cwd.sfd_ino);	// find a free inode near its directory, and mark it in use
+	if (!fbn){	// no more free block
+		error_message(mp, "cpin", local_path, -4);
+		goto out;
+	}
+	u_int32_t cifbn = fbn;
+
+
+	/* for directory block (current or new) */
+	if(!empty_dtre_found){
+		// new direct ptr -> new directory block allocate
+		struct sfs_dir new_dtrb[SFS_DENTRYPERBLOCK];
+		bzero(new_dtrb, SFS_BLOCKSIZE);
+		int i;
+		for(i=0; i<SFS_DENTRYPERBLOCK; i++){
+			new_dtrb[i].sfd_ino = SFS_NOINO;
+		}
+
+
+		new_dtrb[0].sfd_ino = cifbn;
+		bzero(new_dtrb[0].sfd_name, SFS_NAMELEN);
+		strncpy(new_dtrb[0].sfd_name, local_path, SFS_NAMELEN);
+		disk_write_r(mp->sm_dk, new_dtrb, ndpfbn);
+
+		ci.sfi_direct[empty_direct_ptr] = ndpfbn;	// parent direct ptr update (for new directory block)
+	} else{	// found empty directory entry
+		tempdrte->sfd_ino = cifbn;
+		bzero(tempdrte->sfd_name, SFS_NAMELEN);
+		strncpy(tempdrte->sfd_name, local_path, SFS_NAMELEN);
+		disk_write_r(mp->sm_dk, modified_drtblock, origin_drtblock_no);
+	}
+
+	/* for parent i-node */
+
+	ci.sfi_size += sizeof(struct sfs_dir);	// file size up (one directory entry added)
+	inode_write(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	// the new file is reachable now; hold it instead of the directory while copying
+	cl = inode_lock(mp, cifbn, IL_WRITE);
+	inode_unlock(mp, pl);
+	pl = NULL;
+
+
+	/* tiny file: data goes in the inode block itself */
+	int len;
+	if (mp->sm_filesize > 0 && mp->sm_filesize <= mp->sm_vol->sv_inlinemax){
+		len = custom_disk_read(mp, new_inode.sfi_inline, 0);
+		if (len < 0){
+			bzero(new_inode.sfi_inline, SFS_INLINESIZE);
+			inode_write(mp, &new_inode, cifbn);
+			error_message(mp, "cpin", path, len);
+			goto out;
+		}
+		new_inode.sfi_size = len;
+		new_inode.sfi_flags |= SFS_IFLAG_INLINE;
+		inode_write(mp, &new_inode, cifbn);
+		goto out;
+	}
+
+	/* new file datablock */
+	
+	int index=0;
+	int n, k;
+	char datablock[SFS_CZBLOCKS * SFS_BLOCKSIZE];
+	char zblock[SFS_CZBLOCKS * SFS_BLOCKSIZE];
+	char *data;
+	u_int32_t location = 0;
+	u_int32_t realblock[SFS_DBPERIDB];
+	bzero(realblock, SFS_BLOCKSIZE);
+
+	int total=0, start;
+	int hole=0, zero;
+	int chunk = 1;	// blocks read at a time
+	u_int32_t clen, nblocks=0, hits=0;
+	struct timespec t0, t1;
+	int totalfs = mp->sm_filesize;
+
+	if (flags & SFS_CPIN_COMPRESS){
+		new_inode.sfi_flags |= SFS_IFLAG_COMP;
+		chunk = SFS_CZBLOCKS;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while(total < totalfs){
+		start = total;
+		bzero(datablock, chunk * SFS_BLOCKSIZE);
+		zero = 1;
+		for (n=0; n<chunk && total<totalfs; n++){
+			len = custom_disk_read(mp, &datablock[n * SFS_BLOCKSIZE], location++);
+			if (len < 0){
+				new_inode.sfi_size = start;
+				inode_write(mp, &new_inode, cifbn);
+				error_message(mp, "cpin", path, len);
+				goto out;
+			}
+			total += len;
+			zero = zero && block_is_zero(&datablock[n * SFS_BLOCKSIZE]);
+		}
+
+		// nothing but zeros: leave a hole
+		if (zero){
+			hole = 1;
+			index += n;
+			continue;
+		}
+		if (hole)	// data after a hole, which fsck can't see
+			sb_setfeature(mp->sm_vol, SFS_FEAT_SPARSE);
+
+		// compressed, if that saves at least a block
+		data = datablock;
+		k = n;
+		if (n > 1){
+			clen = sfs_lz_compress(datablock, total - start, zblock + 4, (n - 1) * SFS_BLOCKSIZE - 4);
+			if (clen){
+				memcpy(zblock, &clen, 4);
+				k = (4 + clen + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE;
+				bzero(zblock + 4 + clen, k * SFS_BLOCKSIZE - 4 - clen);
+				data = zblock;
+			}
+		}
+
+		for (; k>0; k--, n--, index++, data+=SFS_BLOCKSIZE){
+			if (place_block(mp, &new_inode, realblock, index, data, &hits)){	//no more free block
+				new_inode.sfi_size = start;
+				inode_write(mp, &new_inode, cifbn);
+				error_message(mp, "cpin", local_path, -4);
+				goto out;
+			}
+			nblocks++;
+		}
+		index += n;	// the blocks compression saved
+		inode_write(mp, &new_inode, cifbn);
+
+	}
+
+	new_inode.sfi_size = total;
+	inode_write(mp, &new_inode, cifbn);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pthread_mutex_lock(&mp->sm_vol->sv_ddlock);
+	mp->sm_vol->sv_impbytes += total;
+	mp->sm_vol->sv_impblocks += nblocks;
+	mp->sm_vol->sv_imphits += hits;
+	mp->sm_vol->sv_impsecs += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	pthread_mutex_unlock(&mp->sm_vol->sv_ddlock);
+
+out:
+	custom_disk_close(mp);
+	unreserve_blocks(mp, nres);
+	sb_sync(mp->sm_vol);
+	inode_unlock(mp, cl);
+	inode_unlock(mp, pl);
+	write_end(mp);
+}
+
+
+
+void sfs_cpin_r(struct sfs_mnt *mp, const char* local_path, const char* path)
+{
+	sfs_cpin_flags_r(mp, local_path, path, 0);
+}
+
+void sfs_cpout_r(struct sfs_mnt *mp, const char* local_path, const char* path) 
+{
+	vol_refresh(mp);
+
+	int target_ino = -1;
+	int bflag = 0;
+	int error = 0;
+
+
+	// get cwd's inode
+	struct ilock *pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_READ);
+	struct ilock *cl = NULL;
+	struct sfs_inode ci;
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+	// find path
+	// cwd inode direct ptr loop
+	int i;
+	for (i=0; i<SFS_NDIRECT; i++){
+		// if direct ptr in use,
+		if (ci.sfi_direct[i]){
+			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
+			disk_read_r(mp->sm_dk, cdtrb, ci.sfi_direct[i] );
+
+			// cwd directory entry loop
+			int j;
+			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+				// if directory entry in use, and path found
+				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, local_path) == 0) ){
+					target_ino = cdtrb[j].sfd_ino;
+					cl = inode_lock_child(mp, &pl, &cdtrb[j], IL_READ);
+					bflag = 1;
+					break;
+				}
+			}
+			if (bflag)
+				break;
+		}
+	}
+
+	// the file is held now; let other users at the directory
+	inode_unlock(mp, pl);
+	pl = NULL;
+
+	// path not found
+	if (target_ino == -1){
+		error_message(mp, "cpout", local_path, -1);
+		goto out;
+	}
+
+	int tempfd;
+	if ( (tempfd = open(path, O_RDWR)) >= 0 ){
+		error_message(mp, "cpout", path, -6);
+		goto out;
+	};
+	close(tempfd);
+
+
+
+
+	if ((error = custom_disk_open2(mp, path)) != 0){
+		error_message(mp, "cpout", path, error);
+		goto out;
+	}
+
+	// get i-node
+	struct sfs_inode targeti;
+	inode_read(mp, &targeti, target_ino);
+
+	mp->sm_filesize = targeti.sfi_size;
+	int totalfs = mp->sm_filesize;
+
+	if (targeti.sfi_flags & SFS_IFLAG_INLINE){
+		// data lives in the inode block
+		error = custom_disk_write(mp, targeti.sfi_inline, 0);
+		goto done;
+	}
+
+	// the file's blocks in order, 0 for a hole; the pointer block is
+	// asked for now and read when read-ahead gets to the end of the
+	// direct ones
+	u_int32_t blocks[SFS_NDIRECT + SFS_DBPERIDB];
+	u_int32_t nblocks, pos, end, run, skip, clen;
+	int ptrs_loaded = !targeti.sfi_indirect;
+	int comp = (targeti.sfi_flags & SFS_IFLAG_COMP) != 0;
+	struct rahead ra;
+	char *tempdb = disk_buf_get(mp->sm_dk);	// RA_MAXRUN blocks, aligned
+	char zblock[SFS_CZBLOCKS * SFS_BLOCKSIZE];
+
+	nblocks = (targeti.sfi_size + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE;
+	if (nblocks > SFS_NDIRECT + SFS_DBPERIDB)
+		nblocks = SFS_NDIRECT + SFS_DBPERIDB;
+	bzero(blocks, sizeof(blocks));
+	for (i=0; i<SFS_NDIRECT && i<nblocks; i++){
+		blocks[i] = targeti.sfi_direct[i];
+	}
+	if (targeti.sfi_indirect)
+		disk_readahead_r(mp->sm_dk, targeti.sfi_indirect, 1);
+
+	rahead_init(&ra);
+	for (pos=0; pos<nblocks; pos+=run){
+		// indirect
+		if (!ptrs_loaded && pos + ra.ra_win >= SFS_NDIRECT){
+			u_int32_t realblock[SFS_DBPERIDB];
+			disk_read_r(mp->sm_dk, realblock, targeti.sfi_indirect);
+
+			int j;
+			for (j=0; SFS_NDIRECT+j < nblocks; j++){
+				blocks[SFS_NDIRECT+j] = realblock[j];
+			}
+			ptrs_loaded = 1;
+		}
+
+		// compressed files go a chunk at a time
+		end = nblocks;
+		if (comp && end > pos - pos % SFS_CZBLOCKS + SFS_CZBLOCKS)
+			end = pos - pos % SFS_CZBLOCKS + SFS_CZBLOCKS;
+
+		// hole: leave it out of the host file too
+		if (!blocks[pos]){
+			for (run=1; pos+run < end && !blocks[pos+run]; run++)
+				;
+			skip = run*SFS_BLOCKSIZE;
+			mp->sm_filesize -= (skip < mp->sm_filesize) ? skip : mp->sm_filesize;
+			ra.ra_next = pos + run;
+			continue;
+		}
+
+		rahead_advance(mp, &ra, blocks, nblocks, pos);
+
+		// compressed chunk: only its first blocks are set
+		if (comp && pos % SFS_CZBLOCKS == 0 && !blocks[end-1]){
+			u_int32_t want = (end - pos) * SFS_BLOCKSIZE;
+
+			if (want > mp->sm_filesize)
+				want = mp->sm_filesize;
+			for (run=0; blocks[pos+run]; run++){
+				disk_read_r(mp->sm_dk, &tempdb[run * SFS_BLOCKSIZE], blocks[pos+run]);
+			}
+			memcpy(&clen, tempdb, 4);
+			if (clen > run * SFS_BLOCKSIZE - 4 ||
+			    sfs_lz_decompress(tempdb + 4, clen, zblock, sizeof(zblock)) != want){
+				error_message(mp, "cpout", local_path, -14);
+				disk_buf_put(mp->sm_dk, tempdb);
+				custom_disk_close(mp);
+				goto out;
+			}
+			run = end - pos;
+			if ((error = custom_disk_write_blocks(mp, zblock, pos, run)) != 0)
+				break;
+			ra.ra_next = pos + run;
+			continue;
+		}
+
+		// read a contiguous run at once
+		for (run=1; pos+run < end && run < RA_MAXRUN && blocks[pos+run] == blocks[pos]+run; run++)
+			;
+		disk_read_blocks_r(mp->sm_dk, tempdb, blocks[pos], run);
+		if ((error = custom_disk_write_blocks(mp, tempdb, pos, run)) != 0)
+			break;
+		ra.ra_next = pos + run;
+	}
+
+	disk_buf_put(mp->sm_dk, tempdb);
+
+	// a hole at the end still counts in the size
+	if (!error && ftruncate(mp->sm_hostfd, targeti.sfi_size) < 0)
+		error = -14;
+
+done:
+	if (custom_disk_close(mp) && !error)
+		error = -14;
+	if (error)
+		error_message(mp, "cpout", path, error);
+
+out:
+	inode_unlock(mp, cl);
+	inode_unlock(mp, pl);
+}
+
+/*
+ * Open files. A handle's table maps each fd to a struct sfs_file.
+ * Writes gather in the file's buffer, a window of FILE_BUFBLOCKS
+ * blocks. They go to the volume together when the window moves, on
+ * ftruncate and on close, and only a block written in part is read
+ * first. The inode and block map are kept between calls while the
+ * volume is unchanged: sp_gen even and the same as when they were read.
+ */
+#define FILE_MAXBLOCKS (SFS_NDIRECT + SFS_DBPERIDB)
+#define FILE_BUFBLOCKS SFS_CZBLOCKS	// a compressed chunk fits too
+
+struct sfs_file {
+	u_int32_t sf_ino;
+	int sf_flags;			// SFS_O_*
+	int sf_pos;			// where the next read or write starts
+	u_int32_t sf_gen;		// sp_gen when sf_inode and sf_map were read
+	struct sfs_inode sf_inode;
+	u_int32_t sf_map[FILE_MAXBLOCKS];	// block of each index, 0 for a hole
+	u_int32_t sf_wbase;		// first block index of the window
+	u_int32_t sf_dirty;		// window blocks written, a bit each
+	int sf_wend;			// end of the data written into the window
+	u_int32_t sf_chunk;		// compressed: chunk unpacked in sf_buf, plus 1
+	char sf_buf[FILE_BUFBLOCKS * SFS_BLOCKSIZE];
+};
+
+static u_int32_t vol_gen(struct sfs_vol *vp){
+
+	u_int32_t gen;
+
+	pthread_mutex_lock(&vp->sv_sblock);
+	gen = vp->sv_spb.sp_gen;
+	pthread_mutex_unlock(&vp->sv_sblock);
+	return gen;
+}
+
+static struct sfs_file *file_get(struct sfs_mnt *mp, int fd){
+
+	if (fd < 0 || fd >= SFS_OPEN_MAX)
+		return NULL;
+	return mp->sm_files[fd];
+}
+
+/* inode number of name in the cwd, 0 if there is none */
+static u_int32_t file_lookup(struct sfs_mnt *mp, const char *name){
+
+	struct ilock *pl;
+	struct sfs_inode ci;
+	struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
+	u_int32_t ino = 0;
+	int i, j;
+
+	pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_READ);
+	inode_read(mp, &ci, mp->sm_cwd.sfd_ino );
+
+	//for consistency
+	assert( ci.sfi_type == SFS_TYPE_DIR );
+
+	for (i=0; i<SFS_NDIRECT && ino == 0; i++){
+		if (!ci.sfi_direct[i])
+			continue;
+		disk_read_r(mp->sm_dk, cdtrb, ci.sfi_direct[i] );
+		for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+			if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, name) == 0) ){
+				ino = cdtrb[j].sfd_ino;
+				break;
+			}
+		}
+	}
+	inode_unlock(mp, pl);
+	return ino;
+}
+
+/*
+ * Have the file's inode and block map at hand; the caller holds the
+ * file locked. Returns 0, -1 if the file is gone, or -9 if it is a
+ * directory.
+ */
+static int file_load(struct sfs_mnt *mp, struct sfs_file *fp){
+
+	u_int32_t gen = vol_gen(mp->sm_vol);
+
+	if (gen % 2 == 0 && gen == fp->sf_gen)
+		return 0;
+
+	inode_read(mp, &fp->sf_inode, fp->sf_ino);
+	fp->sf_gen = 1;
+	fp->sf_chunk = 0;
+	if (fp->sf_inode.sfi_type == SFS_TYPE_DIR)
+		return -9;
+	if (fp->sf_inode.sfi_type != SFS_TYPE_FILE)
+		return -1;
+
+	bzero(fp->sf_map, sizeof(fp->sf_map));
+	if (!(fp->sf_inode.sfi_flags & SFS_IFLAG_INLINE)){
+		memcpy(fp->sf_map, fp->sf_inode.sfi_direct, sizeof(fp->sf_inode.sfi_direct));
+		if (fp->sf_inode.sfi_indirect)
+			disk_read_r(mp->sm_dk, &fp->sf_map[SFS_NDIRECT], fp->sf_inode.sfi_indirect);
+	}
+	fp->sf_gen = gen;
+	return 0;
+}
+
+/* the file's size, with what is written but not sent yet; or the load error */
+static int file_size(struct sfs_mnt *mp, struct sfs_file *fp){
+
+	struct ilock *il;
+	int size;
+
+	il = inode_lock(mp, fp->sf_ino, IL_READ);
+	size = file_load(mp, fp);
+	if (size == 0)
+		size = (fp->sf_wend > fp->sf_inode.sfi_size) ? fp->sf_wend : fp->sf_inode.sfi_size;
+	inode_unlock(mp, il);
+	return size;
+}
+
+/* compressed file: unpack chunk c into sf_buf. Returns 0, or -14. */
+static int file_chunk(struct sfs_mnt *mp, struct sfs_file *fp, u_int32_t c){
 
-						return;
+	char zblock[SFS_CZBLOCKS * SFS_BLOCKSIZE];
+	u_int32_t first = c * SFS_CZBLOCKS, end, run, clen, want, size = fp->sf_inode.sfi_size;
 
-					} else{	// if not a directory
-						error_message("rmdir", org_path, -2);
-						return;
-					}
-				}
-			}
+	if (fp->sf_chunk == c + 1)
+		return 0;
 
+	end = (size + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE;
+	if (end > first + SFS_CZBLOCKS)
+		end = first + SFS_CZBLOCKS;
+	bzero(fp->sf_buf, sizeof(fp->sf_buf));
+
+	// packed: only its first blocks are set
+	if (fp->sf_map[first] && !fp->sf_map[end-1]){
+		for (run=0; fp->sf_map[first+run]; run++){
+			disk_read_r(mp->sm_dk, &zblock[run * SFS_BLOCKSIZE], fp->sf_map[first+run]);
+		}
+		want = (end - first) * SFS_BLOCKSIZE;
+		if (want > size - first * SFS_BLOCKSIZE)
+			want = size - first * SFS_BLOCKSIZE;
+		memcpy(&clen, zblock, 4);
+		if (clen > run * SFS_BLOCKSIZE - 4 ||
+		    sfs_lz_decompress(zblock + 4, clen, fp->sf_buf, sizeof(fp->sf_buf)) != want)
+			return -14;
+	} else{
+		for (run=first; run<end; run++){
+			if (fp->sf_map[run])
+				disk_read_r(mp->sm_dk, &fp->sf_buf[(run - first) * SFS_BLOCKSIZE], fp->sf_map[run]);
 		}
 	}
+	fp->sf_chunk = c + 1;
+	return 0;
+}
 
-	// path not found
-	error_message("rmdir", org_path, -1);
-	return;
+/* block index of the file as the volume has it. Returns 0, or -14. */
+static int file_get_block(struct sfs_mnt *mp, struct sfs_file *fp, u_int32_t index, char *data){
+
+	struct sfs_inode *inode = &fp->sf_inode;
+
+	if (inode->sfi_flags & SFS_IFLAG_INLINE){
+		bzero(data, SFS_BLOCKSIZE);
+		if (index == 0)
+			memcpy(data, inode->sfi_inline, inode->sfi_size);
+		return 0;
+	}
+	if (inode->sfi_flags & SFS_IFLAG_COMP){
+		if (file_chunk(mp, fp, index / SFS_CZBLOCKS))
+			return -14;
+		memcpy(data, &fp->sf_buf[(index % SFS_CZBLOCKS) * SFS_BLOCKSIZE], SFS_BLOCKSIZE);
+		return 0;
+	}
+	if (fp->sf_map[index])
+		disk_read_r(mp->sm_dk, data, fp->sf_map[index]);
+	else
+		bzero(data, SFS_BLOCKSIZE);
+	return 0;
+}
+
+/* what the file has in block index, for a write to part of it */
+static int file_fill(struct sfs_mnt *mp, struct sfs_file *fp, u_int32_t index, char *data){
+
+	struct ilock *il;
+	int error, off;
+
+	il = inode_lock(mp, fp->sf_ino, IL_READ);
+	error = file_load(mp, fp);
+	if (!error)
+		error = file_get_block(mp, fp, index, data);
+	if (!error){
+		// past the end reads as zeros, whatever the block holds
+		off = fp->sf_inode.sfi_size - index * SFS_BLOCKSIZE;
+		if (off < 0)
+			off = 0;
+		if (off < SFS_BLOCKSIZE)
+			bzero(data + off, SFS_BLOCKSIZE - off);
+	}
+	inode_unlock(mp, il);
+	return error;
+}
+
+/* send the window to the volume. Returns 0, or -1, -4, -8 or -15. */
+static int file_flush(struct sfs_mnt *mp, struct sfs_file *fp){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	struct sfs_inode inode;
+	struct ilock *il;
+	u_int32_t i, index, oldn, hits = 0, nres = 0;
+	int size, error = 0;
+
+	if (!fp->sf_dirty)
+		return 0;
+	if (write_begin(mp)){
+		fp->sf_dirty = 0;
+		return -15;
+	}
+	il = inode_lock(mp, fp->sf_ino, IL_WRITE);
+	inode_read(mp, &inode, fp->sf_ino);
+	if (inode.sfi_type != SFS_TYPE_FILE){
+		error = -1;
+		goto out;
+	}
+	if (inode.sfi_flags & SFS_IFLAG_COMP){	// made so since it was opened
+		error = -8;
+		goto out;
+	}
+	size = (fp->sf_wend > inode.sfi_size) ? fp->sf_wend : inode.sfi_size;
+
+	/* tiny file: stays in, or goes into, the inode */
+	if (size <= vp->sv_inlinemax && fp->sf_wbase == 0 && !inode.sfi_direct[0] && !inode.sfi_indirect){
+		bzero(inode.sfi_inline, SFS_INLINESIZE);
+		memcpy(inode.sfi_inline, fp->sf_buf, size);
+		inode.sfi_flags |= SFS_IFLAG_INLINE;
+		inode.sfi_size = size;
+		inode_write(mp, &inode, fp->sf_ino);
+		goto out;
+	}
+
+	// a block for each, and a copy of a shared indirect block
+	nres = __builtin_popcount(fp->sf_dirty) + 2;
+	if (reserve_blocks(mp, nres)){
+		nres = 0;
+		error = -4;
+		goto out;
+	}
+	if (spill_inline(mp, &inode, fp->sf_ino)){
+		error = -4;
+		goto out;
+	}
 
+	oldn = (inode.sfi_size + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE;
+	for (i=0; i<FILE_BUFBLOCKS; i++){
+		if (!(fp->sf_dirty & (1U << i)))
+			continue;
+		index = fp->sf_wbase + i;
+		if (index > oldn)	// data after a hole, which fsck can't see
+			sb_setfeature(vp, SFS_FEAT_SPARSE);
+		if (file_put_block(mp, &inode, index, &fp->sf_buf[i * SFS_BLOCKSIZE], &hits) < 0){
+			// what got there still counts
+			error = -4;
+			if (size > (int)(index * SFS_BLOCKSIZE))
+				size = index * SFS_BLOCKSIZE;
+			if (size < inode.sfi_size)
+				size = inode.sfi_size;
+			break;
+		}
+	}
+	inode.sfi_size = size;
+	inode_write(mp, &inode, fp->sf_ino);
+
+out:
+	unreserve_blocks(mp, nres);
+	sb_sync(vp);
+	inode_unlock(mp, il);
+	write_end(mp);
+	fp->sf_dirty = 0;
+	fp->sf_wend = 0;
+	return error;
 }
 
-void sfs_mv(const char* src_name, const char* dst_name) 
+int sfs_open_r(struct sfs_mnt *mp, const char *path, int flags)
 {
+	struct sfs_file *fp;
+	struct ilock *il;
+	u_int32_t ino;
+	int fd, error, acc = flags & SFS_O_ACCMODE;
+
+	if (mp->sm_cwd.sfd_ino == SFS_NOINO || acc == SFS_O_ACCMODE)
+		return -8;
+	for (fd=0; fd<SFS_OPEN_MAX && mp->sm_files[fd] != NULL; fd++)
+		;
+	if (fd == SFS_OPEN_MAX)
+		return -17;
+
+	vol_refresh(mp);
+	ino = file_lookup(mp, path);
+	if (!ino && (flags & SFS_O_CREAT)){
+		if (mp->sm_vol->sv_rdonly)
+			return -15;
+		dir_create(mp, "open", (char *const *)&path, 1, SFS_TYPE_FILE);	// says why if it can't
+		ino = file_lookup(mp, path);
+	}
+	if (!ino)
+		return -1;
+
+	fp = calloc(1, sizeof(struct sfs_file));
+	if (fp == NULL)
+		err(1, "malloc");
+	fp->sf_ino = ino;
+	fp->sf_flags = flags;
+	fp->sf_gen = 1;
+
+	il = inode_lock(mp, ino, IL_READ);
+	error = file_load(mp, fp);
+	if (!error && acc != SFS_O_RDONLY){
+		if (mp->sm_vol->sv_rdonly)
+			error = -15;
+		else if (fp->sf_inode.sfi_flags & SFS_IFLAG_COMP)
+			error = -8;	// compressed files are read only
+	}
+	inode_unlock(mp, il);
+	if (error){
+		free(fp);
+		return error;
+	}
+	mp->sm_files[fd] = fp;
 
-	int srcfound=0, dstfound=0;
+	if ((flags & SFS_O_TRUNC) && acc != SFS_O_RDONLY && (error = sfs_ftruncate_r(mp, fd, 0))){
+		sfs_close_r(mp, fd);
+		return error;
+	}
+	return fd;
+}
 
-	struct sfs_dir *modified_drtblock;
-	u_int32_t origin_drtblock_no;
+int sfs_read_r(struct sfs_mnt *mp, int fd, void *buf, int n)
+{
+	struct sfs_file *fp = file_get(mp, fd);
+	char block[SFS_BLOCKSIZE], *cbuf = buf;
+	struct ilock *il;
+	u_int32_t index;
+	int size, off, len, done = 0, error;
+
+	if (fp == NULL || n < 0 || (fp->sf_flags & SFS_O_ACCMODE) == SFS_O_WRONLY)
+		return -8;
+
+	vol_refresh(mp);
+	il = inode_lock(mp, fp->sf_ino, IL_READ);
+	if ((error = file_load(mp, fp)))
+		goto out;
+	size = (fp->sf_wend > fp->sf_inode.sfi_size) ? fp->sf_wend : fp->sf_inode.sfi_size;
+
+	while (done < n && fp->sf_pos < size){
+		index = fp->sf_pos / SFS_BLOCKSIZE;
+		off = fp->sf_pos % SFS_BLOCKSIZE;
+		len = SFS_BLOCKSIZE - off;
+		if (len > n - done)
+			len = n - done;
+		if (len > size - fp->sf_pos)
+			len = size - fp->sf_pos;
+
+		// written here but not sent yet
+		if (index >= fp->sf_wbase && index < fp->sf_wbase + FILE_BUFBLOCKS &&
+		    (fp->sf_dirty & (1U << (index - fp->sf_wbase))))
+			memcpy(cbuf + done, &fp->sf_buf[(index - fp->sf_wbase) * SFS_BLOCKSIZE + off], len);
+		else if (len == SFS_BLOCKSIZE){
+			if ((error = file_get_block(mp, fp, index, cbuf + done)))
+				break;
+		} else{
+			if ((error = file_get_block(mp, fp, index, block)))
+				break;
+			memcpy(cbuf + done, block + off, len);
+		}
+		done += len;
+		fp->sf_pos += len;
+	}
 
-	// get cwd's inode
-	struct sfs_inode ci;
-	disk_read( &ci, sd_cwd.sfd_ino );
+out:
+	inode_unlock(mp, il);
+	return (done || !error) ? done : error;
+}
 
-	//for consistency
-	assert( ci.sfi_type == SFS_TYPE_DIR );
+int sfs_write_r(struct sfs_mnt *mp, int fd, const void *buf, int n)
+{
+	struct sfs_file *fp = file_get(mp, fd);
+	const char *cbuf = buf;
+	char *bp;
+	u_int32_t index, slot;
+	int off, len, done = 0, error = 0;
+
+	if (fp == NULL || n < 0 || (fp->sf_flags & SFS_O_ACCMODE) == SFS_O_RDONLY)
+		return -8;
+	if (fp->sf_flags & SFS_O_APPEND){
+		if ((error = file_size(mp, fp)) < 0)
+			return error;
+		fp->sf_pos = error;
+		error = 0;
+	}
 
-	// check invalid
-	if (!strcmp(src_name, ".") || !strcmp(dst_name, ".") ){
-		error_message("mv", ".", -8);
+	while (done < n){
+		if (fp->sf_pos >= SFS_MAXFILESIZE){
+			error = -11;
+			break;
+		}
+		index = fp->sf_pos / SFS_BLOCKSIZE;
+		off = fp->sf_pos % SFS_BLOCKSIZE;
+		len = SFS_BLOCKSIZE - off;
+		if (len > n - done)
+			len = n - done;
+
+		// out of the window: send it and start one here
+		if (index < fp->sf_wbase || index >= fp->sf_wbase + FILE_BUFBLOCKS){
+			if ((error = file_flush(mp, fp)))
+				break;
+			fp->sf_wbase = index;
+		}
+		slot = index - fp->sf_wbase;
+		bp = &fp->sf_buf[slot * SFS_BLOCKSIZE];
+
+		// only a block written in part needs what is there
+		if (!(fp->sf_dirty & (1U << slot)) && len < SFS_BLOCKSIZE){
+			if ((error = file_fill(mp, fp, index, bp)))
+				break;
+		}
+		memcpy(bp + off, cbuf + done, len);
+		fp->sf_dirty |= 1U << slot;
+		done += len;
+		fp->sf_pos += len;
+		if (fp->sf_pos > fp->sf_wend)
+			fp->sf_wend = fp->sf_pos;
+	}
+	return (done || !error) ? done : error;
+}
+
+int sfs_lseek_r(struct sfs_mnt *mp, int fd, int offset, int whence)
+{
+	struct sfs_file *fp = file_get(mp, fd);
+	int base;
+
+	if (fp == NULL)
+		return -8;
+	switch (whence){
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = fp->sf_pos;
+		break;
+	case SEEK_END:
+		if ((base = file_size(mp, fp)) < 0)
+			return base;
+		break;
+	default:
+		return -8;
+	}
+	if (offset < -base)
+		return -8;
+	if (offset > SFS_MAXFILESIZE - base)
+		return -11;
+	fp->sf_pos = base + offset;
+	return fp->sf_pos;
+}
+
+int sfs_ftruncate_r(struct sfs_mnt *mp, int fd, int length)
+{
+	struct sfs_file *fp = file_get(mp, fd);
+	struct sfs_vol *vp = mp->sm_vol;
+	struct sfs_inode inode;
+	struct ilock *il;
+	char block[SFS_BLOCKSIZE];
+	u_int32_t blockno, nres = 2;
+	int off, error;
+
+	if (fp == NULL || length < 0 || (fp->sf_flags & SFS_O_ACCMODE) == SFS_O_RDONLY)
+		return -8;
+	if (length > SFS_MAXFILESIZE)
+		return -11;
+	if ((error = file_flush(mp, fp)))
+		return error;
+
+	if (write_begin(mp))
+		return -15;
+	il = inode_lock(mp, fp->sf_ino, IL_WRITE);
+	inode_read(mp, &inode, fp->sf_ino);
+	if (inode.sfi_type != SFS_TYPE_FILE){
+		error = -1;
+		nres = 0;
+		goto out;
+	}
+	if (inode.sfi_flags & SFS_IFLAG_COMP){
+		error = -8;
+		nres = 0;
+		goto out;
+	}
+	if (reserve_blocks(mp, nres)){
+		error = -4;
+		nres = 0;
+		goto out;
+	}
+
+	if (inode.sfi_flags & SFS_IFLAG_INLINE){
+		if (length <= vp->sv_inlinemax){
+			if (length < inode.sfi_size)
+				bzero(&inode.sfi_inline[length], SFS_INLINESIZE - length);
+			if (length == 0)
+				inode.sfi_flags &= ~SFS_IFLAG_INLINE;
+			goto done;
+		}
+		if (spill_inline(mp, &inode, fp->sf_ino)){
+			error = -4;
+			goto out;
+		}
+	}
+
+	if (length < inode.sfi_size){
+		if (file_truncate(mp, &inode, (length + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE)){
+			error = -4;
+			goto out;
+		}
+		// the rest of the last block reads as zeros if the file grows again
+		off = length % SFS_BLOCKSIZE;
+		if (off){
+			if (file_block_cow(mp, &inode, length / SFS_BLOCKSIZE, &blockno)){
+				error = -4;
+				goto out;
+			}
+			if (blockno){
+				disk_read_r(mp->sm_dk, block, blockno);
+				bzero(block + off, SFS_BLOCKSIZE - off);
+				disk_write_r(mp->sm_dk, block, blockno);
+				if (vp->sv_dedup)
+					dedup_add(mp, blockno, block_hash(block));
+			}
+		}
+	} else if ((length + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE > (inode.sfi_size + SFS_BLOCKSIZE - 1) / SFS_BLOCKSIZE)
+		sb_setfeature(vp, SFS_FEAT_SPARSE);	// a hole up to the new end
+
+done:
+	inode.sfi_size = length;
+	inode_write(mp, &inode, fp->sf_ino);
+out:
+	unreserve_blocks(mp, nres);
+	sb_sync(vp);
+	inode_unlock(mp, il);
+	write_end(mp);
+	return error;
+}
+
+int sfs_close_r(struct sfs_mnt *mp, int fd)
+{
+	struct sfs_file *fp = file_get(mp, fd);
+	int error;
+
+	if (fp == NULL)
+		return -8;
+	error = file_flush(mp, fp);
+	mp->sm_files[fd] = NULL;
+	free(fp);
+	return error;
+}
+
+void sfs_cat_r(struct sfs_mnt *mp, const char* path)
+{
+	char buf[SFS_BLOCKSIZE];
+	int fd, n;
+
+	if ((fd = sfs_open_r(mp, path, SFS_O_RDONLY)) < 0){
+		error_message(mp, "cat", path, fd);
 		return;
 	}
-	if ( !strcmp(src_name, "..") || !strcmp(dst_name, "..") ){
-		error_message("mv", "..", -8);
+	while ((n = sfs_read_r(mp, fd, buf, sizeof(buf))) > 0){
+		fwrite(buf, 1, n, mp->sm_out);
+	}
+	if (n < 0)
+		error_message(mp, "cat", path, n);
+	sfs_close_r(mp, fd);
+}
+
+void sfs_append_r(struct sfs_mnt *mp, const char* path, const char *text)
+{
+	int fd, error;
+
+	if ((fd = sfs_open_r(mp, path, SFS_O_WRONLY | SFS_O_CREAT | SFS_O_APPEND)) < 0){
+		error_message(mp, "append", path, fd);
 		return;
 	}
+	error = sfs_write_r(mp, fd, text, strlen(text));
+	if (error >= 0)
+		error = sfs_write_r(mp, fd, "\n", 1);
+	if (error >= 0)
+		error = sfs_close_r(mp, fd);
+	else
+		sfs_close_r(mp, fd);
+	if (error < 0)
+		error_message(mp, "append", path, error);
+}
 
-	// find src_name
-	// cwd inode direct ptr loop
-	int i;
-	struct sfs_dir *tmpdtre;
-	for (i=0; i<SFS_NDIRECT; i++){
-		if (srcfound && dstfound)	// for lower stress
-			break;
+void sfs_truncate_r(struct sfs_mnt *mp, const char* path, int length)
+{
+	int fd, error;
 
-		// if direct ptr in use,
-		if (ci.sfi_direct[i]){
-			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
-			disk_read( cdtrb, ci.sfi_direct[i] );
+	if ((fd = sfs_open_r(mp, path, SFS_O_WRONLY)) < 0){
+		error_message(mp, "truncate", path, fd);
+		return;
+	}
+	error = sfs_ftruncate_r(mp, fd, length);
+	sfs_close_r(mp, fd);
+	if (error < 0)
+		error_message(mp, "truncate", path, error);
+}
 
-			// cwd directory entry loop
-			int j;
-			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
-				if (srcfound && dstfound)	// for lower stress
-					break;
+void sfs_df_r(struct sfs_mnt *mp) {
+	struct sfs_vol *vp = mp->sm_vol;
+	u_int32_t nfree;
 
-				// if directory entry in use
-				if (cdtrb[j].sfd_ino != SFS_NOINO){
-					// srcname found
-					if ( !srcfound && (strcmp(cdtrb[j].sfd_name, src_name) == 0) ){
-						srcfound = 1;
-						tmpdtre = &cdtrb[j];
-						modified_drtblock = cdtrb;
-						origin_drtblock_no = ci.sfi_direct[i];
-					}
-					// dstname found
-					if ( !dstfound && (strcmp(cdtrb[j].sfd_name, dst_name) == 0) ){
-						dstfound = 1;
-					}
-				}
+	vol_refresh(mp);
+	nfree = __atomic_load_n(&vp->sv_spb.sp_nfree, __ATOMIC_RELAXED);
 
-			}
+	fprintf(mp->sm_out, "Volume name: %s\n", vp->sv_spb.sp_volname);
+	fprintf(mp->sm_out, "Number of blocks: %u\n", vp->sv_spb.sp_nblocks);
+	fprintf(mp->sm_out, "Used blocks: %u\n", vp->sv_spb.sp_nblocks - nfree);
+	fprintf(mp->sm_out, "Free blocks: %u (%llu bytes)\n", nfree, (unsigned long long)nfree * SFS_BLOCKSIZE);
+}
+
+/*
+ * With policy, choose when writes are synced to the host's disk:
+ * "none", "cmd" after each command, or "ms[,blocks]" every ms
+ * milliseconds or once that many blocks wait, whichever is first.
+ * Without, sync now and show how it went.
+ */
+void sfs_sync_r(struct sfs_mnt *mp, const char *policy) {
+	struct sfs_vol *vp = mp->sm_vol;
+	struct disk_syncstat st;
+	u_int32_t interval, maxdirty = 0;
+	char *end;
+
+	if (vp == NULL)
+		return;	// not mounted
+	if (policy == NULL){
+		if (!vp->sv_rdonly)
+			sb_sync(vp);
+		disk_sync_r(mp->sm_dk);
+		disk_sync_stat(mp->sm_dk, &st);
+		if (st.ds_policy == DISK_SYNC_NONE)
+			fprintf(mp->sm_out, "Sync: when asked\n");
+		else if (st.ds_policy == DISK_SYNC_CMD)
+			fprintf(mp->sm_out, "Sync: after each command\n");
+		else if (st.ds_maxdirty == 0)
+			fprintf(mp->sm_out, "Sync: every %u ms\n", st.ds_interval);
+		else if (st.ds_interval == 0)
+			fprintf(mp->sm_out, "Sync: every %u blocks\n", st.ds_maxdirty);
+		else
+			fprintf(mp->sm_out, "Sync: every %u ms or %u blocks\n", st.ds_interval, st.ds_maxdirty);
+		fprintf(mp->sm_out, "Synced: %llu times, %llu blocks (%.1f per sync)\n",
+			(unsigned long long)st.ds_syncs, (unsigned long long)st.ds_blocks,
+			st.ds_syncs ? (double)st.ds_blocks / st.ds_syncs : 0.0);
+		return;
+	}
+
+	if (vp->sv_rdonly){
+		error_message(mp, "sync", policy, -15);
+		return;
+	}
+	if (!strcmp(policy, "none")){
+		disk_sync_policy(mp->sm_dk, DISK_SYNC_NONE, 0, 0);
+		return;
+	}
+	if (!strcmp(policy, "cmd")){
+		disk_sync_policy(mp->sm_dk, DISK_SYNC_CMD, 0, 0);
+		return;
+	}
+	interval = strtoul(policy, &end, 10);
+	if (*end == ',')
+		maxdirty = strtoul(end + 1, &end, 10);
+	if (end == policy || *end != '\0' || (interval == 0 && maxdirty == 0)){
+		error_message(mp, "sync", policy, -8);
+		return;
+	}
+	disk_sync_policy(mp->sm_dk, DISK_SYNC_GROUP, interval, maxdirty);
+}
+
+/*
+ * Make a new empty file system in the host file path.
+ * The classic layout is superblock, root inode, bitmap, root directory.
+ * SFS_MKFS_PACKED keeps inodes SFS_PINODESIZE bytes each in a table
+ * after the bitmap instead of one per block (block 1 is left unused).
+ * SFS_MKFS_CSUM adds a table with a checksum for every block.
+ */
+void sfs_mkfs_r(struct sfs_mnt *mp, const char *path, unsigned long long count, const char *volname, int flags)
+{
+	struct disk dk = { .dk_fd = -1 };
+	struct sfs_vol *vp;
+	struct sfs_super spb;
+	struct sfs_inode rooti;
+	struct sfs_dir rootd[SFS_DENTRYPERBLOCK];
+	char block[SFS_BLOCKSIZE];
+	u_int8_t *bitmap;
+	u_int32_t nblocks = count, nbitblocks, nitblocks = 0, itable = 0, ncsblocks = 0, csum = 0, rootdir, i, j;
+	u_int64_t end;
+	struct stat st;
+	int fd;
+
+	if (count > SFS_MAXBLOCKS){
+		error_message(mp, "mkfs", path, -8);
+		return;
+	}
 
+	// don't pull the image out from under a mount
+	if (stat(path, &st) == 0){
+		pthread_mutex_lock(&vol_lock);
+		for (vp = vol_list; vp != NULL; vp = vp->sv_next){
+			if (vp->sv_dev == st.st_dev && vp->sv_ino == st.st_ino)
+				break;
+		}
+		pthread_mutex_unlock(&vol_lock);
+		if (vp != NULL){
+			error_message(mp, "mkfs", path, -13);
+			return;
 		}
 	}
 
-	if (!srcfound) {
-		error_message("mv", src_name, -1);
+	nbitblocks = SFS_BITBLOCKS(nblocks);
+	rootdir = SFS_MAP_LOCATION + nbitblocks;
+	if (flags & SFS_MKFS_PACKED){
+		itable = rootdir;
+		nitblocks = (nblocks/4 + SFS_PINODEPERBLOCK - 1) / SFS_PINODEPERBLOCK;
+		if (nitblocks == 0)
+			nitblocks = 1;
+		rootdir = itable + nitblocks;
+	}
+	if (flags & SFS_MKFS_CSUM){
+		csum = rootdir;
+		ncsblocks = nblocks / (SFS_BLOCKSIZE/4) + (nblocks % (SFS_BLOCKSIZE/4) != 0);
+		rootdir = csum + ncsblocks;
+	}
+	if (nblocks <= rootdir + 1){	// not even room for one file
+		error_message(mp, "mkfs", path, -8);
 		return;
 	}
-	if (dstfound) {
-		error_message("mv", dst_name, -6);
+
+	// nor from under another process using it: lock it, then empty it
+	fd = open(path, O_RDWR|O_CREAT, 0644);
+	if (fd < 0){
+		error_message(mp, "mkfs", path, -12);
+		return;
+	}
+	close(fd);
+	if (disk_open_flags_r(&dk, path, 0)){
+		error_message(mp, "mkfs", path, -13);
+		return;
+	}
+	if (disk_shared_r(&dk)){	// a reader holds only its read lock
+		error_message(mp, "mkfs", path, -13);
+		disk_close_r(&dk);
+		return;
+	}
+	if (ftruncate(dk.dk_fd, 0) < 0 || ftruncate(dk.dk_fd, (off_t)nblocks * SFS_BLOCKSIZE) < 0){
+		error_message(mp, "mkfs", path, -12);
+		disk_close_r(&dk);
 		return;
 	}
+	if (flags & SFS_MKFS_CSUM)	// before anything is written
+		disk_csum_create(&dk, csum, ncsblocks, nblocks);
+
+	// superblock
+	bzero(&spb, sizeof(spb));
+	spb.sp_magic = SFS_MAGIC;
+	spb.sp_nblocks = nblocks;
+	strncpy(spb.sp_volname, volname ? volname : "SFS", SFS_VOLNAME_SIZE - 1);
+	spb.sp_features = SFS_FEAT_NFREE;
+	spb.sp_nfree = nblocks - (rootdir + 1);
+	if (flags & SFS_MKFS_PACKED){
+		spb.sp_features |= SFS_FEAT_ITABLE;
+		spb.sp_itable = itable;
+		spb.sp_ninodes = nitblocks * SFS_PINODEPERBLOCK;
+	}
+	if (flags & SFS_MKFS_CSUM){
+		spb.sp_features |= SFS_FEAT_CSUM;
+		spb.sp_csum = csum;
+		spb.sp_csumblocks = ncsblocks;
+	}
+	disk_write_r(&dk, &spb, SFS_SB_LOCATION);
+
+	// bitmap: everything up to the root directory, and the bits past the end
+	bitmap = (u_int8_t*)malloc(nbitblocks * SFS_BLOCKSIZE);
+	if (bitmap == NULL)
+		err(1, "malloc");
+	bzero(bitmap, nbitblocks * SFS_BLOCKSIZE);
+	for (i=0; i<=rootdir; i++){
+		BIT_SET(bitmap[i/8], i%8);
+	}
+	for (end=nblocks; end<(u_int64_t)nbitblocks*SFS_BLOCKBITS; end++){
+		BIT_SET(bitmap[end/8], end%8);
+	}
+	// the image is all zeros already: only blocks with bits set
+	for (i=0; i<nbitblocks; i++){
+		for (j=0; j<SFS_BLOCKSIZE && !bitmap[i*SFS_BLOCKSIZE + j]; j++)
+			;
+		if (j < SFS_BLOCKSIZE)
+			disk_write_r(&dk, &bitmap[i*SFS_BLOCKSIZE], SFS_MAP_LOCATION+i);
+	}
+	free(bitmap);
+
+	// root directory
+	bzero(&rooti, sizeof(rooti));
+	rooti.sfi_size = sizeof(struct sfs_dir) * 2;
+	rooti.sfi_type = SFS_TYPE_DIR;
+	rooti.sfi_direct[0] = rootdir;
+
+	bzero(rootd, SFS_BLOCKSIZE);
+	rootd[0].sfd_ino = SFS_ROOT_LOCATION;
+	strncpy(rootd[0].sfd_name, ".", SFS_NAMELEN);
+	rootd[1].sfd_ino = SFS_ROOT_LOCATION;
+	strncpy(rootd[1].sfd_name, "..", SFS_NAMELEN);
+	disk_write_r(&dk, rootd, rootdir);
+
+	if (flags & SFS_MKFS_PACKED){
+		bzero(block, SFS_BLOCKSIZE);	// the rest of the table is zeros already
+		memcpy(&block[SFS_ROOT_LOCATION * SFS_PINODESIZE], &rooti, SFS_PINODESIZE);
+		disk_write_r(&dk, block, itable);
+	} else {
+		disk_write_r(&dk, &rooti, SFS_ROOT_LOCATION);
+	}
 
-	// able to change the name
-	bzero(tmpdtre->sfd_name, SFS_NAMELEN);
-	strncpy(tmpdtre->sfd_name, dst_name, SFS_NAMELEN);
+	disk_close_r(&dk);
 
-	// write modified block on disk
-	disk_write(modified_drtblock, origin_drtblock_no);
-	return;
+	fprintf(mp->sm_out, "%s: %u blocks, %u free", spb.sp_volname, nblocks, spb.sp_nfree);
+	if (flags & SFS_MKFS_PACKED)
+		fprintf(mp->sm_out, ", %u inodes", spb.sp_ninodes);
+	fprintf(mp->sm_out, "\n");
 }
 
-void sfs_rm(const char* path) 
-{
-	// get cwd's inode
-	struct sfs_inode ci;
-	disk_read( &ci, sd_cwd.sfd_ino );
+/*
+ * dedup on: share blocks cpin finds already on the volume (makes the
+ * table the first time). dedup off: stop looking, for this mount.
+ * Shared blocks keep their counts either way. Without an argument,
+ * show what sharing saves and what cpin has done since mount.
+ */
+void sfs_dedup_r(struct sfs_mnt *mp, const char *arg) {
+	struct sfs_vol *vp = mp->sm_vol;
+	struct sfs_ddent ent[SFS_DDPERBLOCK];
+	u_int64_t stored = 0, refs = 0;
+	u_int32_t i, j;
+
+	if (arg != NULL && vp->sv_rdonly){
+		error_message(mp, "dedup", arg, -15);
+		return;
+	}
 
-	//for consistency
-	assert( ci.sfi_type == SFS_TYPE_DIR );
+	pthread_mutex_lock(&vp->sv_ddlock);
+	if (arg != NULL && !strcmp(arg, "on")){
+		if (vp->sv_ddpage == NULL && ddt_create(mp)){
+			error_message(mp, "dedup", vp->sv_spb.sp_volname, -4);
+			goto out;
+		}
+		if (vp->sv_ddidx == NULL){
+			error_message(mp, "dedup", vp->sv_spb.sp_volname, -19);
+			goto out;
+		}
+		vp->sv_dedup = 1;
+		goto out;
+	}
+	if (arg != NULL && !strcmp(arg, "off")){
+		vp->sv_dedup = 0;
+		goto out;
+	}
+	if (arg != NULL){
+		error_message(mp, "dedup", arg, -8);
+		goto out;
+	}
 
-	// find path
-	// cwd inode direct ptr loop
+	fprintf(mp->sm_out, "Dedup: %s\n", vp->sv_dedup ? "on" : "off");
+	if (vp->sv_ddpage != NULL){
+		// nothing is dirty while sv_ddlock is free, the disk has it all
+		for (i=0; i<vp->sv_spb.sp_ddtblocks; i++){
+			disk_read_r(&vp->sv_disk, ent, vp->sv_spb.sp_ddt + i);
+			for (j=0; j<SFS_DDPERBLOCK; j++){
+				if (ent[j].dd_refs){
+					stored++;
+					refs += ent[j].dd_refs;
+				}
+			}
+		}
+		fprintf(mp->sm_out, "Data blocks: %llu referenced, %llu stored (ratio %.2f)\n",
+			(unsigned long long)refs, (unsigned long long)stored, stored ? (double)refs / stored : 1.0);
+		fprintf(mp->sm_out, "Saved: %llu blocks (%llu bytes)\n",
+			(unsigned long long)(refs - stored), (unsigned long long)(refs - stored) * SFS_BLOCKSIZE);
+	}
+	fprintf(mp->sm_out, "Imported: %llu bytes in %.3f s (%.1f MB/s), %llu of %llu blocks shared\n",
+		(unsigned long long)vp->sv_impbytes, vp->sv_impsecs,
+		vp->sv_impsecs > 0 ? vp->sv_impbytes / vp->sv_impsecs / 1e6 : 0.0,
+		(unsigned long long)vp->sv_imphits, (unsigned long long)vp->sv_impblocks);
+out:
+	pthread_mutex_unlock(&vp->sv_ddlock);
+	if (arg != NULL)
+		disk_commit_r(mp->sm_dk);
+}
+
+/* the snapshot table, made by the first snapshot */
+static int snap_table_create(struct sfs_mnt *mp){
+
+	struct sfs_vol *vp = mp->sm_vol;
+	u_int32_t blockno;
+
+	if (reserve_blocks(mp, 1))
+		return -4;
+	blockno = take_free_block(mp);
+	unreserve_blocks(mp, 1);
+	if (!blockno)
+		return -4;
+
+	bzero(vp->sv_snaptab, SFS_BLOCKSIZE);
+	pthread_mutex_lock(&vp->sv_sblock);
+	vp->sv_spb.sp_snap = blockno;
+	vp->sv_spb.sp_features |= SFS_FEAT_SNAP;
+	vp->sv_sbdirty = 1;
+	pthread_mutex_unlock(&vp->sv_sblock);
+	snap_table_write(vp);
+	sb_sync(vp);
+	return 0;
+}
+
+/*
+ * Take a snapshot called name. Only the superblock is copied now; the
+ * rest is kept as it is overwritten, so this costs the same on any
+ * volume. Changes in flight finish first.
+ */
+void sfs_mksnap_r(struct sfs_mnt *mp, const char *name) {
+	struct sfs_vol *vp = mp->sm_vol;
+	struct sfs_snap *ss;
+	u_int32_t seq = 0;
+	int slot, i;
+
+	if (vp->sv_rdonly){
+		error_message(mp, "mksnap", name, -15);
+		return;
+	}
+	if (name[0] == '\0' || strlen(name) >= SFS_SNAPNAMELEN){
+		error_message(mp, "mksnap", name, -8);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&vp->sv_snaplock);
+	if (!(vp->sv_spb.sp_features & SFS_FEAT_SNAP) && snap_table_create(mp)){
+		error_message(mp, "mksnap", name, -4);
+		goto out;
+	}
+	if (vp->sv_fresh == NULL)
+		fresh_alloc(vp);
+	sb_sync(vp);	// the copy taken below is the volume as it is now
+
+	pthread_mutex_lock(&vp->sv_snmtx);
+	if (snap_lookup(vp, name) >= 0){
+		pthread_mutex_unlock(&vp->sv_snmtx);
+		error_message(mp, "mksnap", name, -6);
+		goto out;
+	}
+	for (slot=0; slot<SFS_MAXSNAP && vp->sv_snaptab[slot].ss_name[0] != '\0'; slot++)
+		;
+	if (slot == SFS_MAXSNAP){
+		pthread_mutex_unlock(&vp->sv_snmtx);
+		error_message(mp, "mksnap", name, -16);
+		goto out;
+	}
+	for (i=0; i<vp->sv_nsnap; i++){
+		if (vp->sv_snaptab[vp->sv_order[i]].ss_seq > seq)
+			seq = vp->sv_snaptab[vp->sv_order[i]].ss_seq;
+	}
+
+	ss = &vp->sv_snaptab[slot];
+	bzero(ss, sizeof(struct sfs_snap));
+	strcpy(ss->ss_name, name);
+	ss->ss_seq = seq + 1;
+	ss->ss_time = time(NULL);
+	snap_sort(vp);
+	vp->sv_epoch++;		// nothing is fresh for it
+	snap_keep(vp, SFS_SB_LOCATION);
+	snap_table_write(vp);
+	pthread_mutex_unlock(&vp->sv_snmtx);
+out:
+	pthread_rwlock_unlock(&vp->sv_snaplock);
+	disk_commit_r(mp->sm_dk);
+}
+
+void sfs_lssnap_r(struct sfs_mnt *mp) {
+	struct sfs_vol *vp = mp->sm_vol->sv_base ? mp->sm_vol->sv_base : mp->sm_vol;
+	struct sfs_snap *ss;
+	char when[32];
+	time_t t;
 	int i;
-	for (i=0; i<SFS_NDIRECT; i++){
-		// if direct ptr in use,
-		if (ci.sfi_direct[i]){
-			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
-			disk_read( cdtrb, ci.sfi_direct[i] );
 
-			// cwd directory entry loop
-			int j;
-			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
-				// if directory entry in use, and path found
-				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, path) == 0) ){
-					struct sfs_inode pathi;
-					disk_read( &pathi, cdtrb[j].sfd_ino );
-
-					// if file
-					int tmpchinum;
-					if (pathi.sfi_type == SFS_TYPE_FILE){
-						// clear loaded bitmap
-						bzero(BITMAP, bm_size);
-						// load bitmap
-						int k;
-						for (k=0; k<SFS_BITBLOCKS(spb.sp_nblocks); k++){
-							disk_read( &BITMAP[k*SFS_BLOCKSIZE], k+2);
-						}
-						
-						/* directory entry i-node number release */
-						tmpchinum = cdtrb[j].sfd_ino;
-						cdtrb[j].sfd_ino = SFS_NOINO;
-						disk_write(cdtrb, ci.sfi_direct[i]);
+	pthread_mutex_lock(&vp->sv_snmtx);
+	for (i=0; i<vp->sv_nsnap; i++){
+		ss = &vp->sv_snaptab[vp->sv_order[i]];
+		t = ss->ss_time;
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		fprintf(mp->sm_out, "%-20s %s %8u blocks kept%s\n", ss->ss_name, when, ss->ss_nkept,
+			snap_lost(vp, vp->sv_order[i]) ? " (lost)" : "");
+	}
+	pthread_mutex_unlock(&vp->sv_snmtx);
+}
 
-						ci.sfi_size -= sizeof(struct sfs_dir);	// decrease parent size info
-						disk_write(&ci, sd_cwd.sfd_ino);
+/*
+ * Delete a snapshot. Blocks it kept that the next older snapshot reads
+ * through it go to that one; the rest are freed with its log.
+ */
+void sfs_rmsnap_r(struct sfs_mnt *mp, const char *name) {
+	struct sfs_vol *vp = mp->sm_vol, *v;
+	struct sfs_snap *ss;
+	struct snap *sn, *on = NULL;
+	struct sfs_snaplog lb;
+	u_int32_t h, blockno;
+	int slot, older = -1, i;
+
+	if (vp->sv_rdonly){
+		error_message(mp, "rmsnap", name, -15);
+		return;
+	}
 
-						/* datablock pointed by direct_ptr release */
-						for (k=0; k<SFS_NDIRECT; k++){
-							if (pathi.sfi_direct[k]){
-								// clear the datablock
-								char tempdb[SFS_BLOCKSIZE];
-								disk_read(tempdb, pathi.sfi_direct[k]);
-								bzero(tempdb, SFS_BLOCKSIZE);
-								disk_write(tempdb, pathi.sfi_direct[k]);
-								// update bitmap
-								release_block(pathi.sfi_direct[k]);
-							}
-						}
+	pthread_mutex_lock(&vol_lock);	// no one mounts it meanwhile
+	pthread_mutex_lock(&vp->sv_snmtx);
+	slot = snap_lookup(vp, name);
+	if (slot < 0){
+		error_message(mp, "rmsnap", name, -1);
+		goto out;
+	}
+	for (v = vol_list; v != NULL; v = v->sv_next){
+		if (v->sv_base == vp && v->sv_view == slot)
+			break;
+	}
+	if (v != NULL){
+		error_message(mp, "rmsnap", name, -13);
+		goto out;
+	}
+	for (i=0; vp->sv_order[i] != slot; i++){
+		older = vp->sv_order[i];
+	}
 
-						/* indirect_ptr handle */
-						if (pathi.sfi_indirect){	// if in use
-							u_int32_t realblock[SFS_DBPERIDB];
-							disk_read(realblock, pathi.sfi_indirect);	// get real direct_ptrs' block
-
-							for (k=0; k<SFS_DBPERIDB; k++){
-								if (realblock[k]){
-									// clear the datablock
-									char tempdb[SFS_BLOCKSIZE];
-									disk_read(tempdb, realblock[k]);
-									bzero(tempdb, SFS_BLOCKSIZE);
-									disk_write(tempdb, realblock[k]);
-									// update bitmap
-									release_block(realblock[k]);
-								}
-							}
+	ss = &vp->sv_snaptab[slot];
+	sn = &vp->sv_snap[slot];
+	if (older >= 0)
+		on = &vp->sv_snap[older];
+	for (h=0; sn->sn_key != NULL && h<=sn->sn_mask; h++){
+		if (sn->sn_key[h] == SNAP_NOBLOCK)
+			continue;
+		if (on != NULL && snap_find(on, sn->sn_key[h]) == SNAP_NOBLOCK){
+			if (snap_log(vp, older, sn->sn_key[h], sn->sn_val[h]) == 0)
+				continue;
+			vp->sv_snaptab[older].ss_flags |= SFS_SNAP_BROKEN;
+		}
+		snap_put_block(vp, sn->sn_val[h]);
+	}
+	for (blockno = ss->ss_log; blockno; blockno = lb.sl_next){
+		disk_read_r(&vp->sv_disk, &lb, blockno);
+		snap_put_block(vp, blockno);
+	}
+
+	snap_free(sn);
+	bzero(ss, sizeof(struct sfs_snap));
+	snap_table_write(vp);
+	snap_sort(vp);
+out:
+	pthread_mutex_unlock(&vp->sv_snmtx);
+	pthread_mutex_unlock(&vol_lock);
+	sb_sync(vp);
+	disk_commit_r(mp->sm_dk);
+}
+
+/*
+ * Fragmentation. A file reads fastest with its blocks in the order
+ * cpout wants them: the direct blocks, the indirect block, then the
+ * blocks it points to. file_layout() lists them so (holes left out)
+ * and an extent is a run of them that are also consecutive on disk.
+ */
+#define SFS_MAXFILEBLOCKS (SFS_NDIRECT + 1 + SFS_DBPERIDB)
+
+static u_int32_t file_layout(struct sfs_mnt *mp, const struct sfs_inode *inode, u_int32_t *blocks, u_int32_t *realblock){
+
+	u_int32_t n = 0;
+	int k;
+
+	for (k=0; k<SFS_NDIRECT; k++){
+		if (inode->sfi_direct[k])
+			blocks[n++] = inode->sfi_direct[k];
+	}
+	if (inode->sfi_indirect){
+		blocks[n++] = inode->sfi_indirect;
+		disk_read_r(mp->sm_dk, realblock, inode->sfi_indirect);
+		for (k=0; k<SFS_DBPERIDB; k++){
+			if (realblock[k])
+				blocks[n++] = realblock[k];
+		}
+	}
+	return n;
+}
+
+static u_int32_t extents(const u_int32_t *blocks, u_int32_t n){
 
-							bzero(realblock, SFS_BLOCKSIZE);	// clear real block
-							disk_write(realblock, pathi.sfi_indirect);
-							release_block(pathi.sfi_indirect);	// update bitmap
-						}
+	u_int32_t i, ext = (n > 0);
 
-						/* release child(target file's) i-node */
-						bzero(&pathi, SFS_BLOCKSIZE);
-						disk_write( &pathi, tmpchinum );
-						release_block(tmpchinum);
+	for (i=1; i<n; i++){
+		if (blocks[i] != blocks[i-1] + 1)
+			ext++;
+	}
+	return ext;
+}
 
-						return;
+struct fragstat {
+	u_int32_t fs_files;
+	u_int32_t fs_fragmented;
+	u_int64_t fs_extents;
+	u_int32_t fs_moved;		// defrag: files
+	u_int64_t fs_mblocks;		// and their blocks
+	u_int32_t fs_skipped;		// shared, or no run long enough
+};
+
+static void frag_count(struct sfs_mnt *mp, const struct sfs_inode *inode, const char *path, struct fragstat *fs){
+
+	u_int32_t blocks[SFS_MAXFILEBLOCKS], realblock[SFS_DBPERIDB], n, ext;
+
+	n = file_layout(mp, inode, blocks, realblock);
+	ext = extents(blocks, n);
+	fs->fs_files++;
+	fs->fs_extents += ext;
+	if (ext > 1){
+		fs->fs_fragmented++;
+		fprintf(mp->sm_out, "%s%s: %u extents, %u blocks\n", path,
+			inode->sfi_type == SFS_TYPE_DIR ? "/" : "", ext, n);
+	}
+}
 
-					} else{	// if not a file
-						error_message("rm", path, -9);
-						return;
-					}
-				}
-			}
+static void frag_dir(struct sfs_mnt *mp, u_int32_t ino, const char *path, struct fragstat *fs){
+
+	struct ilock *il = inode_lock(mp, ino, IL_READ), *cl;
+	struct sfs_inode di, ci;
+	struct sfs_dir de[SFS_DENTRYPERBLOCK];
+	char cpath[1024];
+	int i, j;
 
+	inode_read(mp, &di, ino);
+	frag_count(mp, &di, path, fs);
+	for (i=0; i<SFS_NDIRECT; i++){
+		if (!di.sfi_direct[i])
+			continue;
+		disk_read_r(mp->sm_dk, de, di.sfi_direct[i]);
+		for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+			if (de[j].sfd_ino == SFS_NOINO || !strcmp(de[j].sfd_name, ".") || !strcmp(de[j].sfd_name, ".."))
+				continue;
+			snprintf(cpath, sizeof(cpath), "%s/%.*s", path, SFS_NAMELEN, de[j].sfd_name);
+
+			cl = inode_lock(mp, de[j].sfd_ino, IL_READ);
+			inode_read(mp, &ci, de[j].sfd_ino);
+			if (ci.sfi_type != SFS_TYPE_DIR)
+				frag_count(mp, &ci, cpath, fs);
+			inode_unlock(mp, cl);
+			if (ci.sfi_type == SFS_TYPE_DIR)
+				frag_dir(mp, de[j].sfd_ino, cpath, fs);	// we hold its parent
 		}
 	}
-
-	// path not found
-	error_message("rm", path, -1);
-	return;
+	inode_unlock(mp, il);
 }
 
+/* count one free extent of run blocks, in a power of two bucket */
+static void free_extent(u_int32_t *hist, u_int32_t *largest, u_int32_t run){
 
-void sfs_cpin(const char* local_path, const char* path) 
-{
+	int b;
 
-	int tempfd;
+	for (b=0; (2ull << b) <= run; b++)
+		;
+	hist[b]++;
+	if (run > *largest)
+		*largest = run;
+}
 
-	// host path check
-	tempfd = open(path, O_RDWR);
-	if (tempfd < 0){
-		error_message("cpin", path, -12);
-		return;
+/*
+ * Show every file in more than one extent, then how broken up the
+ * free space is.
+ */
+void sfs_frag_r(struct sfs_mnt *mp) {
+	struct sfs_vol *vp = mp->sm_vol;
+	struct fragstat fs;
+	u_int32_t hist[33], blockno, first, end, run = 0, nruns = 0, largest = 0;
+	u_int8_t byte, *pg;
+	int b, shard, loaded;
+
+	vol_refresh(mp);
+	bzero(&fs, sizeof(fs));
+	frag_dir(mp, SFS_ROOT_LOCATION, "", &fs);
+	fprintf(mp->sm_out, "Files: %u, %u fragmented, %.2f extents per file\n",
+		fs.fs_files, fs.fs_fragmented, fs.fs_files ? (double)fs.fs_extents / fs.fs_files : 0.0);
+
+	bzero(hist, sizeof(hist));
+	for (shard=0; shard<vp->sv_nshard; shard++){
+		blockno = first = (u_int32_t)shard * SFS_BLOCKBITS;
+		end = (vp->sv_spb.sp_nblocks - blockno < SFS_BLOCKBITS) ? vp->sv_spb.sp_nblocks : blockno + SFS_BLOCKBITS;
+		pthread_mutex_lock(&vp->sv_bmlock[shard % SFS_BMLOCKS]);
+		loaded = vp->sv_bmpage[shard] != NULL;
+		pg = NULL;
+		if (vp->sv_bmfree[shard] == BM_UNKNOWN)
+			bm_page(vp, shard);	// counts it
+		if (vp->sv_bmfree[shard] == end - blockno){	// all free
+			run += end - blockno;
+			blockno = end;
+		} else if (vp->sv_bmfree[shard] == 0){	// all used
+			if (run){
+				free_extent(hist, &largest, run);
+				nruns++;
+				run = 0;
+			}
+			blockno = end;
+		} else{
+			pg = bm_page(vp, shard);
+		}
+		for (; blockno<end; blockno++){
+			byte = pg[(blockno-first)/8];
+			if (blockno % 8 == 0 && end - blockno >= 8 && (byte == 0 || (byte == 255 && !run))){
+				run += byte ? 0 : 8;	// a whole byte at once
+				blockno += 7;
+			} else if (!BIT_CHECK(byte, blockno%8)){
+				run++;
+			} else if (run){
+				free_extent(hist, &largest, run);
+				nruns++;
+				run = 0;
+			}
+		}
+		bm_putback(vp, shard, loaded);
+		pthread_mutex_unlock(&vp->sv_bmlock[shard % SFS_BMLOCKS]);
 	}
-
-	// total filesize check
-	filesize = lseek(tempfd, 0, SEEK_END);
-	if (filesize > SFS_BLOCKSIZE * 143){
-		error_message("cpin", "", -11);
-		return;
+	if (run){	// up to the end of the volume
+		free_extent(hist, &largest, run);
+		nruns++;
 	}
+	fprintf(mp->sm_out, "Free extents: %u, largest %u blocks\n", nruns, largest);
+	for (b=0; b<33; b++){
+		if (hist[b])
+			fprintf(mp->sm_out, "%10u-%-10u %u\n", 1u << b, (u_int32_t)((2ull << b) - 1), hist[b]);
+	}
+}
 
-	close(tempfd);
-
+/* copy a block of a file being moved, keeping it findable by dedup */
+static void defrag_copy(struct sfs_mnt *mp, u_int32_t from, u_int32_t to, int data){
 
+	char block[SFS_BLOCKSIZE];
 
-	int empty_dtre_found=0;
-	int empty_direct_ptr=0;
+	disk_read_r(mp->sm_dk, block, from);
+	disk_write_r(mp->sm_dk, block, to);
+	if (data && mp->sm_vol->sv_dedup)
+		dedup_add(mp, to, block_hash(block));
+}
 
-	struct sfs_dir *modified_drtblock;
-	u_int32_t origin_drtblock_no;
-	u_int32_t fbn;
+/*
+ * Move a file into one run of free blocks. The copies are all written
+ * before the inode is, so the file is either all old or all new; the
+ * old blocks are freed after. A file sharing any block with another
+ * stays where it is. Returns 1 if moved, 0 if there was no need, -1
+ * if it could not be.
+ */
+static int defrag_file(struct sfs_mnt *mp, struct sfs_inode *inode, u_int32_t ino, struct fragstat *fs){
+
+	u_int32_t blocks[SFS_MAXFILEBLOCKS], realblock[SFS_DBPERIDB], newrb[SFS_DBPERIDB];
+	u_int32_t n, i, start, next;
+	struct sfs_inode ni = *inode;
+	char zero[SFS_BLOCKSIZE];
+	int k;
+
+	n = file_layout(mp, inode, blocks, realblock);
+	if (extents(blocks, n) <= 1)
+		return 0;
+	// no one else may take a reference while it moves
+	for (i=0; i<n; i++){
+		if (!block_own(mp, blocks[i]))
+			return -1;
+	}
+	if (reserve_blocks(mp, n))
+		return -1;
+	start = take_free_run(mp, n);
+	unreserve_blocks(mp, n);
+	if (!start)
+		return -1;
+
+	next = start;
+	for (k=0; k<SFS_NDIRECT; k++){
+		if (inode->sfi_direct[k]){
+			defrag_copy(mp, inode->sfi_direct[k], next, inode->sfi_type == SFS_TYPE_FILE);
+			ni.sfi_direct[k] = next++;
+		}
+	}
+	if (inode->sfi_indirect){
+		ni.sfi_indirect = next++;
+		for (k=0; k<SFS_DBPERIDB; k++){
+			newrb[k] = 0;
+			if (realblock[k]){
+				defrag_copy(mp, realblock[k], next, 1);
+				newrb[k] = next++;
+			}
+		}
+		disk_write_r(mp->sm_dk, newrb, ni.sfi_indirect);
+	}
+	inode_write(mp, &ni, ino);
+	*inode = ni;
 
-	struct sfs_inode ci;
-	disk_read( &ci, sd_cwd.sfd_ino );
+	bzero(zero, SFS_BLOCKSIZE);
+	for (i=0; i<n; i++){
+		disk_write_r(mp->sm_dk, zero, blocks[i]);
+		release_block(mp, blocks[i]);
+	}
+	fs->fs_moved++;
+	fs->fs_mblocks += n;
+	return 1;
+}
 
-	//for consistency
-	assert( ci.sfi_type == SFS_TYPE_DIR );
+static void defrag_dir(struct sfs_mnt *mp, u_int32_t ino, struct fragstat *fs){
 
+	struct ilock *il, *cl;
+	struct sfs_inode di, ci;
+	struct sfs_dir de[SFS_DENTRYPERBLOCK];
+	int i, j;
 
+	// its own blocks first, repacked, then what is in it; its parent
+	// is held, so it cannot go away in between
+	il = inode_lock(mp, ino, IL_WRITE);
+	inode_read(mp, &di, ino);
+	dir_shrink(mp, ino, &di, 1);
+	if (defrag_file(mp, &di, ino, fs) < 0)
+		fs->fs_skipped++;
+	inode_unlock(mp, il);
 
-	// check if the local path already exists
-	// cwd inode direct ptr loop
-	int i;
-	struct sfs_dir *tempdrte;
+	il = inode_lock(mp, ino, IL_READ);
+	inode_read(mp, &di, ino);
 	for (i=0; i<SFS_NDIRECT; i++){
-		// if direct ptr in use,
-		if (ci.sfi_direct[i]){
-			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
-			disk_read( cdtrb, ci.sfi_direct[i] );
-
-			// cwd directory entry loop
-			int j;
-			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
-				if (!empty_dtre_found && (cdtrb[j].sfd_ino == SFS_NOINO)){	// fisrt empty directory entry found
-					empty_dtre_found = 1;
-					tempdrte = &cdtrb[j];
-					modified_drtblock = cdtrb;
-					origin_drtblock_no = ci.sfi_direct[i];
-				}
-
-				// if directory entry in use, and local_path already exists
-				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, local_path) == 0) ){
-					error_message("cpin", local_path, -6);
-					return;
-				}
+		if (!di.sfi_direct[i])
+			continue;
+		disk_read_r(mp->sm_dk, de, di.sfi_direct[i]);
+		for (j=0; j<SFS_DENTRYPERBLOCK; j++){
+			if (de[j].sfd_ino == SFS_NOINO || !strcmp(de[j].sfd_name, ".") || !strcmp(de[j].sfd_name, ".."))
+				continue;
+
+			cl = inode_lock(mp, de[j].sfd_ino, IL_WRITE);
+			inode_read(mp, &ci, de[j].sfd_ino);
+			if (ci.sfi_type == SFS_TYPE_DIR){
+				inode_unlock(mp, cl);
+				defrag_dir(mp, de[j].sfd_ino, fs);
+				continue;
 			}
-			if (empty_dtre_found)
-				break;
-
-		} else {
-			empty_direct_ptr = i;
-			break;
+			if (defrag_file(mp, &ci, de[j].sfd_ino, fs) < 0)
+				fs->fs_skipped++;
+			inode_unlock(mp, cl);
 		}
 	}
+	inode_unlock(mp, il);
+}
 
+/*
+ * Move every file and directory into one run of blocks each, while
+ * the volume stays in use. Snapshots wait until it is done.
+ */
+void sfs_defrag_r(struct sfs_mnt *mp) {
+	struct fragstat fs;
 
-	if(!empty_dtre_found && !empty_direct_ptr){	// directory full
-		error_message("cpin", path, -3);
+	if (write_begin(mp)){
+		error_message(mp, "defrag", mp->sm_vol->sv_spb.sp_volname, -15);
 		return;
 	}
+	bzero(&fs, sizeof(fs));
+	defrag_dir(mp, SFS_ROOT_LOCATION, &fs);
+	sb_sync(mp->sm_vol);
+	write_end(mp);
 
+	fprintf(mp->sm_out, "Moved %u files (%llu blocks), %u could not be moved\n",
+		fs.fs_moved, (unsigned long long)fs.fs_mblocks, fs.fs_skipped);
+}
 
-	int ndpfbn;
-	if (!empty_dtre_found){
-		ndpfbn = take_free_block();
-		if (!ndpfbn){	// no more free block
-			error_message("cpin", local_path, -4);
-			return;
+/*
+ * Check every block of the volume against its checksum, reading
+ * large runs in order. A block that fails is read once more, since
+ * a writer may have been changing it.
+ */
+#define SCRUB_RUN 2048	// blocks per read
+
+void sfs_scrub_r(struct sfs_mnt *mp) {
+	struct sfs_vol *vp = mp->sm_vol;
+	u_int32_t nblocks;
+	u_int32_t block, n, i, nbad = 0;
+	char *buf, again[SFS_BLOCKSIZE];
+	struct timespec t0, t1;
+	double secs;
+
+	vol_refresh(mp);
+	nblocks = vp->sv_spb.sp_nblocks;
+	if (!(vp->sv_spb.sp_features & SFS_FEAT_CSUM)){
+		fprintf(mp->sm_out, "scrub: %s has no checksums\n", vp->sv_spb.sp_volname);
+		return;
+	}
+
+	// aligned, so direct I/O reads straight into it
+	if ((errno = posix_memalign((void**)&buf, 4096, SCRUB_RUN * SFS_BLOCKSIZE)) != 0)
+		err(1, "posix_memalign");
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (block=0; block<nblocks; block+=n){
+		n = (nblocks - block < SCRUB_RUN) ? nblocks - block : SCRUB_RUN;
+		if (block + n < nblocks)
+			disk_readahead_r(mp->sm_dk, block + n, SCRUB_RUN);
+		disk_read_unchecked_r(mp->sm_dk, buf, block, n);
+		for (i=0; i<n; i++){
+			if (disk_csum_check(mp->sm_dk, &buf[i * SFS_BLOCKSIZE], block + i))
+				continue;
+			if (disk_csum_reread_r(mp->sm_dk, again, block + i))
+				continue;
+			if (nbad++ < 10)
+				fprintf(mp->sm_out, "block %u: checksum mismatch\n", block + i);
 		}
 	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	free(buf);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(mp->sm_out, "Scrubbed %u blocks (%llu bytes) in %.3f s (%.2f GB/s)\n", nblocks,
+		(unsigned long long)nblocks * SFS_BLOCKSIZE, secs,
+		secs > 0 ? (double)nblocks * SFS_BLOCKSIZE / secs / 1e9 : 0.0);
+	fprintf(mp->sm_out, "%u bad blocks, %u mismatches seen on reads since mount\n", nbad, disk_csum_errors(mp->sm_dk));
+}
 
+void dump_inode(struct sfs_mnt *mp, struct sfs_inode inode) {
+	int i;
+	struct sfs_dir dir_entry[SFS_DENTRYPERBLOCK];
 
-	// clear loaded bitmap
-	bzero(BITMAP, bm_size);
-	// load bitmap
-	for (i=0; i<SFS_BITBLOCKS(spb.sp_nblocks); i++){
-		disk_read( &BITMAP[i*SFS_BLOCKSIZE], i+2);
+	fprintf(mp->sm_out, "size %d type %d direct ", inode.sfi_size, inode.sfi_type);
+	for(i=0; i < SFS_NDIRECT; i++) {
+		fprintf(mp->sm_out, " %d ", inode.sfi_direct[i]);
 	}
+	fprintf(mp->sm_out, " indirect %d",inode.sfi_indirect);
+	fprintf(mp->sm_out, "\n");
 
+	if (inode.sfi_type == SFS_TYPE_DIR) {
+		for(i=0; i < SFS_NDIRECT; i++) {
+			if (inode.sfi_direct[i] == 0) break;
+			disk_read_r(mp->sm_dk, dir_entry, inode.sfi_direct[i]);
+			dump_directory(mp, dir_entry);
+		}
+	}
 
+}
 
+void dump_directory(struct sfs_mnt *mp, struct sfs_dir dir_entry[]) {
+	int i;
+	struct sfs_inode inode;
+	struct iblk ib = { 0 };
+	for(i=0; i < SFS_DENTRYPERBLOCK;i++) {
+		fprintf(mp->sm_out, "%d %s\n",dir_entry[i].sfd_ino, dir_entry[i].sfd_name);
+		inode_read_cached(mp, &ib, &inode, dir_entry[i].sfd_ino);
+		if (inode.sfi_type == SFS_TYPE_FILE) {
+			fprintf(mp->sm_out, "\t");
+			dump_inode(mp, inode);
+		}
+	}
+}
 
-	/* for new file i-node*/
+void sfs_dump_r(struct sfs_mnt *mp) {
+	vol_refresh(mp);
 
-	// path not exists
-	struct sfs_inode new_inode;
-	bzero(&new_inode,SFS_BLOCKSIZE); // initalize sfi_direct[] and sfi_indirect
-	new_inode.sfi_size = 0;
-	new_inode.sfi_type = SFS_TYPE_FILE;
+	// dump the current directory structure
+	struct ilock *pl = inode_lock(mp, mp->sm_cwd.sfd_ino, IL_READ);
+	struct sfs_inode c_inode;
 
-	fbn = take_free_block();	// find first free block, get free block number, and mark the bitmap
-	if (!fbn){	// no more free block
-		error_message("cpin", local_path, -4);
-		return;
-	}
-	u_int32_t cifbn = fbn;
+	inode_read(mp, &c_inode, mp->sm_cwd.sfd_ino);
+	fprintf(mp->sm_out, "cwd inode %d name %s\n",mp->sm_cwd.sfd_ino,mp->sm_cwd.sfd_name);
+	dump_inode(mp, c_inode);
+	fprintf(mp->sm_out, "\n");
 
+	inode_unlock(mp, pl);
+}
 
-	/* for directory block (current or new) */
-	if(!empty_dtre_found){
-		// new direct ptr -> new directory block allocate
-		struct sfs_dir new_dtrb[SFS_DENTRYPERBLOCK];
-		bzero(new_dtrb, SFS_BLOCKSIZE);
-		int i;
-		for(i=0; i<SFS_DENTRYPERBLOCK; i++){
-			new_dtrb[i].sfd_ino = SFS_NOINO;
-		}
 
+/*
+ * fsck and bitmap come prebuilt and always read through the default
+ * disk, so only one of them runs at a time.
+ */
+static pthread_mutex_t select_lock = PTHREAD_MUTEX_INITIALIZER;
 
-		new_dtrb[0].sfd_ino = cifbn;
-		bzero(new_dtrb[0].sfd_name, SFS_NAMELEN);
-		strncpy(new_dtrb[0].sfd_name, local_path, SFS_NAMELEN);
-		disk_write(new_dtrb, ndpfbn);
+static void run_prebuilt(struct sfs_mnt *mp, void (*fn)()) {
+	int saved = -1;
 
-		ci.sfi_direct[empty_direct_ptr] = ndpfbn;	// parent direct ptr update (for new directory block)
-	} else{	// found empty directory entry
-		tempdrte->sfd_ino = cifbn;
-		bzero(tempdrte->sfd_name, SFS_NAMELEN);
-		strncpy(tempdrte->sfd_name, local_path, SFS_NAMELEN);
-		disk_write(modified_drtblock, origin_drtblock_no);
+	pthread_mutex_lock(&select_lock);
+	struct disk *prev = disk_select(mp->sm_dk);
+
+	// they print on stdout; point it at the handle's output meanwhile
+	if (mp->sm_out != stdout){
+		fflush(mp->sm_out);
+		fflush(stdout);
+		saved = dup(1);
+		dup2(fileno(mp->sm_out), 1);
+	}
+	fn();
+	if (saved >= 0){
+		fflush(stdout);
+		dup2(saved, 1);
+		close(saved);
 	}
 
-	/* for parent i-node */
+	disk_select(prev);
+	pthread_mutex_unlock(&select_lock);
+}
 
-	ci.sfi_size += sizeof(struct sfs_dir);	// file size up (one directory entry added)
-	disk_write( &ci, sd_cwd.sfd_ino );
+void sfs_fsck_r(struct sfs_mnt *mp) {
+	// the prebuilt checker only knows one inode per block, and stops
+	// at a file's first zero block pointer
+	if (mp->sm_vol != NULL && mp->sm_vol->sv_packed){
+		fprintf(mp->sm_out, "fsck: not supported on a packed inode table\n");
+		return;
+	}
+	if (mp->sm_vol != NULL && (mp->sm_vol->sv_spb.sp_features & SFS_FEAT_SPARSE))
+		fprintf(mp->sm_out, "fsck: image has sparse files; blocks after a hole show as bitmap errors\n");
+	if (mp->sm_vol != NULL && (mp->sm_vol->sv_spb.sp_features & SFS_FEAT_DEDUP))
+		fprintf(mp->sm_out, "fsck: image has a dedup table at %d (%d blocks); they show as bitmap errors\n",
+			mp->sm_vol->sv_spb.sp_ddt, mp->sm_vol->sv_spb.sp_ddtblocks);
+	if (mp->sm_vol != NULL && (mp->sm_vol->sv_spb.sp_features & SFS_FEAT_CSUM))
+		fprintf(mp->sm_out, "fsck: image has a checksum table at %d (%d blocks); they show as bitmap errors\n",
+			mp->sm_vol->sv_spb.sp_csum, mp->sm_vol->sv_spb.sp_csumblocks);
+	if (mp->sm_vol != NULL && (mp->sm_vol->sv_spb.sp_features & SFS_FEAT_SNAP))
+		fprintf(mp->sm_out, "fsck: image has snapshots; the blocks they keep show as bitmap errors\n");
+	run_prebuilt(mp, sfs_fsck);
+}
 
+void sfs_bitmap_r(struct sfs_mnt *mp) {
+	run_prebuilt(mp, sfs_bitmap);
+}
 
 
-	/* new file datablock */
-	
-	int index=0;
-	int n;
-	char datablock[SFS_BLOCKSIZE];
-	int freeblockno, rfreeblockno;
-	u_int32_t location = 0;
-	u_int32_t realblock[SFS_DBPERIDB];
-	bzero(realblock, SFS_BLOCKSIZE);
+/* Default handle wrappers */
 
-	custom_disk_open(path);
+void sfs_mount(const char* path) {
+	default_mnt.sm_out = stdout;
+	sfs_mount_r(&default_mnt, path);
+	if (default_mnt.sm_dk != NULL)
+		disk_select(default_mnt.sm_dk);
+}
 
-	int total=0;
-	int len;
-	int totalfs = filesize;
-	while(total < totalfs){
-		if (index == SFS_NDIRECT){
-			// indirect ptr's realblock
-			rfreeblockno = take_free_block();
-			if (!rfreeblockno){	//no more free block
-				new_inode.sfi_size = total;
-				disk_write(&new_inode, cifbn);
-				error_message("cpin", local_path, -4);
-				return;
-			}
-			new_inode.sfi_indirect = rfreeblockno;
-		}
+void sfs_umount() {
+	sfs_umount_r(&default_mnt);
+}
 
-		// find one free block
-		freeblockno = take_free_block();
-		if (!freeblockno){	//no more free block
-			new_inode.sfi_size = total;
-			disk_write(&new_inode, cifbn);
-			error_message("cpin", local_path, -4);
-			return;
-		}
+void sfs_ls(const char* path) {
+	sfs_ls_r(&default_mnt, path);
+}
 
-		if (index < SFS_NDIRECT)
-			new_inode.sfi_direct[index++] = freeblockno;	// link with i-node's direct ptr
-		else{
-			realblock[index - SFS_NDIRECT] = freeblockno;	// link with indirect ptr's realblock
-			index++;
-			disk_write(realblock, rfreeblockno);
-		}
+void sfs_cd(const char* path) {
+	sfs_cd_r(&default_mnt, path);
+}
 
+void sfs_lsr(const char* path) {
+	sfs_lsr_r(&default_mnt, path);
+}
 
-		bzero(datablock, SFS_BLOCKSIZE);
-		len = custom_disk_read(datablock, location);
-		total += len;
+void sfs_du(const char* path) {
+	sfs_du_r(&default_mnt, path);
+}
 
-		// write into local one block
-		disk_write(datablock, freeblockno);
-		disk_write(&new_inode, cifbn);
+void sfs_find(const char* path, const char *pattern) {
+	sfs_find_r(&default_mnt, path, pattern);
+}
 
-	}
+void sfs_mkdir(const char* path) {
+	sfs_mkdir_r(&default_mnt, path);
+}
 
-	custom_disk_close();
+void sfs_mkdirv(int n, char *const paths[]) {
+	sfs_mkdirv_r(&default_mnt, n, paths);
+}
 
-	new_inode.sfi_size = total;
-	disk_write(&new_inode, cifbn);
+void sfs_rmdir(const char* path) {
+	sfs_rmdir_r(&default_mnt, path);
+}
 
+void sfs_touch(const char* path) {
+	sfs_touch_r(&default_mnt, path);
 }
 
+void sfs_touchv(int n, char *const paths[]) {
+	sfs_touchv_r(&default_mnt, n, paths);
+}
 
+void sfs_rm(const char* path) {
+	sfs_rm_r(&default_mnt, path);
+}
 
-void sfs_cpout(const char* local_path, const char* path) 
-{
+void sfs_rmv(int n, char *const patterns[]) {
+	sfs_rmv_r(&default_mnt, n, patterns);
+}
 
-	int target_ino = -1;
-	int bflag;
+void sfs_rmv_flags(int n, char *const patterns[], int flags) {
+	sfs_rmv_flags_r(&default_mnt, n, patterns, flags);
+}
 
+void sfs_mv(const char* src_name, const char* dst_name) {
+	sfs_mv_r(&default_mnt, src_name, dst_name);
+}
 
-	// get cwd's inode
-	struct sfs_inode ci;
-	disk_read( &ci, sd_cwd.sfd_ino );
+void sfs_cp(const char* src_name, const char* dst_name) {
+	sfs_cp_r(&default_mnt, src_name, dst_name);
+}
 
-	//for consistency
-	assert( ci.sfi_type == SFS_TYPE_DIR );
+void sfs_mksnap(const char *name) {
+	sfs_mksnap_r(&default_mnt, name);
+}
 
-	// find path
-	// cwd inode direct ptr loop
-	int i;
-	for (i=0; i<SFS_NDIRECT; i++){
-		// if direct ptr in use,
-		if (ci.sfi_direct[i]){
-			struct sfs_dir cdtrb[SFS_DENTRYPERBLOCK];
-			disk_read( cdtrb, ci.sfi_direct[i] );
+void sfs_lssnap() {
+	sfs_lssnap_r(&default_mnt);
+}
 
-			// cwd directory entry loop
-			int j;
-			for (j=0; j<SFS_DENTRYPERBLOCK; j++){
-				// if directory entry in use, and path found
-				if ( (cdtrb[j].sfd_ino != SFS_NOINO) && (strcmp(cdtrb[j].sfd_name, local_path) == 0) ){
-					target_ino = cdtrb[j].sfd_ino;
-					bflag = 1;
-					break;
-				}
-			}
-			if (bflag)
-				break;
-		}
-	}
+void sfs_rmsnap(const char *name) {
+	sfs_rmsnap_r(&default_mnt, name);
+}
 
-	// path not found
-	if (target_ino == -1){
-		error_message("cpout", local_path, -1);
-		return;
-	}
+void sfs_sync(const char *policy) {
+	sfs_sync_r(&default_mnt, policy);
+}
 
-	int tempfd;
-	if ( (tempfd = open(path, O_RDWR)) >= 0 ){
-		error_message("cpout", path, -6);
-		return;
-	};
-	close(tempfd);
+void sfs_frag() {
+	sfs_frag_r(&default_mnt);
+}
 
+void sfs_defrag() {
+	sfs_defrag_r(&default_mnt);
+}
 
+void sfs_dump() {
+	sfs_dump_r(&default_mnt);
+}
 
+void sfs_df() {
+	sfs_df_r(&default_mnt);
+}
 
-	custom_disk_open2(path);
-	u_int32_t location = 0;
+void sfs_scrub() {
+	sfs_scrub_r(&default_mnt);
+}
 
-	// get i-node
-	struct sfs_inode targeti;
-	disk_read(&targeti, target_ino);
+void sfs_dedup(const char *arg) {
+	sfs_dedup_r(&default_mnt, arg);
+}
 
-	filesize = targeti.sfi_size;
-	int totalfs = filesize;
+void sfs_mkfs(const char *path, unsigned long long nblocks, const char *volname, int flags) {
+	sfs_mkfs_r(&default_mnt, path, nblocks, volname, flags);
+}
 
-	for (i=0; i<SFS_NDIRECT; i++){
-		if (targeti.sfi_direct[i]){
-			char tempdb[SFS_BLOCKSIZE];
-			bzero(tempdb, SFS_BLOCKSIZE);
-			disk_read(tempdb, targeti.sfi_direct[i]);
-			custom_disk_write(tempdb, location++);
-		}
-	}
+void sfs_cpin(const char* local_path, const char* path) {
+	sfs_cpin_r(&default_mnt, local_path, path);
+}
 
-	// indirect
-	if (targeti.sfi_indirect){
-		u_int32_t realblock[SFS_DBPERIDB];
-		bzero(realblock, SFS_BLOCKSIZE);
-		disk_read(realblock, targeti.sfi_indirect);
-
-		int j;
-		for (j=0; j<SFS_DBPERIDB; j++){
-			if (realblock[j]){
-				char tempdb[SFS_BLOCKSIZE];
-				bzero(tempdb, SFS_BLOCKSIZE);
-				disk_read(tempdb, realblock[j]);
-				custom_disk_write(tempdb, location++);
-			}
-		}
-	}
+void sfs_cpout(const char* local_path, const char* path) {
+	sfs_cpout_r(&default_mnt, local_path, path);
+}
 
-	custom_disk_close();
+int sfs_open(const char *path, int flags) {
+	return sfs_open_r(&default_mnt, path, flags);
 }
 
-void dump_inode(struct sfs_inode inode) {
-	int i;
-	struct sfs_dir dir_entry[SFS_DENTRYPERBLOCK];
+int sfs_read(int fd, void *buf, int n) {
+	return sfs_read_r(&default_mnt, fd, buf, n);
+}
 
-	printf("size %d type %d direct ", inode.sfi_size, inode.sfi_type);
-	for(i=0; i < SFS_NDIRECT; i++) {
-		printf(" %d ", inode.sfi_direct[i]);
-	}
-	printf(" indirect %d",inode.sfi_indirect);
-	printf("\n");
+int sfs_write(int fd, const void *buf, int n) {
+	return sfs_write_r(&default_mnt, fd, buf, n);
+}
 
-	if (inode.sfi_type == SFS_TYPE_DIR) {
-		for(i=0; i < SFS_NDIRECT; i++) {
-			if (inode.sfi_direct[i] == 0) break;
-			disk_read(dir_entry, inode.sfi_direct[i]);
-			dump_directory(dir_entry);
-		}
-	}
+int sfs_lseek(int fd, int offset, int whence) {
+	return sfs_lseek_r(&default_mnt, fd, offset, whence);
+}
 
+int sfs_ftruncate(int fd, int length) {
+	return sfs_ftruncate_r(&default_mnt, fd, length);
 }
 
-void dump_directory(struct sfs_dir dir_entry[]) {
-	int i;
-	struct sfs_inode inode;
-	for(i=0; i < SFS_DENTRYPERBLOCK;i++) {
-		printf("%d %s\n",dir_entry[i].sfd_ino, dir_entry[i].sfd_name);
-		disk_read(&inode,dir_entry[i].sfd_ino);
-		if (inode.sfi_type == SFS_TYPE_FILE) {
-			printf("\t");
-			dump_inode(inode);
-		}
-	}
+int sfs_close(int fd) {
+	return sfs_close_r(&default_mnt, fd);
 }
 
-void sfs_dump() {
-	// dump the current directory structure
-	struct sfs_inode c_inode;
+void sfs_cat(const char* path) {
+	sfs_cat_r(&default_mnt, path);
+}
 
-	disk_read(&c_inode, sd_cwd.sfd_ino);
-	printf("cwd inode %d name %s\n",sd_cwd.sfd_ino,sd_cwd.sfd_name);
-	dump_inode(c_inode);
-	printf("\n");
+void sfs_append(const char* path, const char *text) {
+	sfs_append_r(&default_mnt, path, text);
+}
 
+void sfs_truncate(const char* path, int length) {
+	sfs_truncate_r(&default_mnt, path, length);
 }
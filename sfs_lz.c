@@ -0,0 +1,182 @@
+/*
+ * LZ4-style codec.
+ *
+ * A compressed stream is a list of sequences. Each one is a token
+ * byte (literal count in the high nibble, match length - 4 in the low
+ * one), more literal count bytes if the nibble is 15, the literals, a
+ * two-byte little-endian match offset, and more match length bytes if
+ * that nibble is 15. Extra count bytes add 255 each until one is less.
+ * The last sequence has literals only and ends the stream.
+ *
+ * The compressor takes the first match a 4-byte hash finds, which
+ * keeps it fast; the decompressor checks every bound.
+ */
+#include <sys/types.h>
+#include <string.h>
+
+#include "sfs_types.h"
+#include "sfs_lz.h"
+
+#define MINMATCH  4
+#define HASHBITS  12
+#define MAXOFFSET 65535
+
+static u_int32_t
+read32(const u_int8_t *p)
+{
+	u_int32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static u_int32_t
+hash4(u_int32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASHBITS);
+}
+
+/* a count past the nibble: 255s then the rest */
+static u_int8_t *
+put_count(u_int8_t *op, int n)
+{
+	for (; n >= 255; n -= 255) {
+		*op++ = 255;
+	}
+	*op++ = n;
+	return op;
+}
+
+int
+sfs_lz_compress(const void *src, int srclen, void *dst, int dstcap)
+{
+	const u_int8_t *base = src;
+	const u_int8_t *ip = base, *anchor = base, *end = base + srclen;
+	const u_int8_t *ref;
+	u_int8_t *op = dst, *oend = op + dstcap;
+	u_int32_t table[1 << HASHBITS];	/* position + 1, 0 for none */
+	u_int32_t h;
+	int lit, mlen;
+
+	if (srclen > SFS_LZ_MAXIN)
+		return 0;
+	memset(table, 0, sizeof(table));
+
+	while (ip + MINMATCH <= end) {
+		h = hash4(read32(ip));
+		ref = table[h] ? base + table[h] - 1 : NULL;
+		table[h] = ip - base + 1;
+
+		if (ref == NULL || ip - ref > MAXOFFSET || read32(ref) != read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		for (mlen = MINMATCH; ip + mlen < end && ref[mlen] == ip[mlen]; mlen++)
+			;
+
+		/* worst case for this sequence */
+		lit = ip - anchor;
+		if (op + 1 + lit/255 + 1 + lit + 2 + (mlen - MINMATCH)/255 + 1 > oend)
+			return 0;
+
+		*op = (lit < 15 ? lit : 15) << 4;
+		*op |= (mlen - MINMATCH < 15) ? mlen - MINMATCH : 15;
+		op++;
+		if (lit >= 15)
+			op = put_count(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (mlen - MINMATCH >= 15)
+			op = put_count(op, mlen - MINMATCH - 15);
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	/* the rest as literals */
+	lit = end - anchor;
+	if (op + 1 + lit/255 + 1 + lit > oend)
+		return 0;
+	*op++ = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = put_count(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - (u_int8_t *)dst;
+}
+
+/* read a count past the nibble; -1 if the input runs out */
+static int
+get_count(const u_int8_t **ipp, const u_int8_t *iend)
+{
+	const u_int8_t *ip = *ipp;
+	int n = 0;
+
+	do {
+		if (ip >= iend || n > SFS_LZ_MAXIN)
+			return -1;
+		n += *ip;
+	} while (*ip++ == 255);
+	*ipp = ip;
+	return n;
+}
+
+int
+sfs_lz_decompress(const void *src, int srclen, void *dst, int dstcap)
+{
+	const u_int8_t *ip = src, *iend = ip + srclen;
+	u_int8_t *base = dst, *op = base, *oend = base + dstcap;
+	const u_int8_t *ref;
+	int token, lit, mlen, n;
+
+	for (;;) {
+		if (ip >= iend)
+			return -1;
+		token = *ip++;
+
+		lit = token >> 4;
+		if (lit == 15) {
+			if ((n = get_count(&ip, iend)) < 0)
+				return -1;
+			lit += n;
+		}
+		if (lit > iend - ip || lit > oend - op)
+			return -1;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		if (ip == iend)
+			break;	/* last sequence */
+
+		if (iend - ip < 2)
+			return -1;
+		n = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (n == 0 || n > op - base)
+			return -1;
+		ref = op - n;
+
+		mlen = (token & 15) + MINMATCH;
+		if ((token & 15) == 15) {
+			if ((n = get_count(&ip, iend)) < 0)
+				return -1;
+			mlen += n;
+		}
+		if (mlen > oend - op)
+			return -1;
+		if (op - ref >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			while (mlen--) {	/* overlaps itself */
+				*op++ = *ref++;
+			}
+		}
+	}
+
+	return op - base;
+}
@@ -0,0 +1,18 @@
+#ifndef _SFS_LZ_H_
+#define _SFS_LZ_H_
+
+/*
+ * Small LZ77 codec in the style of LZ4, for compressed files.
+ * Inputs are at most SFS_LZ_MAXIN bytes.
+ *
+ * sfs_lz_compress() returns the compressed size, or 0 if the result
+ * would not fit in dstcap bytes.
+ * sfs_lz_decompress() returns the decompressed size, or -1 if src is
+ * not valid or does not fit in dstcap bytes.
+ */
+#define SFS_LZ_MAXIN  65536
+
+int sfs_lz_compress(const void *src, int srclen, void *dst, int dstcap);
+int sfs_lz_decompress(const void *src, int srclen, void *dst, int dstcap);
+
+#endif /*_SFS_LZ_H_*/
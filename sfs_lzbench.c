@@ -0,0 +1,114 @@
+// Compression benchmark
+//
+// Build: gcc -O2 sfs_lz.c sfs_lzbench.c -o sfs_lzbench
+// Usage: sfs_lzbench file ...
+//
+// Compresses each file in 4 KB chunks as cpin -z does, and reports
+// compress and decompress speed, the codec's ratio, and the ratio in
+// 512-byte blocks actually stored (a chunk that doesn't save a block
+// is stored as is). Try it on samples of what a volume will hold.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <sys/time.h>
+
+#include "sfs_types.h"
+#include "sfs_lz.h"
+
+#define CHUNK      4096	// SFS_CZBLOCKS * SFS_BLOCKSIZE
+#define BLOCKSIZE  512
+#define MINTIME    0.5	// seconds per measurement
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static char *slurp(const char *path, long *lenp)
+{
+	FILE *f = fopen(path, "rb");
+	char *buf;
+	long len;
+
+	if (f == NULL)
+		err(1, "%s", path);
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	buf = malloc(len + 1);
+	if (buf == NULL || fread(buf, 1, len, f) != (size_t)len)
+		err(1, "%s", path);
+	fclose(f);
+	*lenp = len;
+	return buf;
+}
+
+int main(int argc, char *argv[])
+{
+	int a;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: sfs_lzbench file ...\n");
+		return 1;
+	}
+
+	printf("file\tbytes\tcomp MB/s\tdecomp MB/s\tratio\tblock ratio\n");
+	for (a = 1; a < argc; a++) {
+		long len, off, zbytes = 0, blocks = 0, stored = 0, rounds;
+		char *in = slurp(argv[a], &len);
+		long nchunk = (len + CHUNK - 1) / CHUNK;
+		char *z = malloc(nchunk * CHUNK);
+		int *zlen = malloc(nchunk * sizeof(int));
+		char out[CHUNK];
+		double t0, tc, td;
+		long c;
+
+		if (z == NULL || zlen == NULL)
+			err(1, "malloc");
+
+		// compress until enough time has gone by
+		t0 = now();
+		for (rounds = 0; rounds == 0 || now() - t0 < MINTIME; rounds++) {
+			for (c = 0, off = 0; off < len; c++, off += CHUNK) {
+				int n = (len - off < CHUNK) ? len - off : CHUNK;
+				zlen[c] = sfs_lz_compress(in + off, n, z + c * CHUNK, CHUNK);
+			}
+		}
+		tc = (now() - t0) / rounds;
+
+		for (c = 0, off = 0; off < len; c++, off += CHUNK) {
+			int n = (len - off < CHUNK) ? len - off : CHUNK;
+			int nb = (n + BLOCKSIZE - 1) / BLOCKSIZE;
+			int zb = (zlen[c] + 4 + BLOCKSIZE - 1) / BLOCKSIZE;
+
+			zbytes += zlen[c] ? zlen[c] : n;
+			blocks += nb;
+			stored += (zlen[c] && zb < nb) ? zb : nb;
+		}
+
+		t0 = now();
+		for (rounds = 0; rounds == 0 || now() - t0 < MINTIME; rounds++) {
+			for (c = 0, off = 0; off < len; c++, off += CHUNK) {
+				int n = (len - off < CHUNK) ? len - off : CHUNK;
+				if (zlen[c] == 0)
+					continue;
+				if (sfs_lz_decompress(z + c * CHUNK, zlen[c], out, CHUNK) != n ||
+				    memcmp(out, in + off, n) != 0)
+					errx(1, "%s: chunk %ld does not round-trip", argv[a], c);
+			}
+		}
+		td = (now() - t0) / rounds;
+
+		printf("%s\t%ld\t%.1f\t%.1f\t%.2f\t%.2f\n", argv[a], len,
+		    len / tc / 1e6, len / td / 1e6,
+		    zbytes ? (double)len / zbytes : 1.0,
+		    stored ? (double)blocks / stored : 1.0);
+		free(in);
+		free(z);
+		free(zlen);
+	}
+	return 0;
+}
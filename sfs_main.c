@@ -2,213 +2,494 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
+#include "sfs_types.h"
 #include "sfs_func.h"
+#include "sfs_server.h"
+#include "sfs.h"
 #define DELIMS " \t\r\n"
-#define MAX_ARGC 10
+#define MAX_ARGC 128
 
-int main()
+/*
+ * Run one shell command line on a handle, output to out.
+ * Returns 1 on exit, 0 otherwise.
+ */
+int sfs_command(struct sfs_mnt *mp, FILE *out, char *buf)
 {
-	char buf[256];
 	int argc;
 	char* argv[MAX_ARGC];
 
-	printf("OS SFS shell\n");
+	argv[0] = strtok(buf, DELIMS);
+	if( !argv[0] )
+		return 0;
 
-	while(! feof(stdin))
-	{
-		printf("os_shell> ");
+	argc = 1;
+	while(argc < MAX_ARGC - 1 && (argv[argc] = strtok(NULL, DELIMS)) != NULL) {
+		argc++;
+	}
+	argv[argc] = NULL;
 
-		fgets( buf, sizeof(buf), stdin);
-		
-		argv[0] = strtok(buf, DELIMS);
-		if( !argv[0] )
-			continue;
+	// the rest need a volume; without one they would fault
+	if( !sfs_mnt_mounted(mp) && strcmp(argv[0], "mount") && strcmp(argv[0], "umount") &&
+	    strcmp(argv[0], "mkfs") && strcmp(argv[0], "sync") && strcmp(argv[0], "exit") )
+	{
+		fprintf(out, "%s: no volume mounted\n", argv[0]);
+		return 0;
+	}
 
-		argc = 1;
-		while((argv[argc] = strtok(NULL, DELIMS)) != NULL) {
-			argc++;
-		}
+	if( !strcmp(argv[0], "mount") )
+	{
+		int flags = 0, a = 1;
+		char *policy = NULL;
 
-		if( !strcmp(argv[0], "mount") )
+		for( ; a < argc && argv[a][0] == '-'; a++ )
 		{
-			if(	argc != 2 )
-			{
-				printf("usage: mount disk_img\n");
-				continue;
-			}
-			
-			sfs_mount(argv[1]);			
-			continue;	
+			if( !strcmp(argv[a], "-d") )
+				flags |= SFS_MOUNT_DIRECT;
+			else if( !strcmp(argv[a], "-r") )
+				flags |= SFS_MOUNT_RDONLY;
+			else if( !strcmp(argv[a], "-s") && a + 1 < argc )
+				policy = argv[++a];
+			else
+				break;
 		}
-
-		if( !strcmp(argv[0], "umount") )
+		if(	argc - a != 1 && argc - a != 2 )
 		{
-			sfs_umount();
-			continue;
+			fprintf(out, "usage: mount [-d] [-r] [-s none|cmd|ms[,blocks]] disk_img [snapshot]\n");
+			return 0;
 		}
 
-		if( !strcmp(argv[0], "ls") )
+		sfs_mount_flags_r(mp, argv[a], argv[a+1], flags);
+		if( policy )
+			sfs_sync_r(mp, policy);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "umount") )
+	{
+		sfs_umount_r(mp);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "ls") )
+	{
+		if( argc > 1 && !strcmp(argv[1], "-R") )
 		{
-			if( argc == 1 )
-				sfs_ls(NULL);
-			else if( argc == 2 )
-				sfs_ls(argv[1]);
+			if( argc <= 3 )
+				sfs_lsr_r(mp, argv[2]);
 			else
-			{
-				printf("usage: ls [path]\n");
-			}
-			continue;	
+				fprintf(out, "usage: ls [-R] [path]\n");
 		}
-
-		if( !strcmp(argv[0], "cd") )
+		else if( argc == 1 )
+			sfs_ls_r(mp, NULL);
+		else if( argc == 2 )
+			sfs_ls_r(mp, argv[1]);
+		else
 		{
-			if( argc == 1 )
-				sfs_cd(NULL);
-			else if( argc != 2 )
-			{
-				printf("usage: cd [path]\n");
-				continue;
-			}
-			
-			sfs_cd(argv[1]);
-			continue;	
+			fprintf(out, "usage: ls [-R] [path]\n");
 		}
+		return 0;
+	}
 
-		if( !strcmp(argv[0], "dump") )
+	if( !strcmp(argv[0], "du") )
+	{
+		if( argc > 2 )
 		{
-			sfs_dump();
-			continue;
+			fprintf(out, "usage: du [path]\n");
+			return 0;
 		}
 
-		if( !strcmp(argv[0], "touch") )
+		sfs_du_r(mp, argv[1]);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "find") )
+	{
+		if( argc == 2 )
+			sfs_find_r(mp, NULL, argv[1]);
+		else if( argc == 3 )
+			sfs_find_r(mp, argv[1], argv[2]);
+		else
 		{
-			if( argc != 2 )
-			{
-				printf("usage: touch path\n");
-				continue;
-			}
+			fprintf(out, "usage: find [path] pattern\n");
+		}
+		return 0;
+	}
 
-			sfs_touch(argv[1]);
-			continue;	
+	if( !strcmp(argv[0], "cd") )
+	{
+		if( argc == 1 )
+			sfs_cd_r(mp, NULL);
+		else if( argc != 2 )
+		{
+			fprintf(out, "usage: cd [path]\n");
+			return 0;
 		}
 
+		sfs_cd_r(mp, argv[1]);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "dump") )
+	{
+		sfs_dump_r(mp);
+		return 0;
+	}
 
-		if( !strcmp(argv[0], "mkdir") )
+	if( !strcmp(argv[0], "df") )
+	{
+		sfs_df_r(mp);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "mkfs") )
+	{
+		int flags = 0, a = 1;
+
+		for( ; a < argc && argv[a][0] == '-'; a++ )
 		{
-			if( argc != 2 )
-			{
-				printf("usage: mkdir directory\n");
-				continue;
-			}
+			if( !strcmp(argv[a], "-p") )
+				flags |= SFS_MKFS_PACKED;
+			else if( !strcmp(argv[a], "-c") )
+				flags |= SFS_MKFS_CSUM;
+			else
+				break;
+		}
+		if( argc - a != 2 && argc - a != 3 )
+		{
+			fprintf(out, "usage: mkfs [-p] [-c] disk_img nblocks [volname]\n");
+			return 0;
+		}
 
-			sfs_mkdir(argv[1]);
-			continue;	
+		sfs_mkfs_r(mp, argv[a], strtoull(argv[a+1], NULL, 0), argv[a+2], flags);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "scrub") )
+	{
+		sfs_scrub_r(mp);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "sync") )
+	{
+		if( argc > 2 )
+		{
+			fprintf(out, "usage: sync [none|cmd|ms[,blocks]]\n");
+			return 0;
 		}
 
-		if( !strcmp(argv[0], "rmdir") )
+		sfs_sync_r(mp, argv[1]);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "frag") )
+	{
+		sfs_frag_r(mp);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "defrag") )
+	{
+		sfs_defrag_r(mp);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "mksnap") )
+	{
+		if( argc != 2 )
 		{
-			if( argc != 2 )
-			{
-				printf("usage: rmdir directory\n");
-				continue;
-			}
+			fprintf(out, "usage: mksnap name\n");
+			return 0;
+		}
 
-			sfs_rmdir(argv[1]);
-			continue;	
+		sfs_mksnap_r(mp, argv[1]);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "rmsnap") )
+	{
+		if( argc != 2 )
+		{
+			fprintf(out, "usage: rmsnap name\n");
+			return 0;
 		}
 
-		if( !strcmp(argv[0], "rm") )
+		sfs_rmsnap_r(mp, argv[1]);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "lssnap") )
+	{
+		sfs_lssnap_r(mp);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "dedup") )
+	{
+		if( argc > 2 )
 		{
-			if( argc != 2 )
-			{
-				printf("usage: rm path\n");
-				continue;
-			}
+			fprintf(out, "usage: dedup [on|off]\n");
+			return 0;
+		}
+
+		sfs_dedup_r(mp, argv[1]);
+		return 0;
+	}
 
-			sfs_rm(argv[1]);	
-			continue;	
+	if( !strcmp(argv[0], "touch") )
+	{
+		if( argc < 2 )
+		{
+			fprintf(out, "usage: touch path...\n");
+			return 0;
 		}
 
-		if( !strcmp(argv[0], "mv") )
+		sfs_touchv_r(mp, argc - 1, &argv[1]);
+		return 0;
+	}
+
+
+	if( !strcmp(argv[0], "mkdir") )
+	{
+		if( argc < 2 )
 		{
-			if( argc != 3 )
-			{
-				printf("usage: mv src dst\n");
-				continue;
-			}
+			fprintf(out, "usage: mkdir directory...\n");
+			return 0;
+		}
+
+		sfs_mkdirv_r(mp, argc - 1, &argv[1]);
+		return 0;
+	}
 
-			sfs_mv(argv[1], argv[2]);
-			continue;
+	if( !strcmp(argv[0], "rmdir") )
+	{
+		if( argc != 2 )
+		{
+			fprintf(out, "usage: rmdir directory\n");
+			return 0;
 		}
 
-		if( !strcmp(argv[0], "cpin") )
+		sfs_rmdir_r(mp, argv[1]);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "rm") )
+	{
+		int flags = 0, a = 1;
+
+		if( argc > 1 && !strcmp(argv[1], "-r") )
+		{
+			flags |= SFS_RM_RECURSIVE;
+			a++;
+		}
+		if( argc - a < 1 )
 		{
-			if( argc != 3 )
-			{
-				printf("usage: copyin local-file file(source)\n");
-				continue;
-			}
+			fprintf(out, "usage: rm [-r] path|pattern...\n");
+			return 0;
+		}
 
-			sfs_cpin(argv[1], argv[2]);
-			continue;
+		sfs_rmv_flags_r(mp, argc - a, &argv[a], flags);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "mv") )
+	{
+		if( argc != 3 )
+		{
+			fprintf(out, "usage: mv src dst\n");
+			return 0;
 		}
 
-		if( !strcmp(argv[0], "cpout") )
+		sfs_mv_r(mp, argv[1], argv[2]);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "cp") )
+	{
+		if( argc != 3 )
 		{
-			if( argc != 3 )
-			{
-				printf("usage: copyout local-file(source) file\n");
-				continue;
-			}
+			fprintf(out, "usage: cp src dst\n");
+			return 0;
+		}
+
+		sfs_cp_r(mp, argv[1], argv[2]);
+		return 0;
+	}
 
-			sfs_cpout(argv[1], argv[2]);
-			continue;
+	if( !strcmp(argv[0], "cpin") )
+	{
+		int flags = 0, a = 1;
+
+		for( ; a < argc && argv[a][0] == '-'; a++ )
+		{
+			if( !strcmp(argv[a], "-z") )
+				flags |= SFS_CPIN_COMPRESS;
+			else if( !strcmp(argv[a], "-u") )
+				flags |= SFS_CPIN_UPDATE;
+			else
+				break;
+		}
+		if( argc - a != 2 )
+		{
+			fprintf(out, "usage: copyin [-z] [-u] local-file file(source)\n");
+			return 0;
 		}
 
-		if( !strcmp(argv[0], "exit") )
+		sfs_cpin_flags_r(mp, argv[a], argv[a+1], flags);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "cpout") )
+	{
+		if( argc != 3 )
 		{
-			printf("bye\n");
+			fprintf(out, "usage: copyout local-file(source) file\n");
 			return 0;
 		}
 
-		if( !strcmp(argv[0], "fsck") )
+		sfs_cpout_r(mp, argv[1], argv[2]);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "cat") )
+	{
+		if( argc != 2 )
 		{
-			sfs_fsck();
-			continue;
+			fprintf(out, "usage: cat file\n");
+			return 0;
 		}
 
-		if( !strcmp(argv[0], "bitmap") )
+		sfs_cat_r(mp, argv[1]);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "append") )
+	{
+		char text[1024];
+		int a;
+
+		if( argc < 2 )
 		{
-			sfs_bitmap();
-			continue;
+			fprintf(out, "usage: append file [text...]\n");
+			return 0;
 		}
-/*
-		if( !strcmp(argv[0], "fixdir") )
+
+		text[0] = '\0';
+		for( a = 2; a < argc; a++ )
 		{
-			sfs_fixdir();
-			continue;
+			if( a > 2 )
+				strcat(text, " ");
+			strcat(text, argv[a]);
 		}
+		sfs_append_r(mp, argv[1], text);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "truncate") )
+	{
+		char *end;
+		long size;
 
-		if( !strcmp(argv[0], "fixfiles") )
+		if( argc != 3 )
 		{
-			sfs_fixfiles();
-			continue;
+			fprintf(out, "usage: truncate file size\n");
+			return 0;
 		}
 
-		if( !strcmp(argv[0], "test") )
+		errno = 0;
+		size = strtol(argv[2], &end, 10);
+		if( end == argv[2] || *end != '\0' || size < 0 )
 		{
-			if(	argc != 2 )
-			{
-				printf("usage: test argv\n");
-				continue;
-			}
+			fprintf(out, "truncate: %s: Invalid argument\n", argv[2]);
+			return 0;
+		}
+		if( errno == ERANGE || size > SFS_MAXFILESIZE )
+		{
+			fprintf(out, "truncate: %s: exceeds the max file size (%d bytes)\n", argv[2], SFS_MAXFILESIZE);
+			return 0;
+		}
+
+		sfs_truncate_r(mp, argv[1], (int)size);
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "exit") )
+	{
+		fprintf(out, "bye\n");
+		return 1;
+	}
+
+	if( !strcmp(argv[0], "fsck") )
+	{
+		sfs_fsck_r(mp);
+		return 0;
+	}
 
-			sfs_test(argv[1]);
-			continue;
+	if( !strcmp(argv[0], "bitmap") )
+	{
+		sfs_bitmap_r(mp);
+		return 0;
+	}
+/*
+	if( !strcmp(argv[0], "fixdir") )
+	{
+		sfs_fixdir();
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "fixfiles") )
+	{
+		sfs_fixfiles();
+		return 0;
+	}
+
+	if( !strcmp(argv[0], "test") )
+	{
+		if(	argc != 2 )
+		{
+			fprintf(out, "usage: test argv\n");
+			return 0;
 		}
+
+		sfs_test(argv[1]);
+		return 0;
+	}
 */
-		printf("%s command not found\n", argv[0]);
+	fprintf(out, "%s command not found\n", argv[0]);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	char buf[1024];
+	struct sfs_mnt *mp;
+
+	// server mode: sfs -s socket [disk_img ...]
+	if( argc >= 3 && !strcmp(argv[1], "-s") )
+	{
+		sfs_serve(argv[2], argc - 3, &argv[3]);
+		return 0;
+	}
+	if( argc != 1 )
+	{
+		fprintf(stderr, "usage: %s [-s socket [disk_img ...]]\n", argv[0]);
+		return 1;
+	}
+
+	mp = sfs_mnt_alloc();
+
+	printf("OS SFS shell\n");
+
+	while(! feof(stdin))
+	{
+		printf("os_shell> ");
+
+		fgets( buf, sizeof(buf), stdin);
+
+		if( sfs_command(mp, stdout, buf) )
+			return 0;
 	}
 
 	return 0;
@@ -0,0 +1,161 @@
+// SFS server: keeps images mounted for many local clients
+//
+// Protocol: the client sends shell command lines ("ls\n", "cpin a b\n")
+// and may send many before reading any reply. Each line gets its output
+// followed by a NUL byte, in order. Every connection is a session with
+// its own handle, so mount and cwd are per client; "exit" ends it.
+// Host paths (images, cpin/cpout files) are opened by the server, so
+// clients should send absolute paths.
+//
+// Images stay mounted (and warm) in the server once mounted: the ones
+// named on the command line, and any a client mounts later.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sfs_func.h"
+#include "sfs_server.h"
+
+#define DELIMS " \t\r\n"
+#define MAX_PINNED 64
+
+/* one handle kept per image so it stays mounted between clients */
+static struct {
+	char *path;
+	struct sfs_mnt *mp;
+} pinned[MAX_PINNED];
+static int npinned;
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static FILE *devnull;
+static const char *listen_path;
+
+/* keep path mounted, with flags (SFS_MOUNT_RDONLY or 0); kept only if it mounts */
+static void pin(const char *path, int flags)
+{
+	struct sfs_mnt *mp;
+	int i;
+
+	pthread_mutex_lock(&pin_lock);
+	for (i=0; i<npinned; i++){
+		if (!strcmp(pinned[i].path, path))
+			break;
+	}
+	if (i == npinned && npinned < MAX_PINNED){
+		mp = sfs_mnt_alloc();
+		sfs_mnt_setout(mp, devnull);
+		sfs_mount_flags_r(mp, path, NULL, flags);	// attaches if already mounted
+		if (sfs_mnt_mounted(mp)){
+			pinned[i].path = strdup(path);
+			pinned[i].mp = mp;
+			npinned++;
+		} else
+			sfs_mnt_free(mp);
+	}
+	pthread_mutex_unlock(&pin_lock);
+}
+
+static void *session(void *arg)
+{
+	int fd = (int)(long)arg;
+	FILE *in = fdopen(fd, "r");
+	FILE *out = fdopen(dup(fd), "w");
+	char buf[1024], cmd[8];
+	const char *img;
+	struct sfs_mnt *mp;
+	int done = 0, mount, flags;
+
+	if (in == NULL || out == NULL){
+		warn("fdopen");
+		close(fd);
+		return NULL;
+	}
+
+	mp = sfs_mnt_alloc();
+	sfs_mnt_setout(mp, out);
+
+	while (!done && fgets(buf, sizeof(buf), in) != NULL){
+		// strtok takes the line apart
+		mount = sscanf(buf, " %7s", cmd) == 1 && !strcmp(cmd, "mount");
+
+		done = sfs_command(mp, out, buf);
+		if (mount && (img = sfs_mnt_image(mp, &flags)) != NULL)
+			pin(img, flags);
+
+		fputc('\0', out);	// end of this reply
+		if (fflush(out) == EOF)
+			break;	// client went away
+	}
+
+	sfs_mnt_setout(mp, devnull);
+	sfs_mnt_free(mp);
+	fclose(out);
+	fclose(in);
+	return NULL;
+}
+
+static void terminate(int sig)
+{
+	unlink(listen_path);
+	_exit(0);
+}
+
+void sfs_serve(const char *sockpath, int nimg, char *imgs[])
+{
+	struct sockaddr_un sun;
+	pthread_t tid;
+	int lfd, cfd, i;
+
+	devnull = fopen("/dev/null", "w");
+	if (devnull == NULL)
+		err(1, "/dev/null");
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(sockpath) >= sizeof(sun.sun_path))
+		errx(1, "%s: socket path too long", sockpath);
+	strcpy(sun.sun_path, sockpath);
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0)
+		err(1, "socket");
+	unlink(sockpath);
+	if (bind(lfd, (struct sockaddr*)&sun, sizeof(sun)) < 0)
+		err(1, "%s", sockpath);
+	if (listen(lfd, 64) < 0)
+		err(1, "listen");
+
+	listen_path = sockpath;
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, terminate);
+	signal(SIGTERM, terminate);
+
+	for (i=0; i<nimg; i++){
+		pin(imgs[i], 0);
+	}
+	printf("SFS server on %s, %d image(s) mounted\n", sockpath, npinned);
+	fflush(stdout);
+
+	for (;;){
+		cfd = accept(lfd, NULL, NULL);
+		if (cfd < 0){
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		if (pthread_create(&tid, NULL, session, (void*)(long)cfd)){
+			warnx("can't start session");
+			close(cfd);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+}
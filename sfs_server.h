@@ -0,0 +1,17 @@
+#ifndef _SFS_SERVER_H_
+#define _SFS_SERVER_H_
+
+/*
+ * Shell command interpreter (sfs_main.c).
+ * Returns 1 on exit, 0 otherwise.
+ */
+int sfs_command(struct sfs_mnt *mp, FILE *out, char *buf);
+
+/*
+ * Serve the shell's command language on a Unix-domain socket,
+ * keeping the given images (and any image a client mounts) mounted.
+ * Does not return.
+ */
+void sfs_serve(const char *sockpath, int nimg, char *imgs[]);
+
+#endif /*_SFS_SERVER_H_*/